@@ -0,0 +1,158 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "badfiles.h"
+#include "recordio.h"
+#include "threadpool.h"
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+	//bump the trailing digit if the format changes
+	const char MAGIC[] = "RSBAD1\n";
+	const size_t MAGIC_LEN = sizeof(MAGIC) - 1;
+}
+
+bool ratesync::BadFiles::signature_t::operator==(const signature_t& other) const {
+	return ino == other.ino && size == other.size &&
+		mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec &&
+		ctime_sec == other.ctime_sec && ctime_nsec == other.ctime_nsec;
+}
+
+ratesync::BadFiles::signature_t ratesync::BadFiles::signature(const struct stat& sb) {
+	signature_t sig;
+	sig.ino = sb.st_ino;
+	sig.size = sb.st_size;
+	sig.mtime_sec = sb.st_mtim.tv_sec;
+	sig.mtime_nsec = sb.st_mtim.tv_nsec;
+	sig.ctime_sec = sb.st_ctim.tv_sec;
+	sig.ctime_nsec = sb.st_ctim.tv_nsec;
+	return sig;
+}
+
+ratesync::BadFiles::BadFiles(const std::string& path, bool retry)
+	: path(path), retry(retry), skipped(0), changed(false) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ratesync::BadFiles::~BadFiles() {
+	pthread_mutex_destroy(&mutex);
+}
+
+bool ratesync::BadFiles::Load() {
+	if (retry) {
+		changed = true;//rewrite the list with just this run's failures
+		return true;
+	}
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == NULL) {
+		return errno == ENOENT;
+	}
+	char magic[MAGIC_LEN];
+	unsigned long long count;
+	bool ok = fread(magic, 1, MAGIC_LEN, f) == MAGIC_LEN &&
+		memcmp(magic, MAGIC, MAGIC_LEN) == 0 &&
+		record::read_uint(f, count);
+	for (unsigned long long i = 0; ok && i < count; ++i) {
+		std::string file;
+		signature_t sig;
+		ok = record::read_string(f, file) &&
+			record::read_uint(f, sig.ino) && record::read_uint(f, sig.size) &&
+			record::read_uint(f, sig.mtime_sec) && record::read_uint(f, sig.mtime_nsec) &&
+			record::read_uint(f, sig.ctime_sec) && record::read_uint(f, sig.ctime_nsec);
+		if (ok) {
+			files[file] = sig;
+		}
+	}
+	fclose(f);
+	if (!ok) {
+		//only a cache: start over
+		config::error("Ignoring unreadable bad file list %s", path.c_str());
+		files.clear();
+		changed = true;
+	}
+	return true;
+}
+
+bool ratesync::BadFiles::Save() {
+	if (!changed) {
+		return true;
+	}
+	const std::string tmp_path = path + ".tmp";
+	record::make_parents(path);
+	FILE* f = fopen(tmp_path.c_str(), "wb");
+	if (f == NULL) {
+		config::error("Unable to create bad file list %s", tmp_path.c_str());
+		return false;
+	}
+	Lock lock(mutex);
+	//forget files that were since deleted (or renamed)
+	struct stat sb;
+	for (std::map<std::string, signature_t>::iterator it = files.begin(); it != files.end(); ) {
+		if (lstat(it->first.c_str(), &sb) != 0 && errno == ENOENT) {
+			files.erase(it++);
+		} else {
+			++it;
+		}
+	}
+	bool ok = fwrite(MAGIC, 1, MAGIC_LEN, f) == MAGIC_LEN &&
+		record::write_uint(f, files.size());
+	for (std::map<std::string, signature_t>::const_iterator
+			 it = files.begin(); ok && it != files.end(); ++it) {
+		const signature_t& sig = it->second;
+		ok = record::write_string(f, it->first) &&
+			record::write_uint(f, sig.ino) && record::write_uint(f, sig.size) &&
+			record::write_uint(f, sig.mtime_sec) && record::write_uint(f, sig.mtime_nsec) &&
+			record::write_uint(f, sig.ctime_sec) && record::write_uint(f, sig.ctime_nsec);
+	}
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		config::error("Unable to write bad file list %s", path.c_str());
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	changed = false;
+	return true;
+}
+
+bool ratesync::BadFiles::Skip(const std::string& file, const struct stat& sb) {
+	Lock lock(mutex);
+	std::map<std::string, signature_t>::iterator it = files.find(file);
+	if (it == files.end()) {
+		return false;
+	}
+	if (!(it->second == signature(sb))) {
+		//changed since, give it another try
+		files.erase(it);
+		changed = true;
+		return false;
+	}
+	config::debug("SKIP %s (failed before)", file.c_str());
+	++skipped;
+	return true;
+}
+
+void ratesync::BadFiles::Add(const std::string& file, const struct stat& sb) {
+	Lock lock(mutex);
+	files[file] = signature(sb);
+	changed = true;
+}
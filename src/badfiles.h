@@ -0,0 +1,70 @@
+#ifndef RATESYNC_BADFILES_H
+#define RATESYNC_BADFILES_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+#include <string>
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+namespace ratesync {
+	//Files that couldn't be read, kept across runs so that later scans
+	//skip them until they change (going by inode, size, mtime and ctime,
+	//so that a chmod counts too). May be used from several threads.
+	class BadFiles {
+	public:
+		//Without 'retry', files listed in 'path' are skipped. With it,
+		//they're read again and the list starts over.
+		BadFiles(const std::string& path, bool retry);
+		~BadFiles();
+
+		//Reads the list, if there is one yet.
+		bool Load();
+		//Writes the list back, if it changed.
+		bool Save();
+
+		//Whether 'file' failed before and hasn't changed since.
+		bool Skip(const std::string& file, const struct stat& sb);
+		//Records that 'file' couldn't be read.
+		void Add(const std::string& file, const struct stat& sb);
+
+		size_t Skipped() const { return skipped; }
+		const std::string& Path() const { return path; }
+
+	private:
+		BadFiles(const BadFiles&);//disallow copy
+
+		struct signature_t {
+			unsigned long long ino, size, mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+			bool operator==(const signature_t& other) const;
+		};
+		static signature_t signature(const struct stat& sb);
+
+		const std::string path;
+		const bool retry;
+		pthread_mutex_t mutex;
+		std::map<std::string, signature_t> files;
+		size_t skipped;
+		bool changed;
+	};
+}
+
+#endif
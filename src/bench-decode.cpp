@@ -0,0 +1,247 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+//Times the rating decoders in rating-decode.h against the stream-based
+//parsing they replaced, and the per-file decoders in tag-rating.h on
+//typical tags, counting the heap allocations each one makes. Fails if
+//reading a rating from a tag allocates at all:
+//  bench-decode [iterations]
+
+#include <new>
+#include <sstream>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <taglib/taglib.h>
+#include <taglib/id3v2tag.h>
+#include <taglib/popularimeterframe.h>
+#include <taglib/xiphcomment.h>
+#include <taglib/mp4tag.h>
+#include <taglib/apetag.h>
+
+#include "rating-decode.h"
+#include "tag-rating.h"
+
+namespace {
+	//allocations made through operator new, see below
+	size_t allocs = 0;
+
+	const char* const INTS[] = { "1", "2", "3", "4", "5", " 3 ", "100" };
+	const char* const DECIMALS[] = { "0.2", "0.4", "0.6", "0.8", "1.0", "0.25", "1" };
+	const size_t VALUES = sizeof(INTS) / sizeof(INTS[0]);
+
+	double now() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.;
+	}
+
+	//Each case decodes 'iterations' values and returns a sum of them, so
+	//that the work can't be optimized away.
+	typedef long (*bench_fn)(size_t iterations);
+
+	long int_decode(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			int val = 0;
+			ratesync::decode::parse_int(ratesync::decode::CStr(INTS[i % VALUES]), val);
+			sum += val;
+		}
+		return sum;
+	}
+	long int_stream(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			int val = 0;
+			std::istringstream stream(INTS[i % VALUES]);
+			stream >> val;
+			sum += val;
+		}
+		return sum;
+	}
+
+	long milli_decode(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			int val = 0;
+			ratesync::decode::parse_milli(ratesync::decode::CStr(DECIMALS[i % VALUES]), val);
+			sum += val;
+		}
+		return sum;
+	}
+	long milli_stream(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			float val = 0;
+			std::istringstream stream(DECIMALS[i % VALUES]);
+			stream >> val;
+			sum += (long)(val * 1000 + 0.5);
+		}
+		return sum;
+	}
+
+	long format_decode(size_t iterations) {
+		long sum = 0;
+		char buf[12];
+		for (size_t i = 0; i < iterations; ++i) {
+			sum += ratesync::decode::format_int((int)(i % 7) - 1, buf)[0];
+		}
+		return sum;
+	}
+	long format_stream(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			std::ostringstream stream;
+			stream << (int)(i % 7) - 1;
+			sum += stream.str()[0];
+		}
+		return sum;
+	}
+
+	//tags as a tagger would leave them: a few other fields besides the
+	//rating, built once by make_tags()
+	TagLib::Ogg::XiphComment* xiph = NULL;
+	TagLib::ID3v2::Tag* id3v2 = NULL;
+	TagLib::APE::Tag* ape = NULL;
+	TagLib::MP4::Tag* mp4 = NULL;
+
+	void make_tags() {
+		xiph = new TagLib::Ogg::XiphComment;
+		xiph->addField("TITLE", "Some Song");
+		xiph->addField("ARTIST", "Some Artist");
+		xiph->addField("ALBUM", "Some Album");
+		xiph->addField("TRACKNUMBER", "7");
+		xiph->addField("FMPS_RATING", "0.8");
+
+		id3v2 = new TagLib::ID3v2::Tag;
+		TagLib::ID3v2::PopularimeterFrame* other = new TagLib::ID3v2::PopularimeterFrame;
+		other->setEmail("someone@example.com");
+		other->setRating(64);
+		id3v2->addFrame(other);
+		TagLib::ID3v2::PopularimeterFrame* wmp = new TagLib::ID3v2::PopularimeterFrame;
+		wmp->setEmail("Windows Media Player 9 Series");
+		wmp->setRating(196);
+		id3v2->addFrame(wmp);
+
+		ape = new TagLib::APE::Tag;
+		ape->addValue("TITLE", "Some Song");
+		ape->addValue("ARTIST", "Some Artist");
+		ape->addValue("ALBUM", "Some Album");
+		ape->addValue("RATING", "80");
+
+		mp4 = new TagLib::MP4::Tag;
+		TagLib::StringList title, rating;
+		title.append("Some Song");
+		rating.append("0.8");
+		mp4->setItem("\251nam", TagLib::MP4::Item(title));
+		mp4->setItem("tmpo", TagLib::MP4::Item(120));
+		mp4->setItem("rate", TagLib::MP4::Item(80));
+		mp4->setItem("----:com.apple.iTunes:FMPS_Rating", TagLib::MP4::Item(rating));
+	}
+
+	long xiph_decode(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			ratesync::rating_t rating = 0;
+			ratesync::decode::xiph_rating(xiph, rating);
+			sum += rating;
+		}
+		return sum;
+	}
+	long id3v2_decode(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			ratesync::rating_t rating = 0;
+			ratesync::decode::id3v2_rating(id3v2, rating);
+			sum += rating;
+		}
+		return sum;
+	}
+	long ape_decode(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			ratesync::rating_t rating = 0;
+			ratesync::decode::ape_rating(ape, rating);
+			sum += rating;
+		}
+		return sum;
+	}
+	long mp4_decode(size_t iterations) {
+		long sum = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			ratesync::rating_t rating = 0;
+			ratesync::decode::mp4_rating(mp4, rating);
+			sum += rating;
+		}
+		return sum;
+	}
+
+	//Returns the allocations made per op.
+	double run(const char* name, bench_fn fn, size_t iterations) {
+		const size_t allocs_before = allocs;
+		const double start = now();
+		const long sum = fn(iterations);
+		const double secs = now() - start;
+		const double per_op = (double)(allocs - allocs_before) / iterations;
+		printf("%-14s %8.1f ns/op %8.2f allocs/op  (sum %ld)\n", name,
+			   secs * 1e9 / iterations, per_op, sum);
+		return per_op;
+	}
+}
+
+//counts every allocation in the process, which is only ever this thread
+void* operator new(size_t size) {
+	++allocs;
+	void* ptr = malloc(size ? size : 1);
+	if (ptr == NULL) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+void operator delete(void* ptr) throw() {
+	free(ptr);
+}
+
+int main(int argc, char* argv[]) {
+	size_t iterations = 1000000;
+	if (argc > 2 || (argc == 2 && (iterations = strtoul(argv[1], NULL, 10)) == 0)) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	run("parse_int", int_decode, iterations);
+	run("  istream int", int_stream, iterations);
+	run("parse_milli", milli_decode, iterations);
+	run("  istream float", milli_stream, iterations);
+	run("format_int", format_decode, iterations);
+	run("  ostream int", format_stream, iterations);
+
+	make_tags();
+	double tag_allocs = run("xiph_rating", xiph_decode, iterations);
+	tag_allocs += run("id3v2_rating", id3v2_decode, iterations);
+	tag_allocs += run("ape_rating", ape_decode, iterations);
+	tag_allocs += run("mp4_rating", mp4_decode, iterations);
+	if (tag_allocs > 0) {
+		fprintf(stderr, "Reading ratings from tags allocated, see above\n");
+		return 1;
+	}
+	return 0;
+}
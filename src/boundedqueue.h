@@ -0,0 +1,222 @@
+#ifndef RATESYNC_BOUNDEDQUEUE_H
+#define RATESYNC_BOUNDEDQUEUE_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sched.h>
+
+namespace ratesync {
+	//Fixed-size multi-producer/multi-consumer queue without locks (after
+	//Dmitry Vyukov's bounded MPMC queue): each slot carries a sequence
+	//number saying whether it's ready to be written or read on the current
+	//lap around the ring, so that a push or pop is a single CAS on the
+	//tail/head. Push() and Pop() spin and then yield while the queue is
+	//full/empty, and then block until the other side signals them.
+	template <typename T>
+	class BoundedQueue {
+	public:
+		//'capacity' is rounded up to a power of two.
+		BoundedQueue(size_t capacity)
+			: head(0), tail(0), closed(false), push_waiters(0), pop_waiters(0) {
+			size_t size = 2;
+			while (size < capacity) {
+				size *= 2;
+			}
+			mask = size - 1;
+			slots = new slot_t[size];
+			for (size_t i = 0; i < size; ++i) {
+				slots[i].seq = i;
+			}
+			pthread_mutex_init(&mutex, NULL);
+			pthread_cond_init(&not_full, NULL);
+			pthread_cond_init(&not_empty, NULL);
+		}
+		~BoundedQueue() {
+			pthread_cond_destroy(&not_empty);
+			pthread_cond_destroy(&not_full);
+			pthread_mutex_destroy(&mutex);
+			delete[] slots;
+		}
+
+		//Returns false if the queue is full.
+		bool TryPush(const T& val) {
+			size_t pos = load(tail);
+			slot_t* slot;
+			for (;;) {
+				slot = &slots[pos & mask];
+				ptrdiff_t diff = (ptrdiff_t)load(slot->seq) - (ptrdiff_t)pos;
+				if (diff == 0) {
+					if (__sync_bool_compare_and_swap(&tail, pos, pos + 1)) {
+						break;
+					}
+					pos = load(tail);
+				} else if (diff < 0) {
+					return false;//a lap behind: full
+				} else {
+					pos = load(tail);//another producer got here first
+				}
+			}
+			slot->val = val;
+			__sync_synchronize();
+			slot->seq = pos + 1;
+			return true;
+		}
+
+		//Returns false if the queue is empty.
+		bool TryPop(T& out) {
+			size_t pos = load(head);
+			slot_t* slot;
+			for (;;) {
+				slot = &slots[pos & mask];
+				ptrdiff_t diff = (ptrdiff_t)load(slot->seq) - (ptrdiff_t)(pos + 1);
+				if (diff == 0) {
+					if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) {
+						break;
+					}
+					pos = load(head);
+				} else if (diff < 0) {
+					return false;//not written yet: empty
+				} else {
+					pos = load(head);
+				}
+			}
+			out = slot->val;
+			slot->val = T();//don't hold on to the value's memory
+			__sync_synchronize();
+			slot->seq = pos + mask + 1;
+			return true;
+		}
+
+		//Waits while the queue is full.
+		void Push(const T& val) {
+			for (unsigned tries = 0; !TryPush(val); ++tries) {
+				if (tries < BLOCK_TRIES) {
+					backoff(tries);
+					continue;
+				}
+				//a long wait: sleep until a Pop makes room
+				pthread_mutex_lock(&mutex);
+				__sync_fetch_and_add(&push_waiters, 1);
+				while (!TryPush(val)) {
+					pthread_cond_wait(&not_full, &mutex);
+				}
+				__sync_fetch_and_sub(&push_waiters, 1);
+				pthread_mutex_unlock(&mutex);
+				break;
+			}
+			wake(pop_waiters, not_empty);
+		}
+
+		//Waits while the queue is empty. Returns false once the queue is
+		//empty and Close()d.
+		bool Pop(T& out) {
+			bool ok = true;
+			for (unsigned tries = 0; !TryPop(out); ++tries) {
+				if (load(closed)) {
+					ok = TryPop(out);//may have been pushed just before
+					break;
+				}
+				if (tries < BLOCK_TRIES) {
+					backoff(tries);
+					continue;
+				}
+				//a long wait: sleep until a Push or Close
+				pthread_mutex_lock(&mutex);
+				__sync_fetch_and_add(&pop_waiters, 1);
+				while (!(ok = TryPop(out)) && !closed) {
+					pthread_cond_wait(&not_empty, &mutex);
+				}
+				if (!ok) {
+					ok = TryPop(out);
+				}
+				__sync_fetch_and_sub(&pop_waiters, 1);
+				pthread_mutex_unlock(&mutex);
+				break;
+			}
+			if (ok) {
+				wake(push_waiters, not_full);
+			}
+			return ok;
+		}
+
+		//Called by the producers once they're done pushing.
+		void Close() {
+			__sync_synchronize();
+			pthread_mutex_lock(&mutex);
+			closed = true;
+			pthread_cond_broadcast(&not_empty);
+			pthread_mutex_unlock(&mutex);
+		}
+
+	private:
+		BoundedQueue(const BoundedQueue&);//disallow copy
+
+		struct slot_t {
+			volatile size_t seq;
+			T val;
+		};
+
+		template <typename V>
+		static V load(const volatile V& var) {
+			V val = var;
+			__sync_synchronize();
+			return val;
+		}
+
+		//Spins briefly, then yields, before blocking after BLOCK_TRIES:
+		//waits are either very short (a slot being handed over) or as long
+		//as a file read.
+		static const unsigned BLOCK_TRIES = 64;
+		static void backoff(unsigned tries) {
+			if (tries >= 16) {
+				sched_yield();
+			}
+		}
+
+		//Wakes a thread blocked on 'cond', if 'waiters' says there's one.
+		//The fence orders the slot just handed over before the check, so
+		//that a waiter either sees the slot or is signalled.
+		void wake(volatile unsigned& waiters, pthread_cond_t& cond) {
+			__sync_synchronize();
+			if (load(waiters) > 0) {
+				pthread_mutex_lock(&mutex);
+				pthread_cond_signal(&cond);
+				pthread_mutex_unlock(&mutex);
+			}
+		}
+
+		slot_t* slots;
+		size_t mask;
+		//on separate cache lines, so producers and consumers don't contend
+		char pad0[64];
+		volatile size_t head;
+		char pad1[64];
+		volatile size_t tail;
+		char pad2[64];
+		volatile bool closed;
+		//threads blocked in Push/Pop, only touched on the slow path
+		volatile unsigned push_waiters, pop_waiters;
+		pthread_mutex_t mutex;
+		pthread_cond_t not_full, not_empty;
+	};
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "changeset.h"
+#include "recordio.h"
+#include "config.h"
+
+namespace {
+	const size_t ENTRY_OVERHEAD = sizeof(ratesync::song_ratings_t) + 16;
+	const size_t SPILL_BUFFER_SIZE = 64 * 1024;
+}
+
+ratesync::ChangeSet::ChangeSet(size_t max_memory)
+	: max_memory(max_memory), used(0), count(0), pos(0), failed(false), file(NULL) { }
+
+ratesync::ChangeSet::~ChangeSet() {
+	if (file != NULL) {
+		fclose(file);
+	}
+}
+
+bool ratesync::ChangeSet::Add(const song_ratings_t& change) {
+	if (failed) {
+		return false;
+	}
+	++count;
+	if (file != NULL) {
+		if (!record::write_change(file, change)) {
+			config::error("Unable to spill changes, is the temp dir full?");
+			failed = true;
+		}
+		return !failed;
+	}
+	changes.push_back(change);
+	used += change.path.capacity() + ENTRY_OVERHEAD;
+	if (max_memory > 0 && used >= max_memory) {
+		return spill();
+	}
+	return true;
+}
+
+bool ratesync::ChangeSet::spill() {
+	file = record::temp_file();
+	if (file == NULL) {
+		failed = true;
+		return false;
+	}
+	setvbuf(file, NULL, _IOFBF, SPILL_BUFFER_SIZE);
+	for (std::vector<song_ratings_t>::const_iterator
+			 it = changes.begin(); it != changes.end(); ++it) {
+		if (!record::write_change(file, *it)) {
+			config::error("Unable to spill changes, is the temp dir full?");
+			failed = true;
+			return false;
+		}
+	}
+	config::debug("Spilled %d changes to disk", changes.size());
+	std::vector<song_ratings_t>().swap(changes);
+	return true;
+}
+
+bool ratesync::ChangeSet::Rewind() {
+	pos = 0;
+	if (file != NULL && (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0)) {
+		config::error("Unable to read back spilled changes");
+		failed = true;
+	}
+	return !failed;
+}
+
+bool ratesync::ChangeSet::Next(song_ratings_t& change) {
+	if (failed || pos >= count) {
+		return false;
+	}
+	if (file == NULL) {
+		change = changes[pos++];
+		return true;
+	}
+	if (!record::read_change(file, change)) {
+		config::error("Unable to read back spilled changes");
+		failed = true;
+		return false;
+	}
+	++pos;
+	return true;
+}
@@ -0,0 +1,57 @@
+#ifndef RATESYNC_CHANGESET_H
+#define RATESYNC_CHANGESET_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <vector>
+
+#include "song.h"
+
+namespace ratesync {
+	//An ordered list of rating changes. Kept in memory until it outgrows
+	//'max_memory' (0: never), after which it's spilled to a temp file.
+	class ChangeSet {
+	public:
+		ChangeSet(size_t max_memory = 0);
+		~ChangeSet();
+
+		bool Add(const song_ratings_t& change);
+		size_t Size() const { return count; }
+		bool Empty() const { return count == 0; }
+
+		//Iterates the changes in the order they were added. Returns false
+		//once they're exhausted or on error (see Failed).
+		bool Rewind();
+		bool Next(song_ratings_t& change);
+		bool Failed() const { return failed; }
+
+	private:
+		ChangeSet(const ChangeSet&);//disallow copy
+		bool spill();
+
+		const size_t max_memory;
+		size_t used, count, pos;
+		bool failed;
+		std::vector<song_ratings_t> changes;
+		FILE* file;
+	};
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "concurrency.h"
+#include "threadpool.h"
+#include "config.h"
+
+#include <unistd.h>
+#include <sys/time.h>
+
+namespace {
+	//completed ops per adjustment, at least
+	const size_t MIN_WINDOW = 16;
+	//throughput changes smaller than this are noise
+	const double MIN_GAIN = 1.05;
+	//latency past this many times the best means ops are queueing
+	const double MAX_LATENCY_GROWTH = 2.0;
+	//windows without a change before probing a higher limit again
+	const size_t MAX_HOLDS = 4;
+
+	double now() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.;
+	}
+}
+
+size_t ratesync::cpu_count() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? cpus : 1;
+}
+
+ratesync::ConcurrencyLimit::ConcurrencyLimit(size_t initial, size_t max, bool adaptive)
+	: max((max > 0) ? max : 1), adaptive(adaptive), running(0),
+	  window_start(0), window_latency(0), window_ops(0),
+	  last_throughput(0), best_latency(0), holds(0),
+	  first_start(0), limit_time(0), last_change(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&released, NULL);
+	if (!adaptive || initial > this->max) {
+		initial = this->max;
+	} else if (initial == 0) {
+		initial = 1;
+	}
+	limit = this->initial = peak = low = initial;
+}
+
+ratesync::ConcurrencyLimit::~ConcurrencyLimit() {
+	pthread_cond_destroy(&released);
+	pthread_mutex_destroy(&mutex);
+}
+
+double ratesync::ConcurrencyLimit::Acquire() {
+	Lock lock(mutex);
+	while (running >= limit) {
+		pthread_cond_wait(&released, &mutex);
+	}
+	++running;
+	double start = now();
+	if (first_start == 0) {
+		first_start = last_change = window_start = start;
+	}
+	return start;
+}
+
+void ratesync::ConcurrencyLimit::Release(double start, size_t ops) {
+	double end = now();
+	Lock lock(mutex);
+	--running;
+	if (adaptive && ops > 0) {
+		window_latency += end - start;
+		window_ops += ops;
+		if (window_ops >= MIN_WINDOW && window_ops >= limit * 2) {
+			adjust(end);
+		}
+	}
+	pthread_cond_broadcast(&released);
+}
+
+void ratesync::ConcurrencyLimit::adjust(double end) {
+	double elapsed = end - window_start;
+	if (elapsed <= 0) {
+		return;//too fast to tell, keep collecting
+	}
+	const double throughput = window_ops / elapsed,
+		latency = window_latency / window_ops;
+	if (best_latency == 0 || latency < best_latency) {
+		best_latency = latency;
+	}
+
+	size_t next = limit;
+	if (throughput > last_throughput * MIN_GAIN) {
+		next = limit + 1;
+		holds = 0;
+	} else if (latency > best_latency * MAX_LATENCY_GROWTH) {
+		next = limit - limit / 4;
+		if (next == limit) {
+			next = limit - 1;
+		}
+		holds = 0;
+	} else if (++holds >= MAX_HOLDS) {
+		next = limit + 1;//conditions may have changed, probe again
+		holds = 0;
+	}
+	if (next < 1) {
+		next = 1;
+	} else if (next > max) {
+		next = max;
+	}
+	if (next != limit) {
+		config::debug("concurrency %d -> %d (%.1f ops/s, %.1fms/op, best %.1fms/op)",
+					  limit, next, throughput, latency * 1000, best_latency * 1000);
+		limit_time += limit * (end - last_change);
+		last_change = end;
+		limit = next;
+		if (next > peak) {
+			peak = next;
+		} else if (next < low) {
+			low = next;
+		}
+	}
+
+	last_throughput = throughput;
+	window_start = end;
+	window_latency = 0;
+	window_ops = 0;
+}
+
+void ratesync::ConcurrencyLimit::Report(const char* what) const {
+	if (!adaptive || first_start == 0) {
+		return;
+	}
+	double end = now(), total = end - first_start;
+	double average = (total > 0) ? (limit_time + limit * (end - last_change)) / total : limit;
+	config::log("%s concurrency: started at %d, ended at %d (%d-%d, averaged %.1f)",
+				what, initial, limit, low, peak, average);
+}
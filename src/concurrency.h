@@ -0,0 +1,82 @@
+#ifndef RATESYNC_CONCURRENCY_H
+#define RATESYNC_CONCURRENCY_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+namespace ratesync {
+	//Online CPUs, a starting point for CPU-bound work.
+	size_t cpu_count();
+
+	//Limits how many operations run at once, and with 'adaptive' set keeps
+	//adjusting the limit to what the storage does best with: more when the
+	//ops are waiting on latency (eg opens over NFS), fewer when they're
+	//CPU-bound or the disk is saturated. Workers call Acquire() before an
+	//op and Release() after it.
+	//
+	//The limit is adjusted once per window of completed ops (AIMD): it
+	//grows by one while throughput keeps improving, and is cut by a
+	//quarter when per-op latency has grown well past the best seen without
+	//throughput improving, ie when the extra ops only queue up.
+	class ConcurrencyLimit {
+	public:
+		//Starts at 'initial' and stays within 1 to 'max'. Without
+		//'adaptive' the limit stays at 'max'.
+		ConcurrencyLimit(size_t initial, size_t max, bool adaptive);
+		~ConcurrencyLimit();
+
+		//Waits until fewer than Limit() ops are running, returns the start
+		//time to pass to Release().
+		double Acquire();
+		//Ends an op started at 'start', which handled 'ops' items.
+		void Release(double start, size_t ops = 1);
+
+		size_t Limit() const { return limit; }
+		size_t Max() const { return max; }
+
+		//Logs the levels that were used, for 'what' ("scan", ...).
+		void Report(const char* what) const;
+
+	private:
+		ConcurrencyLimit(const ConcurrencyLimit&);//disallow copy
+
+		void adjust(double now);
+
+		const size_t max;
+		const bool adaptive;
+		pthread_mutex_t mutex;
+		pthread_cond_t released;
+		volatile size_t limit;
+		size_t running, initial, peak, low;
+
+		//the current window
+		double window_start, window_latency;
+		size_t window_ops;
+		//previous windows
+		double last_throughput, best_latency;
+		size_t holds;
+		//for the average limit
+		double first_start, limit_time, last_change;
+	};
+}
+
+#endif
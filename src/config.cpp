@@ -24,6 +24,7 @@
 namespace ratesync {
 	namespace config {
 		bool debug_enabled = false;
+		bool nfc_enabled = false;
 
 		void debug(const char* format, ...) {
 			if (debug_enabled) {
@@ -20,6 +20,7 @@
 */
 
 #cmakedefine USE_MPDCLIENT
+#cmakedefine USE_ICU
 
 namespace ratesync {
 	namespace config {
@@ -36,6 +37,8 @@ namespace ratesync {
 		static const char* BUILD_DATE = __TIMESTAMP__;
 
 		extern bool debug_enabled;
+		//whether song keys are Unicode NFC-normalized (requires USE_ICU)
+		extern bool nfc_enabled;
 
 		void debug(const char* format, ...);
 		void debugnn(const char* format, ...);
@@ -0,0 +1,210 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "extsort.h"
+#include "recordio.h"
+#include "config.h"
+
+#include <algorithm>
+
+namespace {
+	//rough per-entry cost of a buffered song besides the path itself: a
+	//map node with its tree links and malloc overhead
+	const size_t ENTRY_OVERHEAD = sizeof(std::pair<ratesync::song_t, ratesync::rating_t>) + 48;
+	const size_t RUN_BUFFER_SIZE = 64 * 1024;
+	//runs merged at once, which bounds the open files to this many per
+	//level (a level holds this many times more songs than the one below)
+	const size_t MAX_FAN_IN = 32;
+}
+
+ratesync::RunWriter::RunWriter(size_t max_memory)
+	: max_memory(max_memory), used(0), failed(false) { }
+
+ratesync::RunWriter::~RunWriter() {
+	for (std::vector<FILE*>::iterator it = runs.begin(); it != runs.end(); ++it) {
+		fclose(*it);
+	}
+}
+
+bool ratesync::RunWriter::Put(const song_t& song, rating_t rating) {
+	if (!buffer.insert(std::make_pair(song, rating)).second) {
+		return false;//like MapOutput, the first one is kept
+	}
+	used += song.capacity() + ENTRY_OVERHEAD;
+	if (used >= max_memory) {
+		return flush();
+	}
+	return !failed;
+}
+
+bool ratesync::RunWriter::Finish() {
+	if (!buffer.empty() && !flush()) {
+		return false;
+	}
+	for (std::vector<FILE*>::iterator it = runs.begin(); it != runs.end(); ++it) {
+		if (fflush(*it) != 0 || fseek(*it, 0, SEEK_SET) != 0) {
+			config::error("Unable to finish writing sorted run");
+			failed = true;
+		}
+	}
+	return !failed;
+}
+
+bool ratesync::RunWriter::flush() {
+	if (failed) {
+		return false;
+	}
+
+	FILE* f = record::temp_file();
+	if (f == NULL) {
+		failed = true;
+		return false;
+	}
+	setvbuf(f, NULL, _IOFBF, RUN_BUFFER_SIZE);
+	runs.push_back(f);
+	levels.push_back(0);
+	record::songs_end_t end;
+	for (std::map<song_t, rating_t>::const_iterator
+			 it = buffer.begin(); it != buffer.end(); ++it) {
+		if (!record::write_song(f, it->first, it->second)) {
+			config::error("Unable to write sorted run, is the temp dir full?");
+			failed = true;
+			return false;
+		}
+		end.Add(it->first, it->second);
+	}
+	if (!record::write_songs_end(f, end)) {
+		config::error("Unable to write sorted run, is the temp dir full?");
+		failed = true;
+		return false;
+	}
+	config::debug("Wrote sorted run %d with %d songs", runs.size(), buffer.size());
+
+	buffer.clear();
+	used = 0;
+	return compact();
+}
+
+bool ratesync::RunWriter::compact() {
+	while (runs.size() >= MAX_FAN_IN &&
+		   levels[runs.size() - MAX_FAN_IN] == levels.back()) {
+		const size_t first = runs.size() - MAX_FAN_IN, level = levels.back();
+		std::vector<FILE*> merge(runs.begin() + first, runs.end());
+		for (std::vector<FILE*>::iterator it = merge.begin(); it != merge.end(); ++it) {
+			if (fflush(*it) != 0 || fseek(*it, 0, SEEK_SET) != 0) {
+				config::error("Unable to finish writing sorted run");
+				failed = true;
+				return false;
+			}
+		}
+
+		FILE* f = record::temp_file();
+		if (f == NULL) {
+			failed = true;
+			return false;
+		}
+		setvbuf(f, NULL, _IOFBF, RUN_BUFFER_SIZE);
+		RunMerger merger(merge);
+		song_t song;
+		rating_t rating;
+		record::songs_end_t end;
+		while (merger.Next(song, rating)) {
+			if (!record::write_song(f, song, rating)) {
+				config::error("Unable to write sorted run, is the temp dir full?");
+				failed = true;
+				break;
+			}
+			end.Add(song, rating);
+		}
+		failed = failed || merger.Failed();
+		if (!failed && !record::write_songs_end(f, end)) {
+			config::error("Unable to write sorted run, is the temp dir full?");
+			failed = true;
+		}
+
+		for (std::vector<FILE*>::iterator it = merge.begin(); it != merge.end(); ++it) {
+			fclose(*it);
+		}
+		runs.resize(first);
+		levels.resize(first);
+		runs.push_back(f);
+		levels.push_back(level + 1);
+		if (failed) {
+			return false;
+		}
+		config::debug("Merged %d sorted runs into one with %d songs", merge.size(), end.count);
+	}
+	return true;
+}
+
+ratesync::RunMerger::RunMerger(const std::vector<FILE*>& runs)
+	: runs(runs), heads(runs.size()), started(false), failed(false) { }
+
+bool ratesync::RunMerger::advance(head_t* head) {
+	FILE* f = runs[head->run];
+	if (record::read_song(f, head->song, head->rating)) {
+		head->read.Add(head->song, head->rating);
+		heap.push_back(head);
+		std::push_heap(heap.begin(), heap.end(), head_greater());
+		return true;
+	}
+	//only a complete file ends with the songs it holds
+	record::songs_end_t end;
+	if (ferror(f)) {
+		config::error("Unable to read sorted run");
+	} else if (feof(f) || !record::read_songs_end(f, end)) {
+		config::error("Sorted run or partial file was cut short after %d songs",
+					  head->read.count);
+	} else if (!(end == head->read)) {
+		config::error("Sorted run or partial file is corrupt: read %d songs, expected %d",
+					  head->read.count, end.count);
+	} else {
+		return false;
+	}
+	failed = true;
+	return false;
+}
+
+bool ratesync::RunMerger::Next(song_t& song, rating_t& rating) {
+	if (!started) {
+		started = true;
+		for (size_t i = 0; i < runs.size(); ++i) {
+			heads[i].run = i;
+			advance(&heads[i]);
+		}
+	}
+	while (!heap.empty() && !failed) {
+		std::pop_heap(heap.begin(), heap.end(), head_greater());
+		head_t* top = heap.back();
+		heap.pop_back();
+
+		bool dup = (!last.empty() && top->song == last);
+		if (!dup) {
+			last = top->song;
+			song = top->song;
+			rating = top->rating;
+		} else {
+			config::error("Duplicate entries for song %s, keeping the first", top->song.c_str());
+		}
+		advance(top);
+		if (!dup) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,103 @@
+#ifndef RATESYNC_EXTSORT_H
+#define RATESYNC_EXTSORT_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+
+#include "sink.h"
+#include "recordio.h"
+
+namespace ratesync {
+	//Buffers songs in memory, writing them out as a sorted run to a
+	//temporary file whenever the buffer reaches 'max_memory' bytes. Runs
+	//are merged into bigger ones as they pile up, so that only a few
+	//dozen files are open however small the budget. As with MapOutput,
+	//the first rating Put for a song is kept: Put returns false for later
+	//ones that are still buffered, and RunMerger drops those in later runs.
+	class RunWriter : public ISongOutput {
+	public:
+		RunWriter(size_t max_memory);
+		virtual ~RunWriter();
+
+		bool Put(const song_t& song, rating_t rating);
+
+		//Writes out any buffered songs. Call once all songs are Put.
+		bool Finish();
+
+		//The completed runs, each rewound to its start. Ownership stays
+		//with the RunWriter.
+		const std::vector<FILE*>& Runs() const { return runs; }
+
+	private:
+		RunWriter(const RunWriter&);//disallow copy
+		bool flush();
+		//Merges the runs at the last run's level into one at the next
+		//level, once there are enough of them.
+		bool compact();
+
+		const size_t max_memory;
+		size_t used;
+		bool failed;
+		std::map<song_t, rating_t> buffer;
+		//runs and how many merges each went through, fewest last
+		std::vector<FILE*> runs;
+		std::vector<size_t> levels;
+	};
+
+	//Reads a set of sorted runs back as one sorted stream (k-way merge).
+	//Songs found in more than one run are only returned once, from the
+	//first run that has them.
+	class RunMerger {
+	public:
+		RunMerger(const std::vector<FILE*>& runs);
+
+		//Returns false once all runs are exhausted, or on error (see Failed).
+		bool Next(song_t& song, rating_t& rating);
+		bool Failed() const { return failed; }
+
+	private:
+		struct head_t {
+			song_t song;
+			rating_t rating;
+			size_t run;
+			//what was read so far, to check against the end of the run
+			record::songs_end_t read;
+		};
+		//orders the heap so that the smallest song is on top, from the
+		//first run if there are several
+		struct head_greater {
+			bool operator()(const head_t* a, const head_t* b) const {
+				int cmp = a->song.compare(b->song);
+				return cmp > 0 || (cmp == 0 && a->run > b->run);
+			}
+		};
+		bool advance(head_t* head);
+
+		std::vector<FILE*> runs;
+		std::vector<head_t> heads;
+		std::vector<head_t*> heap;
+		song_t last;
+		bool started, failed;
+	};
+}
+
+#endif
@@ -0,0 +1,495 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//A stand-in for MPD, speaking just enough of the protocol for sink::Mpd
+//(lsinfo, listall, sticker get/set/delete/find, command lists, idle),
+//over a generated database. Each response can be delayed to mimic a
+//remote server, so that the MPD sink can be tried and timed offline:
+//  fake-mpd -s 400000 -l 2 &
+//  ratesync -m localhost:6601 -p songs.partial mpd
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "threadpool.h"
+
+using ratesync::config::error;
+using ratesync::config::log;
+using ratesync::config::debug;
+
+namespace {
+	//MPD's ACK codes
+	enum ACK {
+		ACK_ERROR_ARG = 2,
+		ACK_ERROR_UNKNOWN = 5,
+		ACK_ERROR_NO_EXIST = 50
+	};
+
+	struct options_t {
+		options_t() : port(6601), songs(10000), dirs(100),
+					  rated_percent(20), latency_ms(0), no_find(false) { }
+		unsigned port;
+		size_t songs, dirs, rated_percent;
+		double latency_ms;
+		bool no_find;//act like a server without 'sticker find'
+	};
+	options_t options;
+
+	//sorted song uris, fixed after startup
+	std::vector<std::string> songs;
+	//uri -> rating sticker value
+	std::map<std::string, std::string> stickers;
+	//bumped whenever a sticker changes, for idle
+	unsigned long sticker_version = 0;
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	void make_songs() {
+		char buf[64];
+		for (size_t i = 0; i < options.songs; ++i) {
+			snprintf(buf, sizeof(buf), "dir%04lu/album%03lu/song%07lu.mp3",
+					 (unsigned long)(i % options.dirs),
+					 (unsigned long)(i / options.dirs % 50), (unsigned long)i);
+			songs.push_back(buf);
+		}
+		std::sort(songs.begin(), songs.end());
+		for (size_t i = 0; i < songs.size(); ++i) {
+			if ((i * 7919) % 100 < options.rated_percent) {
+				snprintf(buf, sizeof(buf), "%lu", (unsigned long)(i % 5 + 1));
+				stickers[songs[i]] = buf;
+			}
+		}
+	}
+
+	bool is_song(const std::string& uri) {
+		return std::binary_search(songs.begin(), songs.end(), uri);
+	}
+
+	void sleep_ms(double ms) {
+		if (ms <= 0) {
+			return;
+		}
+		struct timespec ts;
+		ts.tv_sec = (time_t)(ms / 1000);
+		ts.tv_nsec = (long)((ms - ts.tv_sec * 1000) * 1000000);
+		nanosleep(&ts, NULL);
+	}
+
+	//Splits a command line into its words, undoing MPD's "quoting".
+	bool split(const std::string& line, std::vector<std::string>& words) {
+		size_t i = 0;
+		while (i < line.size()) {
+			if (line[i] == ' ' || line[i] == '\t') {
+				++i;
+				continue;
+			}
+			std::string word;
+			if (line[i] == '"') {
+				for (++i; i < line.size() && line[i] != '"'; ++i) {
+					if (line[i] == '\\' && i + 1 < line.size()) {
+						++i;
+					}
+					word += line[i];
+				}
+				if (i >= line.size()) {
+					return false;//unterminated
+				}
+				++i;
+			} else {
+				while (i < line.size() && line[i] != ' ' && line[i] != '\t') {
+					word += line[i++];
+				}
+			}
+			words.push_back(word);
+		}
+		return !words.empty();
+	}
+
+	class Client {
+	public:
+		Client(int fd, int id) : fd(fd), id(id), commands(0) { }
+
+		void Run() {
+			out = "OK MPD 0.23.0\n";
+			if (!flush()) {
+				return;
+			}
+			std::string line;
+			std::vector<std::string> list;
+			bool in_list = false, list_ok = false;
+			while (read_line(line)) {
+				std::vector<std::string> words;
+				if (!split(line, words)) {
+					ack(ACK_ERROR_ARG, 0, "", "incorrect arguments");
+				} else if (words[0] == "command_list_begin" ||
+						   words[0] == "command_list_ok_begin") {
+					in_list = true;
+					list_ok = (words[0] == "command_list_ok_begin");
+					list.clear();
+					continue;
+				} else if (in_list && words[0] == "command_list_end") {
+					in_list = false;
+					run_list(list, list_ok);
+				} else if (in_list) {
+					list.push_back(line);
+					continue;
+				} else if (words[0] == "close") {
+					break;
+				} else if (words[0] == "idle") {
+					if (!idle()) {
+						break;
+					}
+				} else if (run(words, 0)) {
+					out += "OK\n";
+				}
+				sleep_ms(options.latency_ms);
+				if (!flush()) {
+					break;
+				}
+			}
+			debug("client %d: %lu commands", id, (unsigned long)commands);
+			close(fd);
+		}
+
+	private:
+		bool read_line(std::string& line) {
+			size_t pos;
+			while ((pos = in.find('\n')) == std::string::npos) {
+				char buf[4096];
+				ssize_t n = read(fd, buf, sizeof(buf));
+				if (n <= 0) {
+					return false;
+				}
+				in.append(buf, n);
+			}
+			line.assign(in, 0, pos);
+			in.erase(0, pos + 1);
+			return true;
+		}
+
+		bool flush() {
+			size_t done = 0;
+			while (done < out.size()) {
+				ssize_t n = write(fd, out.data() + done, out.size() - done);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					return false;
+				}
+				done += n;
+			}
+			out.clear();
+			return true;
+		}
+
+		void ack(int code, size_t index, const std::string& cmd, const char* msg) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "ACK [%d@%lu] {", code, (unsigned long)index);
+			out += buf + cmd + "} " + msg + "\n";
+		}
+
+		void run_list(const std::vector<std::string>& list, bool list_ok) {
+			for (size_t i = 0; i < list.size(); ++i) {
+				std::vector<std::string> words;
+				split(list[i], words);
+				if (!run(words, i)) {
+					return;//the ack ends the whole list
+				}
+				if (list_ok) {
+					out += "list_OK\n";
+				}
+			}
+			out += "OK\n";
+		}
+
+		//Waits for a sticker change or "noidle".
+		bool idle() {
+			unsigned long version;
+			{
+				ratesync::Lock lock(mutex);
+				version = sticker_version;
+			}
+			while (true) {
+				struct pollfd pfd;
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+				int ret = poll(&pfd, 1, 100);
+				if (ret < 0 && errno != EINTR) {
+					return false;
+				}
+				if (ret > 0) {
+					std::string line;
+					if (!read_line(line)) {
+						return false;
+					}
+					if (line != "noidle") {
+						ack(ACK_ERROR_ARG, 0, "idle", "only noidle is allowed while idle");
+					} else {
+						out += "OK\n";
+					}
+					return true;
+				}
+				ratesync::Lock lock(mutex);
+				if (sticker_version != version) {
+					out += "changed: sticker\nOK\n";
+					return true;
+				}
+			}
+		}
+
+		//Runs one command, writing its output but not the final "OK".
+		bool run(const std::vector<std::string>& words, size_t index) {
+			++commands;
+			const std::string& cmd = words[0];
+			if (ratesync::config::debug_enabled) {
+				std::string line;
+				for (size_t i = 0; i < words.size(); ++i) {
+					line += " " + words[i];
+				}
+				debug("client %d:%s", id, line.c_str());
+			}
+			if (cmd == "ping") {
+				return true;
+			} else if (cmd == "lsinfo") {
+				//only the root is supported, which has no songs
+				std::string last;
+				for (size_t i = 0; i < songs.size(); ++i) {
+					std::string dir(songs[i], 0, songs[i].find('/'));
+					if (dir != last) {
+						out += "directory: " + dir + "\n";
+						last = dir;
+					}
+				}
+				return true;
+			} else if (cmd == "listall") {
+				std::string prefix = (words.size() > 1) ? words[1] : "";
+				if (!prefix.empty()) {
+					prefix += '/';
+				}
+				std::string last_dir;
+				for (std::vector<std::string>::const_iterator
+						 it = std::lower_bound(songs.begin(), songs.end(), prefix);
+					 it != songs.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+					std::string dir(*it, 0, it->find_last_of('/'));
+					if (dir != last_dir) {
+						out += "directory: " + dir + "\n";
+						last_dir = dir;
+					}
+					out += "file: " + *it + "\n";
+				}
+				return true;
+			} else if (cmd == "stats") {
+				char buf[64];
+				snprintf(buf, sizeof(buf), "songs: %lu\ndb_update: 0\n",
+						 (unsigned long)songs.size());
+				out += buf;
+				return true;
+			} else if (cmd == "sticker") {
+				return sticker(words, index);
+			}
+			ack(ACK_ERROR_UNKNOWN, index, cmd,
+				("unknown command \"" + cmd + "\"").c_str());
+			return false;
+		}
+
+		bool sticker(const std::vector<std::string>& words, size_t index) {
+			if (words.size() < 5 || words[2] != "song" || words[4] != "rating") {
+				ack(ACK_ERROR_ARG, index, "sticker", "only song rating stickers are supported");
+				return false;
+			}
+			const std::string& sub = words[1], uri = words[3];
+			if (sub == "find") {
+				if (options.no_find) {
+					ack(ACK_ERROR_UNKNOWN, index, "sticker", "bad request");
+					return false;
+				}
+				ratesync::Lock lock(mutex);
+				for (std::map<std::string, std::string>::const_iterator
+						 it = stickers.lower_bound(uri); it != stickers.end() &&
+						 it->first.compare(0, uri.size(), uri) == 0; ++it) {
+					out += "file: " + it->first + "\nsticker: rating=" + it->second + "\n";
+				}
+				return true;
+			}
+			if (!is_song(uri)) {
+				ack(ACK_ERROR_NO_EXIST, index, "sticker", "no such song");
+				return false;
+			}
+			ratesync::Lock lock(mutex);
+			std::map<std::string, std::string>::iterator it = stickers.find(uri);
+			if (sub == "get") {
+				if (it == stickers.end()) {
+					ack(ACK_ERROR_NO_EXIST, index, "sticker", "no such sticker");
+					return false;
+				}
+				out += "sticker: rating=" + it->second + "\n";
+				return true;
+			} else if (sub == "set" && words.size() == 6) {
+				stickers[uri] = words[5];
+				++sticker_version;
+				return true;
+			} else if (sub == "delete") {
+				if (it == stickers.end()) {
+					ack(ACK_ERROR_NO_EXIST, index, "sticker", "no such sticker");
+					return false;
+				}
+				stickers.erase(it);
+				++sticker_version;
+				return true;
+			}
+			ack(ACK_ERROR_ARG, index, "sticker", "bad request");
+			return false;
+		}
+
+		const int fd, id;
+		size_t commands;
+		std::string in, out;
+	};
+
+	void* client_main(void* client) {
+		static_cast<Client*>(client)->Run();
+		delete static_cast<Client*>(client);
+		return NULL;
+	}
+
+	void syntax(const char* appname) {
+		error("Usage: %s [options]", appname);
+		error("Serves a generated song database over a subset of the MPD protocol.");
+		error("  -h/--help           This help text.");
+		error("  -v/--verbose        Log every command.");
+		error("  -p/--port <n>       Port to listen on. (default %u)", options.port);
+		error("  -s/--songs <n>      Songs in the database. (default %lu)",
+			  (unsigned long)options.songs);
+		error("  -d/--dirs <n>       Top level directories. (default %lu)",
+			  (unsigned long)options.dirs);
+		error("  -r/--rated <pct>    Songs that start out with a rating. (default %lu)",
+			  (unsigned long)options.rated_percent);
+		error("  -l/--latency <ms>   Delay before every response. (default 0)");
+		error("  --no-find           Refuse 'sticker find', like old servers.");
+	}
+
+	bool parse_config(int argc, char* argv[]) {
+		static struct option long_options[] = {
+			{"help", 0, NULL, 'h'},
+			{"verbose", 0, NULL, 'v'},
+			{"port", 1, NULL, 'p'},
+			{"songs", 1, NULL, 's'},
+			{"dirs", 1, NULL, 'd'},
+			{"rated", 1, NULL, 'r'},
+			{"latency", 1, NULL, 'l'},
+			{"no-find", 0, NULL, 'F'},
+			{0,0,0,0}
+		};
+		int c;
+		while ((c = getopt_long(argc, argv, "hvp:s:d:r:l:", long_options, NULL)) != -1) {
+			switch (c) {
+			case 'v':
+				ratesync::config::debug_enabled = true;
+				break;
+			case 'p':
+				options.port = atoi(optarg);
+				break;
+			case 's':
+				options.songs = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				options.dirs = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				options.rated_percent = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				options.latency_ms = atof(optarg);
+				break;
+			case 'F':
+				options.no_find = true;
+				break;
+			default:
+				syntax(argv[0]);
+				return false;
+			}
+		}
+		if (optind < argc || options.port == 0 || options.port > 65535 ||
+			options.dirs == 0 || options.rated_percent > 100) {
+			syntax(argv[0]);
+			return false;
+		}
+		return true;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (!parse_config(argc, argv)) {
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	make_songs();
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(options.port);
+	if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		listen(server, 64) != 0) {
+		error("Unable to listen on port %u: %s", options.port, strerror(errno));
+		return 1;
+	}
+	log("Serving %lu songs (%lu rated) on localhost:%u, %.1fms latency",
+		(unsigned long)songs.size(), (unsigned long)stickers.size(),
+		options.port, options.latency_ms);
+
+	for (int id = 1; ; ++id) {
+		int fd = accept(server, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error("accept failed: %s", strerror(errno));
+			return 1;
+		}
+		pthread_t thread;
+		Client* client = new Client(fd, id);
+		if (pthread_create(&thread, NULL, client_main, client) != 0) {
+			error("Unable to start a thread for client %d", id);
+			close(fd);
+			delete client;
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
@@ -0,0 +1,118 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fdstream.h"
+
+#include <algorithm>
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+ratesync::FdStream::FdStream(int fd, const std::string& path)
+	: fd(fd), path(path), pos(0), size(-1), bytes_read(0) { }
+
+const std::string& ratesync::FdStream::Head(size_t length) {
+	if (head.empty() && length > 0 && fd >= 0) {
+		head.resize(length);
+		size_t got = 0;
+		while (got < length) {
+			ssize_t n = pread(fd, &head[got], length - got, got);
+			if (n <= 0) {
+				break;
+			}
+			got += n;
+		}
+		head.resize(got);
+		bytes_read += got;
+	}
+	return head;
+}
+
+TagLib::FileName ratesync::FdStream::name() const {
+	return path.c_str();
+}
+
+TagLib::ByteVector ratesync::FdStream::readBlock(TagLib::ulong length) {
+	if (length == 0 || fd < 0) {
+		return TagLib::ByteVector();
+	}
+	TagLib::ByteVector block((TagLib::uint)length, 0);
+	size_t got = 0, from_head = 0;
+	if (pos < (long)head.size()) {
+		got = from_head = std::min((size_t)length, head.size() - pos);
+		memcpy(block.data(), head.data() + pos, got);
+	}
+	while (got < length) {
+		ssize_t n = pread(fd, block.data() + got, length - got, pos + got);
+		if (n <= 0) {
+			break;
+		}
+		got += n;
+	}
+	pos += got;
+	bytes_read += got - from_head;
+	block.resize((TagLib::uint)got);
+	return block;
+}
+
+void ratesync::FdStream::writeBlock(const TagLib::ByteVector&) { }
+
+void ratesync::FdStream::insert(const TagLib::ByteVector&,
+								TagLib::ulong, TagLib::ulong) { }
+
+void ratesync::FdStream::removeBlock(TagLib::ulong, TagLib::ulong) { }
+
+bool ratesync::FdStream::readOnly() const {
+	return true;
+}
+
+bool ratesync::FdStream::isOpen() const {
+	return fd >= 0;
+}
+
+void ratesync::FdStream::seek(long offset, Position p) {
+	switch (p) {
+	case Beginning:
+		pos = offset;
+		break;
+	case Current:
+		pos += offset;
+		break;
+	case End:
+		pos = length() + offset;
+		break;
+	}
+	if (pos < 0) {
+		pos = 0;
+	}
+}
+
+long ratesync::FdStream::tell() const {
+	return pos;
+}
+
+long ratesync::FdStream::length() {
+	if (size < 0) {
+		struct stat sb;
+		size = (fd >= 0 && fstat(fd, &sb) == 0) ? sb.st_size : 0;
+	}
+	return size;
+}
+
+void ratesync::FdStream::truncate(long) { }
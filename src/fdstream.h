@@ -0,0 +1,66 @@
+#ifndef RATESYNC_FDSTREAM_H
+#define RATESYNC_FDSTREAM_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+
+#include <taglib/tiostream.h>
+
+namespace ratesync {
+	//Read-only TagLib stream over an already-open fd, so that the scanner
+	//decides how files are opened (see io::ScanIo). Keeps count of the
+	//bytes TagLib actually read.
+	class FdStream : public TagLib::IOStream {
+	public:
+		FdStream(int fd, const std::string& path);
+		virtual ~FdStream() { }
+
+		size_t BytesRead() const { return bytes_read; }
+
+		//Reads (once) and returns up to the first 'length' bytes, eg for
+		//telling the format. TagLib's reads of them are then served from
+		//memory rather than read again.
+		const std::string& Head(size_t length);
+
+		TagLib::FileName name() const;
+		TagLib::ByteVector readBlock(TagLib::ulong length);
+		void writeBlock(const TagLib::ByteVector& data);
+		void insert(const TagLib::ByteVector& data,
+					TagLib::ulong start = 0, TagLib::ulong replace = 0);
+		void removeBlock(TagLib::ulong start = 0, TagLib::ulong length = 0);
+		bool readOnly() const;
+		bool isOpen() const;
+		void seek(long offset, Position p = Beginning);
+		long tell() const;
+		long length();
+		void truncate(long length);
+
+	private:
+		FdStream(const FdStream&);//disallow copy
+
+		const int fd;
+		const std::string path;
+		long pos, size;
+		size_t bytes_read;
+		std::string head;
+	};
+}
+
+#endif
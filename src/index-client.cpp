@@ -0,0 +1,185 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "index-client.h"
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace {
+	//Parses "<digest> <files> <songs>" from the start of 'str', and
+	//returns the rest after a space.
+	bool parse_node(const std::string& str, ratesync::merkle_node_t& node,
+					std::string& rest) {
+		const char* pos = str.c_str();
+		char* end = NULL;
+		node.digest = strtoull(pos, &end, 16);
+		if (end == pos || *end != ' ') {
+			return false;
+		}
+		pos = end + 1;
+		node.files = strtoull(pos, &end, 16);
+		if (end == pos || *end != ' ') {
+			return false;
+		}
+		pos = end + 1;
+		node.songs = strtoul(pos, &end, 10);
+		if (end == pos || (*end != ' ' && *end != 0)) {
+			return false;
+		}
+		rest = (*end == ' ') ? std::string(end + 1) : std::string();
+		return true;
+	}
+
+	//Whether 'request' gets a multi-line response ending in "END".
+	bool multi_line(const std::string& request) {
+		return request.compare(0, 5, "RANGE") == 0 ||
+			request.compare(0, 6, "DIGEST") == 0 ||
+			request.compare(0, 5, "SONGS") == 0;
+	}
+}
+
+ratesync::IndexClient::IndexClient(const std::string& socket_path)
+	: socket_path(socket_path), fd(-1) { }
+
+ratesync::IndexClient::~IndexClient() {
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+bool ratesync::IndexClient::Connect() {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		config::error("Socket path %s is too long", socket_path.c_str());
+		return false;
+	}
+	strcpy(addr.sun_path, socket_path.c_str());
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		config::error("Unable to connect to %s: %s", socket_path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool ratesync::IndexClient::read_line(std::string& line) {
+	size_t pos;
+	while ((pos = in.find('\n')) == std::string::npos) {
+		char buf[4096];
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			config::error("Lost connection to %s", socket_path.c_str());
+			return false;
+		}
+		in.append(buf, n);
+	}
+	line.assign(in, 0, pos);
+	in.erase(0, pos + 1);
+	return true;
+}
+
+bool ratesync::IndexClient::Request(const std::string& request,
+									std::vector<std::string>& lines) {
+	std::string out(request + "\n");
+	while (!out.empty()) {
+		//MSG_NOSIGNAL: a server that went away is an error, not SIGPIPE
+		ssize_t n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			config::error("Unable to send request to %s: %s",
+						  socket_path.c_str(), strerror(errno));
+			return false;
+		}
+		out.erase(0, n);
+	}
+
+	const bool multi = multi_line(request);
+	std::string line;
+	while (read_line(line)) {
+		if (line.compare(0, 3, "ERR") == 0) {
+			config::error("%s: '%s' failed: %s", socket_path.c_str(),
+						  request.c_str(), line.c_str());
+			return false;
+		}
+		if (multi && line == "END") {
+			return true;
+		}
+		lines.push_back(line);
+		if (!multi) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ratesync::IndexClient::Node(const std::string& dir, merkle_node_t& node,
+								 merkle_children_t& children) {
+	std::vector<std::string> lines;
+	if (!Request("DIGEST " + dir, lines)) {
+		return false;
+	}
+	std::string rest;
+	if (lines.empty() || lines[0].compare(0, 3, "OK ") != 0 ||
+		!parse_node(lines[0].substr(3), node, rest)) {
+		config::error("%s: unexpected DIGEST response", socket_path.c_str());
+		return false;
+	}
+	for (size_t i = 1; i < lines.size(); ++i) {
+		merkle_node_t child;
+		if (lines[i].compare(0, 4, "DIR ") != 0 ||
+			!parse_node(lines[i].substr(4), child, rest) || rest.empty()) {
+			config::error("%s: unexpected DIGEST response '%s'",
+						  socket_path.c_str(), lines[i].c_str());
+			return false;
+		}
+		children.push_back(std::make_pair(rest, child));
+	}
+	return true;
+}
+
+bool ratesync::IndexClient::Songs(const std::string& dir, std::map<song_t, rating_t>& out) {
+	std::vector<std::string> lines;
+	if (!Request("SONGS " + dir, lines)) {
+		return false;
+	}
+	for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+		const char* pos = it->c_str();
+		char* end = NULL;
+		long rating = strtol(pos, &end, 10);
+		if (end == pos || *end != ' ') {
+			config::error("%s: unexpected SONGS response '%s'", socket_path.c_str(), pos);
+			return false;
+		}
+		out[song_t(end + 1)] = rating;
+	}
+	return true;
+}
@@ -0,0 +1,61 @@
+#ifndef RATESYNC_INDEX_CLIENT_H
+#define RATESYNC_INDEX_CLIENT_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "merkle.h"
+
+namespace ratesync {
+	//Talks to an IndexServer, eg to compare its songs with another's.
+	class IndexClient : public IMerkleSongs {
+	public:
+		IndexClient(const std::string& socket_path);
+		~IndexClient();
+
+		bool Connect();
+
+		//Sends 'request' and collects the response lines. Responses to
+		//RANGE/DIGEST/SONGS are read up to "END", which is left out.
+		//Returns false on errors, including "ERR" responses.
+		bool Request(const std::string& request, std::vector<std::string>& lines);
+
+		//Hash tree nodes from DIGEST.
+		bool Node(const std::string& dir, merkle_node_t& node,
+				  merkle_children_t& children);
+		//Adds the songs directly in 'dir' to 'out', from SONGS.
+		bool Songs(const std::string& dir, std::map<song_t, rating_t>& out);
+
+		const std::string& Path() const { return socket_path; }
+
+	private:
+		IndexClient(const IndexClient&);//disallow copy
+		bool read_line(std::string& line);
+
+		const std::string socket_path;
+		int fd;
+		std::string in;
+	};
+}
+
+#endif
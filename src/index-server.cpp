@@ -0,0 +1,520 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "index-server.h"
+#include "threadpool.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace {
+	//a client that sends this much without a newline (or doesn't read
+	//this much of its responses) is dropped
+	const size_t MAX_BUFFER = 16 * 1024 * 1024;
+	//streamed replies are listed this many songs at a time, whenever
+	//less than STREAM_BUFFER bytes of the reply are waiting to be sent
+	const size_t STREAM_CHUNK = 1000;
+	const size_t STREAM_BUFFER = 64 * 1024;
+
+	//written to by the signal handler to wake up the poll loop
+	int signal_fd = -1;
+	volatile sig_atomic_t stop_signal = 0;
+
+	void on_signal(int) {
+		stop_signal = 1;
+		if (signal_fd >= 0) {
+			char c = 0;
+			if (write(signal_fd, &c, 1) < 0) {
+				//nothing to be done, the pipe is full and poll will wake anyway
+			}
+		}
+	}
+
+	void set_nonblock(int fd) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	std::string str(ratesync::rating_t rating) {
+		if (rating == ABSENT) {
+			return "-";
+		}
+		char buf[12];
+		snprintf(buf, sizeof(buf), "%d", rating);
+		return buf;
+	}
+
+	//Writes songs as "<rating> <song>" lines.
+	class LineOutput : public ratesync::ISongOutput {
+	public:
+		LineOutput(std::string& out) : out(out) { }
+		bool Put(const ratesync::song_t& song, ratesync::rating_t rating) {
+			out += str(rating);
+			out += ' ';
+			out += song;
+			out += '\n';
+			return true;
+		}
+	private:
+		std::string& out;
+	};
+
+	//Passes on up to 'limit' songs, remembering the last one.
+	class ChunkOutput : public ratesync::ISongOutput {
+	public:
+		ChunkOutput(size_t limit, ratesync::ISongOutput& next)
+			: limit(limit), count(0), next(next) { }
+		bool Put(const ratesync::song_t& song, ratesync::rating_t rating) {
+			last = song;
+			++count;
+			return next.Put(song, rating) && count < limit;
+		}
+		bool Full() const { return count >= limit; }
+		const ratesync::song_t& Last() const { return last; }
+	private:
+		const size_t limit;
+		size_t count;
+		ratesync::song_t last;
+		ratesync::ISongOutput& next;
+	};
+
+	std::string node_str(const ratesync::merkle_node_t& node) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%016llx %016llx %lu",
+				 (unsigned long long)node.digest, (unsigned long long)node.files,
+				 (unsigned long)node.songs);
+		return buf;
+	}
+
+	//Splits off the first space-separated word of 'line'.
+	std::string next_word(std::string& line) {
+		size_t sep = line.find(' ');
+		std::string word = line.substr(0, sep);
+		line.erase(0, (sep == std::string::npos) ? line.size() : sep + 1);
+		return word;
+	}
+
+	bool parse_rating(const std::string& str, ratesync::rating_t& out) {
+		char* end = NULL;
+		long val = strtol(str.c_str(), &end, 10);
+		if (str.empty() || *end != 0 || val < UNRATED || val > 5) {
+			return false;
+		}
+		out = val;
+		return true;
+	}
+
+	//Normalizes a directory argument into the form used by MerkleTree.
+	bool dir_key(std::string& dir) {
+		if (dir.empty()) {
+			return true;
+		}
+		if (!ratesync::normalize_key(dir)) {
+			return false;
+		}
+		if (!dir.empty() && dir[dir.size() - 1] != SEP) {
+			dir += SEP;
+		}
+		return true;
+	}
+
+	bool flush(int fd, std::string& out) {
+		while (!out.empty()) {
+			ssize_t n = write(fd, out.data(), out.size());
+			if (n < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+			out.erase(0, n);
+		}
+		return true;
+	}
+}
+
+ratesync::IndexServer::IndexServer(ISink* source, const std::string& socket_path,
+								   unsigned interval)
+	: source(source), socket_path(socket_path), interval(interval), listen_fd(-1),
+	  index(NULL), tree(NULL), scans(0), rescan(false), stopping(false) {
+	wake_fd[0] = wake_fd[1] = -1;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&rescan_cond, NULL);
+}
+
+ratesync::IndexServer::~IndexServer() {
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(socket_path.c_str());
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (wake_fd[i] >= 0) {
+			close(wake_fd[i]);
+		}
+	}
+	delete index;
+	delete tree;
+	pthread_cond_destroy(&rescan_cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool ratesync::IndexServer::scan() {
+	SongIndex* fresh = new SongIndex;
+	if (!source->Get(*fresh)) {
+		config::error("Some songs couldn't be read, serving the rest");
+	}
+	fresh->Finish();
+	MerkleTree* fresh_tree = new MerkleTree;
+	fresh->Range("", UNRATED, 5, *fresh_tree);
+	fresh_tree->Finish();
+
+	//only this thread replaces the index, so it can be read without the lock
+	std::vector<song_ratings_t> changes;
+	if (index != NULL) {
+		fresh->Diff(*index, changes);
+	}
+	SongIndex* old;
+	MerkleTree* old_tree;
+	{
+		Lock lock(mutex);
+		old = index;
+		index = fresh;
+		old_tree = tree;
+		tree = fresh_tree;
+		++scans;
+		pending.insert(pending.end(), changes.begin(), changes.end());
+	}
+	//queries only use the index with the lock held, so nobody has the old one
+	delete old;
+	delete old_tree;
+	config::log("Indexed %d songs, %d changed", fresh->Size(), changes.size());
+	if (!changes.empty() && wake_fd[1] >= 0) {
+		char c = 0;
+		if (write(wake_fd[1], &c, 1) < 0) {
+			//the pipe is full, so the poll loop is already due to wake up
+		}
+	}
+	return true;
+}
+
+void* ratesync::IndexServer::scan_main(void* server) {
+	static_cast<IndexServer*>(server)->scan_loop();
+	return NULL;
+}
+
+void ratesync::IndexServer::scan_loop() {
+	pthread_mutex_lock(&mutex);
+	while (!stopping) {
+		if (!rescan) {
+			if (interval > 0) {
+				struct timespec deadline;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += interval;
+				if (pthread_cond_timedwait(&rescan_cond, &mutex, &deadline) == ETIMEDOUT) {
+					rescan = true;
+				}
+			} else {
+				pthread_cond_wait(&rescan_cond, &mutex);
+			}
+			continue;
+		}
+		rescan = false;
+		pthread_mutex_unlock(&mutex);
+		scan();
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool ratesync::IndexServer::listen_socket() {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		config::error("Socket path %s is too long", socket_path.c_str());
+		return false;
+	}
+	strcpy(addr.sun_path, socket_path.c_str());
+
+	//replace a socket left behind by a previous run, but nothing else
+	struct stat sb;
+	if (lstat(socket_path.c_str(), &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+		unlink(socket_path.c_str());
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		listen(fd, 64) != 0) {
+		config::error("Unable to listen on %s: %s", socket_path.c_str(), strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	set_nonblock(fd);
+	listen_fd = fd;
+	return true;
+}
+
+void ratesync::IndexServer::handle(client_t& client, const std::string& request) {
+	std::string args(request);
+	const std::string cmd = next_word(args);
+	std::string& out = client.out;
+	if (cmd == "GET") {
+		song_t song(args);
+		rating_t rating;
+		bool found;
+		if (!normalize_key(song)) {
+			found = false;
+		} else {
+			Lock lock(mutex);
+			found = index->Find(song, rating);
+		}
+		out += found ? "OK " + str(rating) + "\n" : "ERR no such song\n";
+	} else if (cmd == "RANGE") {
+		rating_t min, max;
+		if (!parse_rating(next_word(args), min) || !parse_rating(next_word(args), max)) {
+			out += "ERR expected RANGE <min> <max> [<prefix>]\n";
+			return;
+		}
+		client.streaming = true;
+		client.dir_only = false;
+		client.min = min;
+		client.max = max;
+		client.stream_prefix = args;
+		client.after.clear();
+	} else if (cmd == "SUBSCRIBE") {
+		client.subscribed = true;
+		client.prefix = args;
+		out += "OK\n";
+	} else if (cmd == "RESCAN") {
+		{
+			Lock lock(mutex);
+			rescan = true;
+			pthread_cond_signal(&rescan_cond);
+		}
+		out += "OK\n";
+	} else if (cmd == "STATS") {
+		char buf[64];
+		Lock lock(mutex);
+		snprintf(buf, sizeof(buf), "OK %lu %lu\n",
+				 (unsigned long)index->Size(), (unsigned long)scans);
+		out += buf;
+	} else if (cmd == "DIGEST") {
+		std::string dir(args);
+		if (!dir_key(dir)) {
+			out += "ERR invalid directory\n";
+			return;
+		}
+		merkle_node_t node;
+		merkle_children_t children;
+		{
+			Lock lock(mutex);
+			tree->Node(dir, node, children);
+		}
+		out += "OK " + node_str(node) + "\n";
+		for (merkle_children_t::const_iterator
+				 it = children.begin(); it != children.end(); ++it) {
+			out += "DIR " + node_str(it->second) + " " + it->first + "\n";
+		}
+		out += "END\n";
+	} else if (cmd == "SONGS") {
+		std::string dir(args);
+		if (!dir_key(dir)) {
+			out += "ERR invalid directory\n";
+			return;
+		}
+		client.streaming = true;
+		client.dir_only = true;
+		client.min = UNRATED;
+		client.max = 5;
+		client.stream_prefix = dir;
+		client.after.clear();
+	} else {
+		out += "ERR unknown command\n";
+	}
+}
+
+void ratesync::IndexServer::stream(client_t& client) {
+	//songs in subdirectories count towards the chunk too, so that the
+	//lock is never held for long
+	LineOutput lines(client.out);
+	DirOutput dir(client.stream_prefix, lines);
+	ChunkOutput chunk(STREAM_CHUNK, client.dir_only ? (ISongOutput&)dir : lines);
+	{
+		//a rescan may swap the index between chunks, picking up after the
+		//last song keeps the reply in order regardless
+		Lock lock(mutex);
+		index->Range(client.stream_prefix, client.min, client.max, chunk, client.after);
+	}
+	if (chunk.Full()) {
+		client.after = chunk.Last();
+	} else {
+		client.out += "END\n";
+		client.streaming = false;
+	}
+}
+
+void ratesync::IndexServer::notify(std::vector<client_t>& clients) {
+	std::vector<song_ratings_t> changes;
+	{
+		Lock lock(mutex);
+		changes.swap(pending);
+	}
+	for (std::vector<client_t>::iterator
+			 client = clients.begin(); client != clients.end(); ++client) {
+		if (!client->subscribed) {
+			continue;
+		}
+		for (std::vector<song_ratings_t>::const_iterator
+				 it = changes.begin(); it != changes.end(); ++it) {
+			if (it->path.compare(0, client->prefix.size(), client->prefix) == 0) {
+				client->out += "CHANGE " + str(it->rating_old) + " " +
+					str(it->rating_new) + " " + it->path + "\n";
+			}
+		}
+	}
+}
+
+bool ratesync::IndexServer::Run() {
+	config::log("Scanning...");
+	scan();
+	if (pipe(wake_fd) != 0 || !listen_socket()) {
+		return false;
+	}
+	set_nonblock(wake_fd[0]);
+	set_nonblock(wake_fd[1]);
+
+	signal_fd = wake_fd[1];
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_t scan_thread;
+	if (pthread_create(&scan_thread, NULL, scan_main, this) != 0) {
+		config::error("Unable to start the scan thread");
+		return false;
+	}
+	config::log("Serving ratings on %s", socket_path.c_str());
+
+	std::vector<client_t> clients;
+	std::vector<struct pollfd> fds;
+	while (!stop_signal) {
+		fds.resize(2 + clients.size());
+		fds[0].fd = wake_fd[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = listen_fd;
+		fds[1].events = POLLIN;
+		for (size_t i = 0; i < clients.size(); ++i) {
+			fds[2 + i].fd = clients[i].fd;
+			fds[2 + i].events = POLLIN |
+				((clients[i].out.empty() && !clients[i].streaming) ? 0 : POLLOUT);
+		}
+		if (poll(&fds[0], fds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			config::error("poll failed: %s", strerror(errno));
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			while (read(wake_fd[0], buf, sizeof(buf)) > 0) { }
+			notify(clients);
+		}
+
+		//handle clients before accepting, fds[] only covers the current ones
+		std::vector<bool> dead(clients.size(), false);
+		for (size_t i = 0; i < clients.size(); ++i) {
+			client_t& client = clients[i];
+			if (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				char buf[4096];
+				ssize_t n = read(client.fd, buf, sizeof(buf));
+				if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+					dead[i] = true;
+					continue;
+				}
+				if (n > 0) {
+					client.in.append(buf, n);
+				}
+			}
+			//one chunk per client each time round, and further requests
+			//wait until the reply is done
+			if (client.streaming && client.out.size() < STREAM_BUFFER) {
+				stream(client);
+			}
+			size_t pos;
+			while (!client.streaming && (pos = client.in.find('\n')) != std::string::npos) {
+				std::string line(client.in, 0, pos);
+				client.in.erase(0, pos + 1);
+				if (!line.empty() && line[line.size() - 1] == '\r') {
+					line.erase(line.size() - 1);
+				}
+				handle(client, line);
+			}
+			if (!flush(client.fd, client.out) ||
+				client.in.size() > MAX_BUFFER || client.out.size() > MAX_BUFFER) {
+				dead[i] = true;
+			}
+		}
+		for (size_t i = clients.size(); i-- > 0; ) {
+			if (dead[i]) {
+				close(clients[i].fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int fd;
+			while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+				set_nonblock(fd);
+				client_t client;
+				client.fd = fd;
+				client.subscribed = false;
+				client.streaming = false;
+				clients.push_back(client);
+			}
+		}
+	}
+
+	config::log("Shutting down");
+	{
+		Lock lock(mutex);
+		stopping = true;
+		pthread_cond_signal(&rescan_cond);
+	}
+	pthread_join(scan_thread, NULL);
+	signal_fd = -1;
+	for (std::vector<client_t>::iterator
+			 client = clients.begin(); client != clients.end(); ++client) {
+		close(client->fd);
+	}
+	return true;
+}
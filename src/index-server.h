@@ -0,0 +1,101 @@
+#ifndef RATESYNC_INDEX_SERVER_H
+#define RATESYNC_INDEX_SERVER_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "merkle.h"
+#include "song-index.h"
+
+//Serves ratings from a SongIndex over a Unix socket, one request per
+//line. Replies listing songs are sent a chunk at a time, so that they
+//don't hold up other clients however long they are. Ratings are 1-5,
+//or -1 for unrated songs:
+//  GET <song>                     -> "OK <rating>" or "ERR ..."
+//  RANGE <min> <max> [<prefix>]   -> "<rating> <song>" lines, then "END"
+//  SUBSCRIBE [<prefix>]           -> "OK", then "CHANGE <old> <new> <song>"
+//                                    lines as rescans find changes (songs
+//                                    that appeared/vanished have old/new "-")
+//  RESCAN                         -> "OK", and rescans right away
+//  STATS                          -> "OK <songs> <scans>"
+//  DIGEST [<dir>]                 -> "OK <digest> <files> <songs>", then
+//                                    "DIR <digest> <files> <songs> <subdir>"
+//                                    lines, then "END" (see MerkleTree)
+//  SONGS [<dir>]                  -> "<rating> <song>" lines for the songs
+//                                    directly in dir, then "END"
+
+namespace ratesync {
+	class IndexServer {
+	public:
+		//Rescans 'source' on RESCAN, and every 'interval' seconds unless
+		//it's 0. Each rescan is a full Get() of the source, nothing else
+		//updates the index.
+		IndexServer(ISink* source, const std::string& socket_path,
+					unsigned interval);
+		~IndexServer();
+
+		//Scans the source, then serves requests until SIGINT/SIGTERM.
+		bool Run();
+
+	private:
+		IndexServer(const IndexServer&);//disallow copy
+
+		struct client_t {
+			int fd;
+			std::string in, out;
+			bool subscribed;
+			std::string prefix;
+			//a RANGE or SONGS reply being sent (see stream), the range it
+			//covers and the last song sent
+			bool streaming, dir_only;
+			rating_t min, max;
+			std::string stream_prefix, after;
+		};
+
+		static void* scan_main(void* server);
+		void scan_loop();
+		bool scan();
+		bool listen_socket();
+		void handle(client_t& client, const std::string& line);
+		//Adds the next chunk of a streamed reply to the client's output.
+		void stream(client_t& client);
+		//Sends the pending changes to subscribed clients.
+		void notify(std::vector<client_t>& clients);
+
+		ISink* source;
+		const std::string socket_path;
+		const unsigned interval;
+		int listen_fd, wake_fd[2];
+
+		//guards everything below, which the scan thread updates
+		pthread_mutex_t mutex;
+		pthread_cond_t rescan_cond;
+		SongIndex* index;
+		MerkleTree* tree;
+		size_t scans;
+		bool rescan, stopping;
+		std::vector<song_ratings_t> pending;
+	};
+}
+
+#endif
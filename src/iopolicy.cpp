@@ -0,0 +1,120 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "iopolicy.h"
+#include "threadpool.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#ifndef O_NOATIME
+#define O_NOATIME 0
+#endif
+
+//from linux/ioprio.h, which isn't exported by glibc
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+namespace {
+	double now() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.;
+	}
+
+	void sleep_until(double when) {
+		double wait = when - now();
+		if (wait <= 0) {
+			return;
+		}
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1000000000.);
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR) { }
+	}
+}
+
+ratesync::io::ScanIo::ScanIo(const policy_t& policy)
+	: policy(policy), noatime_ok(policy.noatime), start(0), files(0), bytes(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ratesync::io::ScanIo::~ScanIo() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void ratesync::io::ScanIo::Begin() {
+	start = now();
+	files = bytes = 0;
+#ifdef SYS_ioprio_set
+	if (policy.idle_class &&
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+		config::error("Unable to switch to idle I/O class, continuing anyway.");
+	}
+#endif
+}
+
+int ratesync::io::ScanIo::Open(const std::string& path) {
+	if (noatime_ok && O_NOATIME != 0) {
+		int fd = open(path.c_str(), O_RDONLY | O_NOATIME | O_CLOEXEC);
+		if (fd >= 0 || errno != EPERM) {
+			return fd;
+		}
+		//only permitted for files we own (or with CAP_FOWNER). once we've
+		//hit one we don't, assume that most aren't and stop trying.
+		config::debug("O_NOATIME not permitted for %s, disabling", path.c_str());
+		noatime_ok = false;
+	}
+	//CLOEXEC: tag workers are forked while other threads have files open
+	return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+void ratesync::io::ScanIo::Close(int fd, size_t bytes_read) {
+#ifdef POSIX_FADV_DONTNEED
+	if (policy.drop_cache) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#endif
+	close(fd);
+
+	double wait_until = 0;
+	Lock lock(mutex);
+	files += 1;
+	bytes += bytes_read;
+	if (policy.max_files_per_sec > 0) {
+		wait_until = start + files / policy.max_files_per_sec;
+	}
+	if (policy.max_bytes_per_sec > 0) {
+		double t = start + bytes / policy.max_bytes_per_sec;
+		if (t > wait_until) {
+			wait_until = t;
+		}
+	}
+	if (wait_until > 0) {
+		//sleeps with the lock held: with a limit set, the other threads
+		//would only be sleeping too
+		sleep_until(wait_until);
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef RATESYNC_IOPOLICY_H
+#define RATESYNC_IOPOLICY_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <sys/types.h>
+
+#include <pthread.h>
+
+namespace ratesync {
+	namespace io {
+		//How the scanner should treat the disk and page cache.
+		struct policy_t {
+			policy_t()
+				: noatime(true), drop_cache(false), idle_class(false),
+				  max_files_per_sec(0), max_bytes_per_sec(0) { }
+
+			bool noatime;//open with O_NOATIME where permitted
+			bool drop_cache;//posix_fadvise(DONTNEED) once a file is read
+			bool idle_class;//ioprio_set() the idle class for the whole run
+			double max_files_per_sec;//0: unlimited
+			double max_bytes_per_sec;//0: unlimited
+		};
+
+		//Applies a policy_t to the files opened during a scan. Open() and
+		//Close() may be called from several threads at once.
+		class ScanIo {
+		public:
+			ScanIo(const policy_t& policy);
+			~ScanIo();
+
+			//Called once before the first Open(), applies the I/O class. This
+			//only covers the calling thread and threads it starts later.
+			void Begin();
+
+			//Opens 'path' read-only, returning the fd or -1 on error.
+			int Open(const std::string& path);
+
+			//Closes an fd from Open(), after 'bytes_read' were read from it.
+			//Sleeps as needed to honor the configured throughput limits.
+			void Close(int fd, size_t bytes_read);
+
+		private:
+			ScanIo(const ScanIo&);//disallow copy
+
+			const policy_t policy;
+			volatile bool noatime_ok;
+			double start;
+			//guards files and bytes
+			pthread_mutex_t mutex;
+			double files, bytes;
+		};
+	}
+}
+
+#endif
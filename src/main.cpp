@@ -16,18 +16,32 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <map>
 #include <string>
+#include <vector>
 #include <sstream>
 #include <iostream>
 
 #include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "config.h" //must come early, defines USE_MPDCLIENT
+#include "rating-scheme.h"
 #include "updater.h"
+#include "extsort.h"
+#include "index-client.h"
+#include "index-server.h"
+#include "tagworker.h"
+#include "concurrency.h"
 
+#include "sink-export.h"
 #include "sink-file.h"
+#include "sink-m3u.h"
+#include "sink-partial.h"
 #include "sink-symlink.h"
 #ifdef USE_MPDCLIENT
 #include "sink-mpd.h"
@@ -37,6 +51,36 @@ using ratesync::config::error;
 using ratesync::config::log;
 using ratesync::config::debug;
 
+namespace {
+	enum LONG_OPT {
+		OPT_IO_IDLE = 256,
+		OPT_DROP_CACHE,
+		OPT_MAX_FILES,
+		OPT_MAX_BYTES,
+		OPT_SUBTREE,
+		OPT_SHARD,
+		OPT_FORCE,
+		OPT_MPD_TIMEOUT,
+		OPT_INTERVAL,
+		OPT_MIN_RATING,
+		OPT_PARSE_TIMEOUT,
+		OPT_BAD_FILES,
+		OPT_RETRY_BAD,
+		OPT_NO_FOLLOW,
+		OPT_ONE_FS,
+		OPT_SAMPLE,
+		OPT_BUDGET_TIME,
+		OPT_BUDGET_FILES,
+		OPT_CURSOR,
+		OPT_BASELINE,
+		OPT_DIGEST
+	};
+}
+
+//threads for copies/MPD connections with -j auto, which aren't tuned
+#define DEFAULT_JOBS 4
+#define MAX_AUTO_JOBS 64
+
 #ifdef USE_MPDCLIENT
 #define DEFAULT_MPD_HOST "localhost"
 #define DEFAULT_MPD_PORT 6600
@@ -47,16 +91,42 @@ namespace {
 		UNKNOWN
 		, HELP
 		, SYMLINK
+		, M3U
+		, EXPORT
+		, SCAN
+		, MERGE
+		, APPLY
+		, SERVE
+		, COMPARE
 #ifdef USE_MPDCLIENT
 		, MPD
 #endif
 	};
 	CMD run_cmd = UNKNOWN;
-	bool no_confirm = false;
+	bool no_confirm = false, force = false;
 	std::string music_dir, symlink_dir;
+	std::string out_file;
+	std::vector<std::string> args, partials;
+	std::string socket_path;
+	std::string rating_schemes;
+	//each rescan reads every tag again, so by default only on RESCAN
+	unsigned rescan_interval = 0;
+	//with a sample size, only check a random sample instead of syncing
+	size_t sample_size = 0;
+	//only compare the hash trees of both sides instead of syncing
+	bool digest = false;
+	//with a baseline, sync both ways
+	std::string baseline;
+	ratesync::sink::file_options_t file_options;
+	ratesync::sink::export_options_t export_options;
+	double max_memory = 0;
+	//with auto_jobs, jobs is the most threads to tune within
+	size_t jobs = 4;
+	bool auto_jobs = true;
 #ifdef USE_MPDCLIENT
 	std::string mpd_host = DEFAULT_MPD_HOST;
 	size_t mpd_port = DEFAULT_MPD_PORT;
+	ratesync::sink::mpd_options_t mpd_options;
 #endif
 }
 
@@ -65,26 +135,147 @@ void syntax(char* appname) {
 		  ratesync::config::VERSION_STRING,
 		  ratesync::config::BUILD_DATE);
 	error("Usage: %s [options] <command> <musicdir>", appname);
+	error("       %s [options] merge -f <out> <partial> [partial ...]", appname);
+	error("       %s [options] apply <changefile>", appname);
+	error("       %s [options] compare <socket> <socket>", appname);
 	error("Commands:");
 #ifdef USE_MPDCLIENT
 	error("  mpd     Store song rating metadata into MPD database.");
 #endif
 	error("  links   Create symlinks to files, grouped according to their ratings.");
+	error("  m3u     Write a playlist of songs for each rating.");
+	error("  export  Copy the highest rated songs into a directory, eg on a player.");
+	error("  scan    Write the ratings of (part of) musicdir to a partial file.");
+	error("  merge   Combine partial files into one.");
+	error("  apply   Apply changes exported by mpd/links/m3u/export -f, without");
+	error("          rescanning.");
+	error("  serve   Keep the ratings of musicdir in memory and answer queries about");
+	error("          them on a Unix socket.");
+	error("  compare List the songs that differ between two serve instances, only");
+	error("          fetching the directories whose digests differ.");
 	error("");
 	error("Common Options:");
 	error("  -h/--help        This help text.");
 	error("  -v/--verbose     Show verbose output.");
 	error("  -n/--no-confirm  Don't confirm changes before applying them.");
+#ifdef USE_ICU
+	error("  -u/--nfc         Match song paths after Unicode NFC normalization.");
+#endif
+	error("  -j/--jobs <n>    Read tags/apply changes on up to n threads, or 'auto' to");
+	error("                   tune the count to the storage as they run. (default auto)");
+	error("  -M/--max-memory <n>  Keep memory use near n bytes (K/M/G suffixes allowed)");
+	error("                   by sorting and comparing songs in temp files ($TMPDIR).");
+	error("  -r/--rating-schemes <a,b,...>");
+	error("                   Tag rating conventions to read, highest priority first:");
+	ratesync::decode::print_schemes();
+	error("");
+	error("Scan I/O Options:");
+	error("  --io-idle          Only use the disk when nothing else is (ioprio idle class).");
+	error("  --drop-cache       Drop scanned files from the page cache after reading them.");
+	error("  --max-files <n>    Scan at most n files per second.");
+	error("  --max-bytes <n>    Read at most n bytes per second (K/M/G suffixes allowed).");
+	error("  --subtree <dir>    Only scan this directory within musicdir.");
+	error("  --shard <i/n>      Only scan songs in shard i (0 to n-1) of n, by path hash.");
+	error("  --parse-timeout <s>  Read tags in separate processes, skipping files which");
+	error("                     take longer than s seconds or crash the tag reader.");
+	error("  --bad-files <path> Remember files which couldn't be read here, and skip them");
+	error("                     until they change. (default:");
+	error("                     $XDG_CACHE_HOME/ratesync/bad-files)");
+	error("  --retry-bad        Read files which couldn't be read before anyway.");
+	error("  --no-follow-symlinks  Skip symlinks to files and directories.");
+	error("  --one-file-system  Skip directories on other filesystems (mount points).");
+	error("  --budget-time <s>  Only scan for s seconds, and sync what was found. The");
+	error("                     next scan resumes where this one stopped, so that");
+	error("                     successive runs cover the whole library.");
+	error("  --budget-files <n> Only scan n files, resuming like --budget-time.");
+	error("  --cursor <path>    Where to remember where a budgeted scan stopped.");
+	error("                     (default: one per destination in $XDG_CACHE_HOME/ratesync)");
+	error("");
+	error("Partial Result Options:");
+	error("  -f/--file <path>     Partial file to write (scan, merge), or file to export");
+	error("                       changes to instead of applying them (mpd, links, m3u,");
+	error("                       export).");
+	error("  -p/--partial <path>  Read ratings from this partial file instead of scanning");
+	error("                       musicdir (mpd, links, m3u, export). May be given more");
+	error("                       than once.");
+	error("  --force              Apply even if the destination changed since the");
+	error("                       changes were exported (apply).");
+	error("");
+	error("Two-way Sync Options:");
+	error("  --baseline <path>  Sync both ways (mpd, links, m3u, export): the ratings");
+	error("                     both sides agreed on are kept in this file, so that");
+	error("                     songs rated in the destination since are kept, and");
+	error("                     songs rated differently on both sides are listed as");
+	error("                     conflicts and left alone.");
+	error("");
+	error("Verification Options:");
+	error("  --sample <n>  Don't sync, only compare the ratings of n songs picked at");
+	error("                random, and estimate how much of the destination is out of");
+	error("                sync (mpd, links, m3u, export). Exits with 2 if any of them");
+	error("                were.");
+	error("  --digest      Don't sync, only compare the source and destination by their");
+	error("                directory hash trees and list the songs that differ (mpd,");
+	error("                links, m3u, export). Exits with 2 if any do.");
 	error("");
 #ifdef USE_MPDCLIENT
 	error("mpd Command Options:");
 	error("  -m/--mpd-host <host[:port]>  MPD host/port. (default %s:%d)",
 		  DEFAULT_MPD_HOST, DEFAULT_MPD_PORT);
+	error("  --mpd-timeout <s>            Network timeout in seconds. (default %d)",
+		  mpd_options.timeout_ms / 1000);
+	error("  Up to -j connections are used to query/update stickers when MPD");
+	error("  doesn't support 'sticker find'.");
 	error("");
 #endif
-	error("links Command Options:");
-	error("  -o/--output-dir <path>  Where to put sorted files/symlinks.");
-	error("                          (default: <musicdir>/rating)");
+	error("serve Command Options:");
+	error("  -S/--socket <path>  Socket to listen on.");
+	error("                      (default: $XDG_RUNTIME_DIR/ratesync.sock)");
+	error("  --interval <s>      Also rescan every s seconds, 0 to only rescan on RESCAN.");
+	error("                      (default %d)", rescan_interval);
+	error("  Each rescan reads every tag in musicdir again, and syncs don't update the");
+	error("  index: send RESCAN after changing ratings (eg from the tagger or cron).");
+	error("  Requests, one per line (ratings are 1-5, -1 for unrated):");
+	error("    GET <song>, RANGE <min> <max> [<prefix>], SUBSCRIBE [<prefix>],");
+	error("    RESCAN, STATS, DIGEST [<dir>], SONGS [<dir>]");
+	error("");
+	error("links/m3u Command Options:");
+	error("  -o/--output-dir <path>  Where to put sorted files/symlinks/playlists.");
+	error("                          (default: <musicdir>/rating or <musicdir>/playlists)");
+	error("");
+	error("export Command Options:");
+	error("  -o/--output-dir <path>  Where to copy songs to, sorted by rating. (required)");
+	error("  --min-rating <n>        Only copy songs rated n or higher, -1 to also copy");
+	error("                          unrated songs. (default %d)", export_options.min_rating);
+	error("  Up to -j files are copied at once.");
+}
+
+//Runs this binary as a tag worker, with the same rating schemes.
+void worker_command(const char* appname, std::vector<std::string>& command) {
+	char self[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	command.push_back((len > 0) ? std::string(self, len) : std::string(appname));
+	command.push_back(TAG_WORKER_ARG);
+	if (ratesync::config::debug_enabled) {
+		command.push_back("-v");
+	}
+	if (!rating_schemes.empty()) {
+		command.push_back("-r");
+		command.push_back(rating_schemes);
+	}
+}
+
+//Entry point for TagWorker processes, requests come in on stdin.
+int run_tag_worker(int argc, char* argv[]) {
+	for (int i = 2; i < argc; ++i) {
+		if (strcmp(argv[i], "-v") == 0) {
+			ratesync::config::debug_enabled = true;
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			if (!ratesync::decode::set_schemes(argv[++i])) {
+				return 1;
+			}
+		}
+	}
+	return ratesync::sink::tag_worker_main(STDIN_FILENO);
 }
 
 bool check_dir(const char* dirpath, bool check_write = false) {
@@ -109,12 +300,79 @@ bool check_dir(const char* dirpath, bool check_write = false) {
 	return true;
 }
 
+void dest_desc(std::vector<std::string>& desc);
+
+//A file in $XDG_CACHE_HOME/ratesync, or "" if there's no cache dir.
+std::string cache_path(const char* name) {
+	const char* cache_dir = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	if (cache_dir != NULL && cache_dir[0] != 0) {
+		return std::string(cache_dir) + SEP + "ratesync" + SEP + name;
+	} else if (home != NULL && home[0] != 0) {
+		return std::string(home) + SEP + ".cache" + SEP + "ratesync" + SEP + name;
+	}
+	return std::string();
+}
+
 void format_dir(std::string& dir) {
 	if (dir.length() > 0 && dir.at(dir.size()-1) != SEP) {
 		dir += SEP;
 	}
 }
 
+//Parses a positive number, eg seconds or a rate.
+bool parse_number(const char* str, double& out) {
+	char* end = NULL;
+	double val = strtod(str, &end);
+	if (end == str || *end != 0 || val <= 0) {
+		return false;
+	}
+	out = val;
+	return true;
+}
+
+//Parses a whole number of at least 1, eg a thread count.
+bool parse_count(const char* str, size_t& out) {
+	if (*str < '0' || *str > '9') {
+		return false;//strtoul would take "-1"
+	}
+	char* end = NULL;
+	unsigned long val = strtoul(str, &end, 10);
+	if (*end != 0 || val < 1) {
+		return false;
+	}
+	out = val;
+	return true;
+}
+
+//Parses a positive size with an optional K/M/G (1024-based) suffix.
+bool parse_amount(const char* str, double& out) {
+	char* end = NULL;
+	double val = strtod(str, &end);
+	if (end == str || val <= 0) {
+		return false;
+	}
+	switch (*end) {
+	case 'k': case 'K':
+		val *= 1024;
+		++end;
+		break;
+	case 'm': case 'M':
+		val *= 1024 * 1024;
+		++end;
+		break;
+	case 'g': case 'G':
+		val *= 1024 * 1024 * 1024;
+		++end;
+		break;
+	}
+	if (*end != 0) {
+		return false;
+	}
+	out = val;
+	return true;
+}
+
 bool parse_config(int argc, char* argv[]) {
 	if (argc == 1) {
 		syntax(argv[0]);
@@ -126,48 +384,84 @@ bool parse_config(int argc, char* argv[]) {
 			{"help", 0, NULL, 'h'},
 			{"verbose", 0, NULL, 'v'},
 			{"no-confirm", 0, NULL, 'n'},
+#ifdef USE_ICU
+			{"nfc", 0, NULL, 'u'},
+#endif
 #ifdef USE_MPDCLIENT
 			{"mpd-host", 1, NULL, 'm'},
+			{"mpd-timeout", 1, NULL, OPT_MPD_TIMEOUT},
 #endif
 			{"output-dir", 1, NULL, 'o'},
+			{"rating-schemes", 1, NULL, 'r'},
+			{"max-memory", 1, NULL, 'M'},
+			{"jobs", 1, NULL, 'j'},
+			{"io-idle", 0, NULL, OPT_IO_IDLE},
+			{"drop-cache", 0, NULL, OPT_DROP_CACHE},
+			{"max-files", 1, NULL, OPT_MAX_FILES},
+			{"max-bytes", 1, NULL, OPT_MAX_BYTES},
+			{"subtree", 1, NULL, OPT_SUBTREE},
+			{"shard", 1, NULL, OPT_SHARD},
+			{"parse-timeout", 1, NULL, OPT_PARSE_TIMEOUT},
+			{"bad-files", 1, NULL, OPT_BAD_FILES},
+			{"retry-bad", 0, NULL, OPT_RETRY_BAD},
+			{"no-follow-symlinks", 0, NULL, OPT_NO_FOLLOW},
+			{"one-file-system", 0, NULL, OPT_ONE_FS},
+			{"file", 1, NULL, 'f'},
+			{"partial", 1, NULL, 'p'},
+			{"force", 0, NULL, OPT_FORCE},
+			{"socket", 1, NULL, 'S'},
+			{"interval", 1, NULL, OPT_INTERVAL},
+			{"min-rating", 1, NULL, OPT_MIN_RATING},
+			{"sample", 1, NULL, OPT_SAMPLE},
+			{"budget-time", 1, NULL, OPT_BUDGET_TIME},
+			{"budget-files", 1, NULL, OPT_BUDGET_FILES},
+			{"cursor", 1, NULL, OPT_CURSOR},
+			{"baseline", 1, NULL, OPT_BASELINE},
+			{"digest", 0, NULL, OPT_DIGEST},
 			{0,0,0,0}
 		};
 
 		int option_index = 0;
-		c = getopt_long(argc, argv, "hvnm:o:",
+		c = getopt_long(argc, argv, "hvnum:o:r:M:j:f:p:S:",
 						long_options, &option_index);
 		if (c == -1) {//unknown arg (doesnt match -x/--x format)
 			if (optind >= argc) {
 				//at end of successful parse
 				break;
 			}
-			//getopt refuses to continue, so handle command / musicdir manually:
+			//getopt refuses to continue, so handle command / args manually:
 			for (int i = optind; i < argc; ++i) {
 				const char* arg = argv[i];
 				debug("%d %d %s", argc, i, arg);
-				if (run_cmd == UNKNOWN) {
+				if (run_cmd != UNKNOWN) {
+					args.push_back(arg);
+					continue;
+				}
 #ifdef USE_MPDCLIENT
-					if (strcmp(arg, "mpd") == 0) {
-						run_cmd = MPD;
-					} else
+				if (strcmp(arg, "mpd") == 0) {
+					run_cmd = MPD;
+				} else
 #endif
-					if (strcmp(arg, "links") == 0) {
-						run_cmd = SYMLINK;
-					} else {
-						error("%s: unknown argument: '%s'", argv[0], argv[i]);
-						syntax(argv[0]);
-						return false;
-					}
+				if (strcmp(arg, "links") == 0) {
+					run_cmd = SYMLINK;
+				} else if (strcmp(arg, "m3u") == 0) {
+					run_cmd = M3U;
+				} else if (strcmp(arg, "export") == 0) {
+					run_cmd = EXPORT;
+				} else if (strcmp(arg, "scan") == 0) {
+					run_cmd = SCAN;
+				} else if (strcmp(arg, "merge") == 0) {
+					run_cmd = MERGE;
+				} else if (strcmp(arg, "apply") == 0) {
+					run_cmd = APPLY;
+				} else if (strcmp(arg, "serve") == 0) {
+					run_cmd = SERVE;
+				} else if (strcmp(arg, "compare") == 0) {
+					run_cmd = COMPARE;
 				} else {
-					if (music_dir.length() > 0) {
-						error("%s: unknown argument: '%s'", argv[0], argv[i]);
-						syntax(argv[0]);
-						return false;
-					}
-					if (!check_dir(arg)) {
-						return false;
-					}
-					music_dir = std::string(arg);
+					error("%s: unknown argument: '%s'", argv[0], argv[i]);
+					syntax(argv[0]);
+					return false;
 				}
 			}
 			break;
@@ -183,6 +477,11 @@ bool parse_config(int argc, char* argv[]) {
 		case 'n':
 			no_confirm = true;
 			break;
+#ifdef USE_ICU
+		case 'u':
+			ratesync::config::nfc_enabled = true;
+			break;
+#endif
 #ifdef USE_MPDCLIENT
 		case 'm':
 			{
@@ -202,7 +501,160 @@ bool parse_config(int argc, char* argv[]) {
 				}
 			}
 			break;
+		case OPT_MPD_TIMEOUT:
+			{
+				double val;
+				if (!parse_number(optarg, val)) {
+					error("%s: invalid timeout '%s'", argv[0], optarg);
+					return false;
+				}
+				mpd_options.timeout_ms = (unsigned)(val * 1000);
+			}
+			break;
 #endif
+		case 'j':
+			if (strcmp(optarg, "auto") == 0) {
+				auto_jobs = true;
+			} else if (parse_count(optarg, jobs)) {
+				auto_jobs = false;
+			} else {
+				error("%s: invalid job count '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
+		case 'M':
+			if (!parse_amount(optarg, max_memory)) {
+				error("%s: invalid memory size '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
+		case 'r':
+			if (!ratesync::decode::set_schemes(optarg)) {
+				return false;
+			}
+			rating_schemes = optarg;
+			break;
+		case OPT_PARSE_TIMEOUT:
+			{
+				double val;
+				if (!parse_number(optarg, val)) {
+					error("%s: invalid timeout '%s'", argv[0], optarg);
+					return false;
+				}
+				file_options.parse_timeout_ms = (unsigned)(val * 1000);
+			}
+			break;
+		case OPT_BAD_FILES:
+			file_options.bad_files = optarg;
+			break;
+		case OPT_RETRY_BAD:
+			file_options.retry_bad = true;
+			break;
+		case OPT_NO_FOLLOW:
+			file_options.follow_symlinks = false;
+			break;
+		case OPT_ONE_FS:
+			file_options.one_file_system = true;
+			break;
+		case OPT_BUDGET_TIME:
+			if (!parse_number(optarg, file_options.budget_secs)) {
+				error("%s: invalid scan time '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
+		case OPT_BUDGET_FILES:
+			if (!parse_count(optarg, file_options.budget_files)) {
+				error("%s: invalid file count '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
+		case OPT_CURSOR:
+			file_options.cursor = optarg;
+			break;
+		case OPT_BASELINE:
+			baseline = optarg;
+			break;
+		case OPT_DIGEST:
+			digest = true;
+			break;
+		case OPT_IO_IDLE:
+			file_options.io.idle_class = true;
+			break;
+		case OPT_DROP_CACHE:
+			file_options.io.drop_cache = true;
+			break;
+		case OPT_MAX_FILES:
+			if (!parse_number(optarg, file_options.io.max_files_per_sec)) {
+				error("%s: invalid file rate '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
+		case OPT_MAX_BYTES:
+			if (!parse_amount(optarg, file_options.io.max_bytes_per_sec)) {
+				error("%s: invalid byte rate '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
+		case OPT_SUBTREE:
+			file_options.subtree = optarg;
+			if (!ratesync::normalize_key(file_options.subtree)) {
+				error("%s: invalid subtree '%s'", argv[0], optarg);
+				return false;
+			}
+			format_dir(file_options.subtree);
+			break;
+		case OPT_SHARD:
+			{
+				char sep = 0;
+				std::stringstream ss(optarg);
+				if ((ss >> file_options.shard_index >> sep >> file_options.shard_count).fail() ||
+					!ss.eof() || sep != '/' || file_options.shard_count == 0 ||
+					file_options.shard_index >= file_options.shard_count) {
+					error("%s: invalid shard '%s', expected <i/n> with i < n", argv[0], optarg);
+					return false;
+				}
+			}
+			break;
+		case 'f':
+			out_file = optarg;
+			break;
+		case 'p':
+			partials.push_back(optarg);
+			break;
+		case OPT_FORCE:
+			force = true;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case OPT_INTERVAL:
+			{
+				char* end = NULL;
+				long val = strtol(optarg, &end, 10);
+				if (*optarg == 0 || *end != 0 || val < 0) {
+					error("%s: invalid interval '%s'", argv[0], optarg);
+					return false;
+				}
+				rescan_interval = val;
+			}
+			break;
+		case OPT_MIN_RATING:
+			{
+				char* end = NULL;
+				long val = strtol(optarg, &end, 10);
+				if (*optarg == 0 || *end != 0 || val < UNRATED || val > 5) {
+					error("%s: invalid rating '%s'", argv[0], optarg);
+					return false;
+				}
+				export_options.min_rating = val;
+			}
+			break;
+		case OPT_SAMPLE:
+			if (!parse_count(optarg, sample_size)) {
+				error("%s: invalid sample size '%s'", argv[0], optarg);
+				return false;
+			}
+			break;
 		case 'o':
 			if (!check_dir(optarg, true)) {
 				return false;
@@ -215,22 +667,175 @@ bool parse_config(int argc, char* argv[]) {
 		}
 	}
 
-	if (music_dir.length() == 0) {
-		error("%s: no music directory specified", argv[0]);
+	if (auto_jobs) {
+		jobs = 16 * ratesync::cpu_count();
+		if (jobs > MAX_AUTO_JOBS) {
+			jobs = MAX_AUTO_JOBS;
+		}
+	}
+	file_options.jobs = jobs;
+	file_options.adaptive_jobs = auto_jobs;
+	if (file_options.parse_timeout_ms > 0) {
+		worker_command(argv[0], file_options.worker_command);
+	}
+
+	if (run_cmd == MERGE) {
+		if (args.empty()) {
+			error("%s: no partial files to merge", argv[0]);
+			syntax(argv[0]);
+			return false;
+		}
+	} else if (run_cmd == APPLY) {
+		if (args.size() != 1) {
+			error("%s: expected one change file to apply", argv[0]);
+			syntax(argv[0]);
+			return false;
+		}
+	} else if (run_cmd == COMPARE) {
+		if (args.size() != 2) {
+			error("%s: expected two sockets to compare", argv[0]);
+			syntax(argv[0]);
+			return false;
+		}
+	} else if (run_cmd != UNKNOWN) {
+		if (args.size() > 1) {
+			error("%s: unknown argument: '%s'", argv[0], args[1].c_str());
+			syntax(argv[0]);
+			return false;
+		}
+		if (!args.empty()) {
+			if (!check_dir(args[0].c_str())) {
+				return false;
+			}
+			music_dir = args[0];
+		}
+		//links, m3u and export refer to songs in the musicdir, even with
+		//partial files
+		if (music_dir.length() == 0 && (partials.empty() || run_cmd == SYMLINK ||
+										run_cmd == M3U || run_cmd == EXPORT)) {
+			error("%s: no music directory specified", argv[0]);
+			syntax(argv[0]);
+			return false;
+		}
+		format_dir(music_dir);
+		if (!file_options.subtree.empty() &&
+			!check_dir((music_dir + file_options.subtree).c_str())) {
+			return false;
+		}
+	}
+	if (file_options.bad_files.empty()) {
+		file_options.bad_files = cache_path("bad-files");
+	}
+	const bool budget = file_options.budget_secs > 0 || file_options.budget_files > 0;
+	if (budget && (run_cmd == SERVE || run_cmd == COMPARE || run_cmd == MERGE ||
+				   run_cmd == APPLY || !partials.empty())) {
+		error("%s: a scan budget only applies when scanning musicdir for"
+			  " scan, mpd, links, m3u or export", argv[0]);
+		return false;
+	}
+	if (run_cmd == SERVE && socket_path.empty()) {
+		const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+		if (runtime_dir != NULL && runtime_dir[0] != 0) {
+			socket_path = std::string(runtime_dir) + SEP + "ratesync.sock";
+		} else {
+			std::ostringstream oss;
+			oss << "/tmp/ratesync-" << getuid() << ".sock";
+			socket_path = oss.str();
+		}
+	}
+	if (run_cmd == EXPORT && symlink_dir.empty()) {
+		error("%s: no directory to export to specified (-o)", argv[0]);
+		syntax(argv[0]);
+		return false;
+	}
+	if (budget) {
+		//each destination resumes where its own last sync stopped
+		std::vector<std::string> desc;
+		dest_desc(desc);
+		std::ostringstream scope;
+		if (run_cmd == SCAN) {
+			scope << "scan " << out_file;
+		}
+		for (std::vector<std::string>::const_iterator it = desc.begin(); it != desc.end(); ++it) {
+			scope << ((it == desc.begin()) ? "" : " ") << *it;
+		}
+		file_options.cursor_scope = scope.str();
+		if (file_options.cursor.empty()) {
+			std::ostringstream name;
+			name << "scan-cursor-" << std::hex
+				 << ratesync::hash_bytes(scope.str().data(), scope.str().size());
+			file_options.cursor = cache_path(name.str().c_str());
+		}
+		if (file_options.cursor.empty()) {
+			error("%s: no place to keep the scan cursor, specify --cursor", argv[0]);
+			return false;
+		}
+	}
+	if (sample_size > 0 && (run_cmd == SCAN || run_cmd == MERGE || run_cmd == APPLY ||
+							run_cmd == SERVE || run_cmd == COMPARE || !out_file.empty())) {
+		error("%s: --sample only checks the destination of mpd, links, m3u or export,"
+			  " without -f", argv[0]);
+		return false;
+	}
+	if (digest && (run_cmd == SCAN || run_cmd == MERGE || run_cmd == APPLY ||
+				   run_cmd == SERVE || run_cmd == COMPARE || budget ||
+				   sample_size > 0 || !baseline.empty() || !out_file.empty())) {
+		error("%s: --digest only checks the destination of mpd, links, m3u or export,"
+			  " without -f, --sample, --baseline or a scan budget", argv[0]);
+		return false;
+	}
+	if (!baseline.empty() && (run_cmd == SCAN || run_cmd == MERGE || run_cmd == APPLY ||
+							  run_cmd == SERVE || run_cmd == COMPARE ||
+							  sample_size > 0 || !out_file.empty())) {
+		error("%s: --baseline only applies to syncing with mpd, links, m3u or export,"
+			  " without -f or --sample", argv[0]);
+		return false;
+	}
+	if ((run_cmd == SCAN || run_cmd == MERGE) && out_file.empty()) {
+		error("%s: no partial file to write specified (-f)", argv[0]);
 		syntax(argv[0]);
 		return false;
 	}
-	format_dir(music_dir);
 
 	debug("common opts:");
 	debug("  music-dir: %s", music_dir.c_str());
 	debug("  no-confirm: %d", no_confirm);
+	debug("  force: %d", force);
+	debug("  nfc: %d", ratesync::config::nfc_enabled);
+	debug("  max-memory: %.0f", max_memory);
+	debug("  jobs: %d%s", jobs, auto_jobs ? " (auto)" : "");
+	debug("  partials: %d", partials.size());
+	debug("  sample: %d", sample_size);
+	debug("  digest: %d", digest);
+	debug("  baseline: %s", baseline.c_str());
+	debug("  io: idle=%d drop-cache=%d max-files=%f max-bytes=%f",
+		  file_options.io.idle_class, file_options.io.drop_cache,
+		  file_options.io.max_files_per_sec, file_options.io.max_bytes_per_sec);
+	debug("  subtree: %s", file_options.subtree.c_str());
+	debug("  shard: %d/%d", file_options.shard_index, file_options.shard_count);
+	debug("  parse-timeout: %dms", file_options.parse_timeout_ms);
+	debug("  bad-files: %s (retry=%d)", file_options.bad_files.c_str(), file_options.retry_bad);
+	debug("  follow-symlinks: %d, one-file-system: %d",
+		  file_options.follow_symlinks, file_options.one_file_system);
+	debug("  budget: %fs, %d files (cursor %s, for %s)", file_options.budget_secs,
+		  file_options.budget_files, file_options.cursor.c_str(),
+		  file_options.cursor_scope.c_str());
+	debug("scan/merge opts (%s)",
+		  ((run_cmd == SCAN || run_cmd == MERGE) ? "enabled" : "disabled"));
+	debug("  file: %s", out_file.c_str());
 #ifdef USE_MPDCLIENT
 	debug("mpdtag opts (%s)", (run_cmd == MPD ? "enabled" : "disabled"));
 	debug("  mpd-host: %s (port %d)", mpd_host.c_str(), mpd_port);
+	debug("  mpd-timeout: %dms", mpd_options.timeout_ms);
 #endif
-	debug("link opts (%s)", (run_cmd == SYMLINK ? "enabled" : "disabled"));
+	debug("serve opts (%s)", (run_cmd == SERVE ? "enabled" : "disabled"));
+	debug("  socket: %s", socket_path.c_str());
+	debug("  interval: %d", rescan_interval);
+	debug("link/m3u opts (%s)",
+		  ((run_cmd == SYMLINK || run_cmd == M3U) ? "enabled" : "disabled"));
 	debug("  symlink-dir: %s", symlink_dir.c_str());
+	debug("export opts (%s)", (run_cmd == EXPORT ? "enabled" : "disabled"));
+	debug("  min-rating: %d", export_options.min_rating);
 
 	return true;
 }
@@ -243,34 +848,306 @@ bool promptYN(const std::string& question) {
 			(response[0] == 'y' || response[0] == 'Y'));
 }
 
+//The song source for the mpd and links commands.
+ratesync::ISink* new_source() {
+	if (!partials.empty()) {
+		return new ratesync::sink::Partial(partials);
+	}
+	return new ratesync::sink::File(music_dir, file_options);
+}
+
+//Compares a sample of songs between the source and destination, and
+//reports the estimated drift. Returns 0 if none was found, 2 otherwise.
+int run_sample(ratesync::Updater& updater, const std::string& dest_label) {
+	log("Comparing %d random songs with your %s...", sample_size, dest_label.c_str());
+	ratesync::drift_t drift;
+	if (!updater.Sample(sample_size, drift)) {
+		log("Encountered error when comparing songs, giving up.");
+		return 1;
+	}
+	if (drift.sampled == 0) {
+		log("No songs to compare.");
+		return 0;
+	}
+	log("Compared %d of %d songs: %d out of sync.",
+		drift.sampled, drift.population, drift.drifted);
+	if (drift.sampled >= drift.population) {
+		log("Drift: %.2f%%, about %.0f songs.", drift.rate * 100,
+			drift.rate * drift.population);
+	} else {
+		log("Estimated drift: %.2f%% (95%% confidence: %.2f%%-%.2f%%),"
+			" about %.0f songs (%.0f-%.0f).",
+			drift.rate * 100, drift.low * 100, drift.high * 100,
+			drift.rate * drift.population, drift.low * drift.population,
+			drift.high * drift.population);
+	}
+	if (drift.drifted > 0) {
+		log("Your %s is out of sync, run without --sample to update it.",
+			dest_label.c_str());
+		return 2;
+	}
+	log("Your %s looks up to date.", dest_label.c_str());
+	return 0;
+}
+
+//Scans (part of) the music dir into a partial file. The songs are sorted
+//on the way, within max_memory if one is set.
+int run_scan() {
+	ratesync::sink::File source(music_dir, file_options);
+	ratesync::RunWriter runs((max_memory > 0) ? (size_t)max_memory : (size_t)-1);
+	log("Scanning %s%s...", music_dir.c_str(), file_options.subtree.c_str());
+	if (!source.Get(runs) || !runs.Finish()) {
+		log("Encountered error when scanning, giving up.");
+		return 1;
+	}
+
+	ratesync::sink::PartialWriter writer(out_file);
+	if (!writer.Open()) {
+		return 1;
+	}
+	ratesync::RunMerger merger(runs.Runs());
+	ratesync::song_t song;
+	ratesync::rating_t rating;
+	while (merger.Next(song, rating)) {
+		if (!writer.Put(song, rating)) {
+			return 1;
+		}
+	}
+	if (merger.Failed() || !writer.Commit() || !source.Synced()) {
+		return 1;
+	}
+	log("Wrote %d songs to %s.", writer.Size(), out_file.c_str());
+	return 0;
+}
+
+//Combines the partial files in args into one.
+int run_merge() {
+	ratesync::sink::Partial source(args);
+	ratesync::sink::PartialWriter writer(out_file);
+	if (!writer.Open() || !source.Get(writer) || !writer.Commit()) {
+		log("Encountered error when merging, giving up.");
+		return 1;
+	}
+	log("Wrote %d songs to %s.", writer.Size(), out_file.c_str());
+	return 0;
+}
+
+//Lists the songs that differ between 'a' and 'b', only fetching the
+//songs of the directories whose digests differ. Songs on just one side
+//only count with 'one_sided'. Returns 0 if there are none, 2 otherwise.
+int compare(ratesync::IMerkleSongs& a, ratesync::IMerkleSongs& b,
+			const std::string& name_a, const std::string& name_b, bool one_sided) {
+	std::vector<std::string> dirs;
+	if (!ratesync::merkle_diff(a, b, dirs)) {
+		log("Encountered error when comparing, giving up.");
+		return 1;
+	}
+	size_t differ = 0, differ_dirs = 0;
+	for (std::vector<std::string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+		const size_t before = differ;
+		std::map<ratesync::song_t, ratesync::rating_t> songs_a, songs_b;
+		if (!a.Songs(*it, songs_a) || !b.Songs(*it, songs_b)) {
+			log("Encountered error when comparing, giving up.");
+			return 1;
+		}
+		//walk both in order, songs only on one side are shown as "-"
+		std::map<ratesync::song_t, ratesync::rating_t>::const_iterator
+			ia = songs_a.begin(), ib = songs_b.begin();
+		while (ia != songs_a.end() || ib != songs_b.end()) {
+			int cmp = (ia == songs_a.end()) ? 1 :
+				((ib == songs_b.end()) ? -1 : ia->first.compare(ib->first));
+			if (cmp < 0) {
+				if (one_sided) {
+					log("  %s: %d -> -", ia->first.c_str(), ia->second);
+					++differ;
+				}
+				++ia;
+			} else if (cmp > 0) {
+				if (one_sided) {
+					log("  %s: - -> %d", ib->first.c_str(), ib->second);
+					++differ;
+				}
+				++ib;
+			} else {
+				if (ia->second != ib->second) {
+					log("  %s: %d -> %d", ia->first.c_str(), ia->second, ib->second);
+					++differ;
+				}
+				++ia;
+				++ib;
+			}
+		}
+		if (differ != before) {
+			++differ_dirs;
+		}
+	}
+	if (differ == 0) {
+		log("%s and %s are in sync.", name_a.c_str(), name_b.c_str());
+		return 0;
+	}
+	log("%d songs differ, in %d directories.", differ, differ_dirs);
+	return 2;
+}
+
+//Compares the serve instances on the two sockets in args.
+int run_compare() {
+	ratesync::IndexClient a(args[0]), b(args[1]);
+	if (!a.Connect() || !b.Connect()) {
+		return 1;
+	}
+	return compare(a, b, a.Path(), b.Path(), true);
+}
+
+//Compares the source with the destination by their hash trees, without
+//changing either. Like a sync, this only covers the source songs that
+//the destination would hold, and songs missing from a destination that
+//doesn't add songs don't count. Returns 0 if they're in sync, 2 otherwise.
+int run_digest(ratesync::ISink* source, ratesync::ISink* dest, const std::string& dest_label) {
+	const bool adds = dest->AddsSong(5);
+	ratesync::SinkMerkle a(source, adds ? dest : NULL), b(dest);
+	log("Hashing the source and your %s...", dest_label.c_str());
+	if (!a.Load() || !b.Load()) {
+		log("Encountered error when reading songs, giving up.");
+		return 1;
+	}
+	ratesync::merkle_node_t node_a, node_b;
+	ratesync::merkle_children_t children;
+	a.Node("", node_a, children);
+	b.Node("", node_b, children);
+	log("source: %016llx, %d songs", (unsigned long long)node_a.digest, node_a.songs);
+	log("%s: %016llx, %d songs", dest_label.c_str(),
+		(unsigned long long)node_b.digest, node_b.songs);
+	return compare(a, b, "The source", "your " + dest_label, adds);
+}
+
+//Describes the destination for the mpd and links commands, so that it
+//can be reopened by apply.
+void dest_desc(std::vector<std::string>& desc) {
+	switch (run_cmd) {
+#ifdef USE_MPDCLIENT
+	case MPD:
+		{
+			std::ostringstream port;
+			port << mpd_port;
+			desc.push_back("mpd");
+			desc.push_back(mpd_host);
+			desc.push_back(port.str());
+		}
+		break;
+#endif
+	case SYMLINK:
+		if (symlink_dir.length() == 0) {
+			symlink_dir = music_dir+"rating"+SEP;
+		} else {
+			format_dir(symlink_dir);
+		}
+		//absolute, so it still works from another working dir
+		desc.push_back("links");
+		desc.push_back(ratesync::SongRoot(music_dir).Dir());
+		desc.push_back(ratesync::SongRoot(symlink_dir).Dir());
+		break;
+	case M3U:
+		if (symlink_dir.length() == 0) {
+			symlink_dir = music_dir+"playlists"+SEP;
+		} else {
+			format_dir(symlink_dir);
+		}
+		desc.push_back("m3u");
+		desc.push_back(ratesync::SongRoot(music_dir).Dir());
+		desc.push_back(ratesync::SongRoot(symlink_dir).Dir());
+		break;
+	case EXPORT:
+		{
+			format_dir(symlink_dir);
+			std::ostringstream min_rating;
+			min_rating << export_options.min_rating;
+			desc.push_back("export");
+			desc.push_back(ratesync::SongRoot(music_dir).Dir());
+			desc.push_back(ratesync::SongRoot(symlink_dir).Dir());
+			desc.push_back(min_rating.str());
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+//Opens the destination described by dest_desc(), or returns NULL.
+ratesync::ISink* new_dest(const std::vector<std::string>& desc, std::string& label) {
+#ifdef USE_MPDCLIENT
+	if (desc.size() == 3 && desc[0] == "mpd") {
+		size_t port;
+		std::stringstream ss(desc[2]);
+		if (!(ss >> port).fail()) {
+			label = "MPD database";
+			mpd_options.connections = auto_jobs ? DEFAULT_JOBS : jobs;
+			return new ratesync::sink::Mpd(desc[1], port, mpd_options);
+		}
+	}
+#endif
+	if (desc.size() == 3 && desc[0] == "links") {
+		label = "symlink directory";
+		return new ratesync::sink::Symlink(desc[1], desc[2]);
+	}
+	if (desc.size() == 3 && desc[0] == "m3u") {
+		label = "playlists";
+		return new ratesync::sink::M3u(desc[1], desc[2]);
+	}
+	if (desc.size() == 4 && desc[0] == "export") {
+		ratesync::sink::export_options_t options;
+		std::stringstream ss(desc[3]);
+		if (!(ss >> options.min_rating).fail()) {
+			label = "export directory";
+			options.jobs = auto_jobs ? DEFAULT_JOBS : jobs;
+			return new ratesync::sink::Export(desc[1], desc[2], options);
+		}
+	}
+	error("Unsupported destination '%s'", desc.empty() ? "" : desc[0].c_str());
+	return NULL;
+}
+
 int main(int argc, char* argv[]) {
+	if (argc >= 2 && strcmp(argv[1], TAG_WORKER_ARG) == 0) {
+		return run_tag_worker(argc, argv);
+	}
 	if (!parse_config(argc, argv)) {
 		return 1;
 	}
 
 	std::string dest_label;
+	std::vector<std::string> desc;
 	ratesync::ISink *in_ptr = NULL, *out_ptr = NULL;
 	switch (run_cmd) {
 	case HELP:
 		syntax(argv[0]);
 		return 0;
+	case SCAN:
+		return run_scan();
+	case MERGE:
+		return run_merge();
+	case COMPARE:
+		return run_compare();
+	case SERVE:
+		{
+			ratesync::ISink* source = new_source();
+			ratesync::IndexServer server(source, socket_path, rescan_interval);
+			bool ok = server.Run();
+			delete source;
+			return ok ? 0 : 1;
+		}
 #ifdef USE_MPDCLIENT
 	case MPD:
-		dest_label = "MPD database";
-		in_ptr = new ratesync::sink::File(music_dir);
-		out_ptr = new ratesync::sink::Mpd(mpd_host, mpd_port);
-		break;
 #endif
 	case SYMLINK:
-		dest_label = "symlink directory";
-		in_ptr = new ratesync::sink::File(music_dir);
-
-		if (symlink_dir.length() == 0) {
-			symlink_dir = music_dir+"rating"+SEP;
-		} else {
-			format_dir(symlink_dir);
+	case M3U:
+	case EXPORT:
+		in_ptr = new_source();
+		dest_desc(desc);
+		break;
+	case APPLY:
+		if (!ratesync::read_change_desc(args[0], desc)) {
+			return 1;
 		}
-		out_ptr = new ratesync::sink::Symlink(music_dir, symlink_dir);
 		break;
 	default:
 		error("%s: no command specified", argv[0]);
@@ -279,10 +1156,50 @@ int main(int argc, char* argv[]) {
 	}
 
 	int ret = 0;
-	{
-		ratesync::Updater updater(in_ptr, out_ptr);
-		log("Calculating changes...");
-		if (updater.Calculate()) {
+	out_ptr = new_dest(desc, dest_label);
+	if (out_ptr == NULL) {
+		ret = 1;
+	} else if (digest) {
+		//like Updater does, so the destination finds renamed songs
+		out_ptr->SetPaths(in_ptr->Paths());
+		ret = run_digest(in_ptr, out_ptr, dest_label);
+	} else if (sample_size > 0) {
+		ratesync::Updater updater(in_ptr, out_ptr, (size_t)max_memory, jobs,
+								  auto_jobs);
+		ret = run_sample(updater, dest_label);
+	} else {
+		ratesync::Updater updater(in_ptr, out_ptr, (size_t)max_memory, jobs,
+								  auto_jobs);
+		if (!baseline.empty()) {
+			updater.SetBaseline(baseline);
+		}
+		bool ok;
+		if (run_cmd == APPLY) {
+			log("Checking your %s...", dest_label.c_str());
+			bool unchanged = false;
+			ok = updater.Import(args[0]) && updater.CheckDest(unchanged);
+			if (ok && !unchanged) {
+				if (force) {
+					log("Your %s changed since the changes were calculated, applying anyway.",
+						dest_label.c_str());
+				} else {
+					log("Your %s changed since the changes were calculated,"
+						" recalculate them or use --force.", dest_label.c_str());
+					ok = false;
+				}
+			}
+		} else {
+			log("Calculating changes...");
+			ok = updater.Calculate();
+		}
+		if (ok && run_cmd != APPLY && !out_file.empty()) {
+			if (updater.Export(out_file, desc) && in_ptr->Synced()) {
+				log("Wrote changes to %s, apply them with '%s apply %s'.",
+					out_file.c_str(), argv[0], out_file.c_str());
+			} else {
+				ret = 1;
+			}
+		} else if (ok) {
 			if (updater.HasChanges()) {
 				log("The following changes are about to be applied to your %s:",
 					dest_label.c_str());
@@ -291,12 +1208,25 @@ int main(int argc, char* argv[]) {
 				txt << "Continue with these changes to your " << dest_label << "?";
 				if (no_confirm || promptYN(txt.str())) {
 					log("Applying changes...");
-					updater.Apply();
-					log("Complete.");
+					if (updater.Apply()) {
+						log("Complete.");
+						if (in_ptr != NULL && !in_ptr->Synced()) {
+							ret = 1;
+						}
+					} else {
+						log("Encountered error when applying changes, some were not applied.");
+						ret = 1;
+					}
 				}
 			} else {
 				log("Your %s is up to date.", dest_label.c_str());
+				if (!updater.SaveBaseline() ||
+					(in_ptr != NULL && !in_ptr->Synced())) {
+					ret = 1;
+				}
 			}
+		} else if (run_cmd == APPLY) {
+			ret = 1;
 		} else {
 			log("Encountered error when calculating changes, giving up.");
 			ret = 1;
@@ -0,0 +1,190 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "merkle.h"
+#include "config.h"
+
+#include <algorithm>
+
+namespace {
+	//Passes on the songs that 'dest' would add.
+	class AddsOutput : public ratesync::ISongOutput {
+	public:
+		AddsOutput(const ratesync::ISink& dest, ratesync::ISongOutput& next)
+			: dest(dest), next(next) { }
+		bool Put(const ratesync::song_t& song, ratesync::rating_t rating) {
+			return !dest.AddsSong(rating) || next.Put(song, rating);
+		}
+	private:
+		const ratesync::ISink& dest;
+		ratesync::ISongOutput& next;
+	};
+
+	//keeps song and directory entries with the same name apart
+	const unsigned char SONG_TAG = 'S', DIR_TAG = 'D';
+
+	uint64_t hash_name(unsigned char tag, const char* name, size_t len, uint64_t hash) {
+		hash = ratesync::hash_bytes(&tag, 1, hash);
+		hash = ratesync::hash_bytes(name, len, hash);
+		const unsigned char end = 0;
+		return ratesync::hash_bytes(&end, 1, hash);
+	}
+
+	//Hashes 'value' little-endian, so that digests match across hosts.
+	uint64_t hash_uint(uint64_t value, uint64_t hash) {
+		unsigned char bytes[8];
+		for (size_t i = 0; i < sizeof(bytes); ++i) {
+			bytes[i] = (unsigned char)(value >> (8 * i));
+		}
+		return ratesync::hash_bytes(bytes, sizeof(bytes), hash);
+	}
+}
+
+bool ratesync::MerkleTree::Put(const song_t& song, rating_t rating) {
+	if (!last.empty() && song <= last) {
+		config::error("Song %s is out of order for hashing (after %s)",
+					  song.c_str(), last.c_str());
+		return false;
+	}
+	last = song;
+
+	//close the directories this song isn't in, then open the ones it is
+	if (open.empty()) {
+		open.push_back(std::make_pair(std::string(), merkle_node_t()));
+	}
+	while (open.size() > 1 && song.compare(0, open.back().first.size(), open.back().first) != 0) {
+		close_dir();
+	}
+	size_t sep;
+	while ((sep = song.find(SEP, open.back().first.size())) != std::string::npos) {
+		open.push_back(std::make_pair(song.substr(0, sep + 1), merkle_node_t()));
+	}
+
+	const std::string& dir = open.back().first;
+	merkle_node_t& node = open.back().second;
+	const unsigned char r = (unsigned char)(rating + 2);
+	const char* name = song.data() + dir.size();
+	const size_t len = song.size() - dir.size();
+	node.digest = hash_bytes(&r, 1, hash_name(SONG_TAG, name, len, node.digest));
+	node.files = hash_bytes(&r, 1, hash_name(SONG_TAG, name, len, node.files));
+	++node.songs;
+	return true;
+}
+
+void ratesync::MerkleTree::close_dir() {
+	const std::pair<std::string, merkle_node_t> done = open.back();
+	open.pop_back();
+	dirs.insert(done);
+	if (open.empty()) {
+		return;
+	}
+	//the parent covers the subdirectory by its name and digest
+	const std::string& parent = open.back().first;
+	merkle_node_t& node = open.back().second;
+	node.digest = hash_name(DIR_TAG, done.first.data() + parent.size(),
+							done.first.size() - parent.size(), node.digest);
+	node.digest = hash_uint(done.second.digest, node.digest);
+	node.songs += done.second.songs;
+}
+
+void ratesync::MerkleTree::Finish() {
+	while (!open.empty()) {
+		close_dir();
+	}
+	last.clear();
+}
+
+bool ratesync::MerkleTree::Node(const std::string& dir, merkle_node_t& node,
+								merkle_children_t& children) {
+	std::map<std::string, merkle_node_t>::const_iterator it = dirs.find(dir);
+	node = (it != dirs.end()) ? it->second : merkle_node_t();
+	if (it == dirs.end()) {
+		return true;
+	}
+	//the subdirectories follow 'dir' in order, skip over each one's own
+	//subdirectories by seeking past "<child>/..."
+	for (++it; it != dirs.end() && it->first.compare(0, dir.size(), dir) == 0; ) {
+		children.push_back(*it);
+		std::string next(it->first);
+		next[next.size() - 1] = SEP + 1;
+		it = dirs.lower_bound(next);
+	}
+	return true;
+}
+
+bool ratesync::SinkMerkle::Load() {
+	if (adds_to != NULL) {
+		AddsOutput adds(*adds_to, index);
+		if (!sink->Get(adds)) {
+			return false;
+		}
+	} else if (!sink->Get(index)) {
+		return false;
+	}
+	index.Finish();
+	index.Range("", UNRATED, 5, tree);
+	tree.Finish();
+	return true;
+}
+
+bool ratesync::SinkMerkle::Songs(const std::string& dir, std::map<song_t, rating_t>& out) {
+	MapOutput map(out);
+	DirOutput songs(dir, map);
+	index.Range(dir, UNRATED, 5, songs);
+	return true;
+}
+
+bool ratesync::merkle_diff(IMerkle& a, IMerkle& b, std::vector<std::string>& dirs) {
+	std::vector<std::string> pending(1, std::string());
+	while (!pending.empty()) {
+		const std::string dir = pending.back();
+		pending.pop_back();
+		merkle_node_t node_a, node_b;
+		merkle_children_t children_a, children_b;
+		if (!a.Node(dir, node_a, children_a) || !b.Node(dir, node_b, children_b)) {
+			return false;
+		}
+		if (node_a == node_b) {
+			continue;
+		}
+		if (node_a.files != node_b.files) {
+			dirs.push_back(dir);
+		}
+		//descend into the subdirectories that differ or are only on one side
+		std::map<std::string, merkle_node_t> by_name(children_b.begin(), children_b.end());
+		for (merkle_children_t::const_iterator
+				 it = children_a.begin(); it != children_a.end(); ++it) {
+			std::map<std::string, merkle_node_t>::iterator match = by_name.find(it->first);
+			if (match == by_name.end()) {
+				pending.push_back(it->first);
+			} else {
+				if (!(match->second == it->second)) {
+					pending.push_back(it->first);
+				}
+				by_name.erase(match);
+			}
+		}
+		for (std::map<std::string, merkle_node_t>::const_iterator
+				 it = by_name.begin(); it != by_name.end(); ++it) {
+			pending.push_back(it->first);
+		}
+	}
+	std::sort(dirs.begin(), dirs.end());
+	return true;
+}
@@ -0,0 +1,124 @@
+#ifndef RATESYNC_MERKLE_H
+#define RATESYNC_MERKLE_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "song-index.h"
+
+//Directories are named like key prefixes: "" for the root, otherwise
+//"a/b/" with the trailing separator.
+
+namespace ratesync {
+	struct merkle_node_t {
+		merkle_node_t() : digest(HASH_INIT), files(HASH_INIT), songs(0) { }
+		bool operator==(const merkle_node_t& o) const {
+			return digest == o.digest && songs == o.songs;
+		}
+		//of everything below the directory, and of just the songs directly
+		//in it (HASH_INIT if there are none)
+		uint64_t digest, files;
+		//songs below the directory
+		size_t songs;
+	};
+	typedef std::vector<std::pair<std::string, merkle_node_t> > merkle_children_t;
+
+	//A hash tree over the directories of a set of songs, local or remote.
+	class IMerkle {
+	public:
+		virtual ~IMerkle() { }
+		//Gets the node for 'dir' and those of its subdirectories. A
+		//directory without songs gets an empty node. Returns false on error.
+		virtual bool Node(const std::string& dir, merkle_node_t& node,
+						  merkle_children_t& children) = 0;
+	};
+
+	//An IMerkle which can also list the songs themselves, to find those
+	//that differ within the directories found by merkle_diff.
+	class IMerkleSongs : public IMerkle {
+	public:
+		//Adds the songs directly in 'dir' to 'out'. Returns false on error.
+		virtual bool Songs(const std::string& dir, std::map<song_t, rating_t>& out) = 0;
+	};
+
+	//Builds the hash tree of the songs passed to Put(), which must come
+	//in key order (eg from SongIndex::Range or a RunMerger). Each song
+	//is hashed with its rating, and each directory over its songs and
+	//subdirectories in order.
+	class MerkleTree : public ISongOutput, public IMerkle {
+	public:
+		MerkleTree() { }
+
+		//Returns false if 'song' is out of order.
+		bool Put(const song_t& song, rating_t rating);
+		//Call once all songs are in.
+		void Finish();
+
+		size_t Dirs() const { return dirs.size(); }
+		bool Node(const std::string& dir, merkle_node_t& node,
+				  merkle_children_t& children);
+
+	private:
+		MerkleTree(const MerkleTree&);//disallow copy
+		//Closes the innermost open directory, adding it to its parent.
+		void close_dir();
+
+		std::map<std::string, merkle_node_t> dirs;
+		//the directories containing the last song, outermost first
+		std::vector<std::pair<std::string, merkle_node_t> > open;
+		song_t last;
+	};
+
+	//The hash tree of a local sink, along with its songs (in a SongIndex).
+	//With 'adds_to', only the songs that sink would add are kept (see
+	//ISink::AddsSong), to compare a source with that destination.
+	class SinkMerkle : public IMerkleSongs {
+	public:
+		SinkMerkle(ISink* sink, const ISink* adds_to = NULL)
+			: sink(sink), adds_to(adds_to) { }
+
+		//Gets the songs from the sink and hashes them.
+		bool Load();
+		size_t Size() const { return index.Size(); }
+
+		bool Node(const std::string& dir, merkle_node_t& node,
+				  merkle_children_t& children) {
+			return tree.Node(dir, node, children);
+		}
+		bool Songs(const std::string& dir, std::map<song_t, rating_t>& out);
+
+	private:
+		SinkMerkle(const SinkMerkle&);//disallow copy
+
+		ISink* sink;
+		const ISink* adds_to;
+		SongIndex index;
+		MerkleTree tree;
+	};
+
+	//Appends the directories whose own songs differ between 'a' and 'b' to
+	//'dirs', only descending into directories whose digests differ.
+	bool merkle_diff(IMerkle& a, IMerkle& b, std::vector<std::string>& dirs);
+}
+
+#endif
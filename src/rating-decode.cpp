@@ -0,0 +1,39 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rating-decode.h"
+
+const char* ratesync::decode::format_int(int rating, char* buf) {
+	char tmp[12];
+	size_t len = 0;
+	bool neg = (rating < 0);
+	unsigned int val = neg ? -(unsigned int)rating : rating;
+	do {
+		tmp[len++] = '0' + (val % 10);
+		val /= 10;
+	} while (val > 0);
+	size_t i = 0;
+	if (neg) {
+		buf[i++] = '-';
+	}
+	while (len > 0) {
+		buf[i++] = tmp[--len];
+	}
+	buf[i] = 0;
+	return buf;
+}
@@ -0,0 +1,135 @@
+#ifndef RATESYNC_RATING_DECODE_H
+#define RATESYNC_RATING_DECODE_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "song.h"
+
+//Parsers for the textual rating values found in tags and stickers.
+//These are run once per song, so they work in-place on whatever string
+//type the tag library hands out (anything with size() and a const
+//operator[]) and never allocate.
+
+namespace ratesync {
+	namespace decode {
+		//Wraps a C string so that it can be passed to the parsers below.
+		class CStr {
+		public:
+			CStr(const char* str) : str(str), len(strlen(str)) { }
+			size_t size() const { return len; }
+			char operator[](size_t i) const { return str[i]; }
+		private:
+			const char* str;
+			const size_t len;
+		};
+
+		//Whether 'str' begins with the ascii string 'prefix'.
+		template <typename StrT>
+		bool starts_with(const StrT& str, const char* prefix) {
+			const size_t size = str.size();
+			size_t i = 0;
+			for (; prefix[i] != 0; ++i) {
+				if (i >= size || str[i] != (unsigned char)prefix[i]) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		//Whether 'str' equals the ascii string 'match'.
+		template <typename StrT>
+		bool equals(const StrT& str, const char* match) {
+			return starts_with(str, match) && (size_t)str.size() == strlen(match);
+		}
+
+		//Parses a non-negative integer, eg "4". Surrounding spaces are ignored.
+		template <typename StrT>
+		bool parse_int(const StrT& str, int& out) {
+			const size_t size = str.size();
+			size_t i = 0;
+			while (i < size && str[i] == ' ') {
+				++i;
+			}
+			int val = 0;
+			size_t digits = 0;
+			for (; i < size && str[i] >= '0' && str[i] <= '9'; ++i, ++digits) {
+				if (val > 100000000) {
+					return false;//no rating is this big, avoid overflow
+				}
+				val = val * 10 + (str[i] - '0');
+			}
+			while (i < size && str[i] == ' ') {
+				++i;
+			}
+			if (digits == 0 || i != size) {
+				return false;
+			}
+			out = val;
+			return true;
+		}
+
+		//Parses a non-negative decimal, eg "0.8", into thousandths (eg 800),
+		//rounding to the nearest thousandth. Surrounding spaces are ignored.
+		template <typename StrT>
+		bool parse_milli(const StrT& str, int& out) {
+			const size_t size = str.size();
+			size_t i = 0;
+			while (i < size && str[i] == ' ') {
+				++i;
+			}
+			int whole = 0;
+			size_t digits = 0;
+			for (; i < size && str[i] >= '0' && str[i] <= '9'; ++i, ++digits) {
+				if (whole > 100000) {
+					return false;
+				}
+				whole = whole * 10 + (str[i] - '0');
+			}
+			int frac = 0, scale = 100;
+			bool round_up = false;
+			if (i < size && str[i] == '.') {
+				for (++i; i < size && str[i] >= '0' && str[i] <= '9'; ++i, ++digits) {
+					if (scale > 0) {
+						frac += (str[i] - '0') * scale;
+						scale /= 10;
+					} else if (scale == 0) {
+						round_up = (str[i] >= '5');
+						scale = -1;
+					}
+				}
+			}
+			while (i < size && str[i] == ' ') {
+				++i;
+			}
+			if (digits == 0 || i != size) {
+				return false;
+			}
+			out = whole * 1000 + frac + (round_up ? 1 : 0);
+			return true;
+		}
+
+		//Writes 'rating' as a decimal into 'buf', which must hold at least
+		//12 chars. Returns 'buf'.
+		const char* format_int(int rating, char* buf);
+	}
+}
+
+#endif
@@ -0,0 +1,218 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rating-scheme.h"
+#include "config.h"
+
+namespace {
+	using ratesync::rating_t;
+	using ratesync::decode::scheme_t;
+
+	//(0.0,0.2] -> 1, (0.2,0.4] -> 2, ..., (0.8,1.0] -> 5
+	rating_t fraction_stars(int milli) {
+		if (milli > 800) {
+			return 5;
+		} else if (milli > 600) {
+			return 4;
+		} else if (milli > 400) {
+			return 3;
+		} else if (milli > 200) {
+			return 2;
+		} else {
+			return 1;
+		}
+	}
+
+	//ratesync's original POPM thresholds
+	rating_t popm_default(int i) {
+		if (i == 0) {
+			return UNRATED;
+		} else if (i < 64) {
+			return 1;
+		} else if (i < 128) {
+			return 2;
+		} else if (i < 192) {
+			return 3;
+		} else if (i < 255) {
+			return 4;
+		} else {
+			return 5;
+		}
+	}
+	//Windows Media Player writes 1/64/128/196/255, most other players copy it
+	rating_t popm_wmp(int i) {
+		if (i == 0) {
+			return UNRATED;
+		} else if (i < 32) {
+			return 1;
+		} else if (i < 96) {
+			return 2;
+		} else if (i < 160) {
+			return 3;
+		} else if (i < 224) {
+			return 4;
+		} else {
+			return 5;
+		}
+	}
+	//Quod Libet stores its 0.0-1.0 rating scaled to 0-255
+	rating_t popm_linear(int i) {
+		return (i == 0) ? UNRATED : fraction_stars((i * 1000 + 127) / 255);
+	}
+
+	//ratesync's original 'RATING:*' mapping, where 0.5 means unrated
+	rating_t xiph_default(int milli) {
+		return (milli == 500) ? UNRATED : fraction_stars(milli);
+	}
+	//FMPS_RATING: 0.0-1.0
+	rating_t fmps(int milli) {
+		return fraction_stars(milli);
+	}
+	//RATING=0-100 (MusicBee, MediaMonkey), scaled to thousandths
+	rating_t percent(int milli) {
+		return (milli == 0) ? UNRATED : fraction_stars(milli);
+	}
+	//RATING=1-5 (foobar2000), scaled to thousandths
+	rating_t stars(int milli) {
+		return (milli == 0) ? UNRATED : milli / 200;
+	}
+
+	const char* wmp_emails[] = {
+		"Windows Media Player 9 Series",
+		"MusicBee",
+		"no@email",//foobar2000
+		"rating@winamp.com",
+		NULL
+	};
+	const char* quodlibet_emails[] = {
+		"quodlibet@lists.sacredchao.net",
+		NULL
+	};
+
+	using namespace ratesync::decode;
+	scheme_t schemes[] = {
+		{ "wmp", "POPM written by WMP, MusicBee, foobar2000, Winamp",
+		  SCHEME_POPM, wmp_emails, NULL, false, FORMAT_FRACTION, popm_wmp, { 0 } },
+		{ "quodlibet", "POPM written by Quod Libet",
+		  SCHEME_POPM, quodlibet_emails, NULL, false, FORMAT_FRACTION, popm_linear, { 0 } },
+		{ "popm", "POPM with any email",
+		  SCHEME_POPM, NULL, NULL, false, FORMAT_FRACTION, popm_default, { 0 } },
+		{ "xiph", "RATING:<user>=0.0-1.0, 0.5 is unrated",
+		  SCHEME_XIPH, NULL, "RATING:", true, FORMAT_FRACTION, xiph_default, { 0 } },
+		{ "fmps", "FMPS_RATING=0.0-1.0 (Quod Libet, Amarok)",
+		  SCHEME_XIPH, NULL, "FMPS_RATING", false, FORMAT_FRACTION, fmps, { 0 } },
+		{ "rating100", "RATING=0-100 (MusicBee, MediaMonkey)",
+		  SCHEME_XIPH, NULL, "RATING", false, FORMAT_PERCENT, percent, { 0 } },
+		{ "rating5", "RATING=1-5 (foobar2000)",
+		  SCHEME_XIPH, NULL, "RATING", false, FORMAT_STARS, stars, { 0 } },
+		{ "mp4rate", "MP4 'rate'=0-100",
+		  SCHEME_MP4, NULL, "rate", false, FORMAT_PERCENT, percent, { 0 } },
+		{ "mp4rating", "MP4 iTunes:RATING=0-100 (MediaMonkey)",
+		  SCHEME_MP4, NULL, "----:com.apple.iTunes:RATING", false, FORMAT_PERCENT, percent, { 0 } },
+		{ "mp4fmps", "MP4 iTunes:FMPS_Rating=0.0-1.0",
+		  SCHEME_MP4, NULL, "----:com.apple.iTunes:FMPS_Rating", false, FORMAT_FRACTION, fmps, { 0 } },
+		{ "ape100", "APE RATING=0-100 (MediaMonkey)",
+		  SCHEME_APE, NULL, "RATING", false, FORMAT_PERCENT, percent, { 0 } },
+		{ "ape5", "APE RATING=1-5 (foobar2000)",
+		  SCHEME_APE, NULL, "RATING", false, FORMAT_STARS, stars, { 0 } },
+		{ "apefmps", "APE FMPS_RATING=0.0-1.0",
+		  SCHEME_APE, NULL, "FMPS_RATING", false, FORMAT_FRACTION, fmps, { 0 } }
+	};
+	const size_t scheme_count = sizeof(schemes)/sizeof(schemes[0]);
+
+	const char* DEFAULT_SCHEMES =
+		"wmp,quodlibet,popm,xiph,fmps,rating100,mp4rate,mp4rating,mp4fmps,ape100,apefmps";
+
+	void build_table(scheme_t& scheme) {
+		for (int i = 0; i <= 1000; ++i) {
+			bool valid;
+			switch (scheme.format) {
+			case FORMAT_PERCENT:
+				valid = (i % 10 == 0);
+				break;
+			case FORMAT_STARS:
+				valid = (i % 200 == 0);
+				break;
+			default:
+				valid = true;
+				break;
+			}
+			if (scheme.tag == SCHEME_POPM) {
+				valid = (i <= 255);
+			}
+			scheme.table[i] = valid ? scheme.decode(i) : INVALID;
+		}
+	}
+
+	struct SchemeInit {
+		SchemeInit() {
+			for (size_t i = 0; i < scheme_count; ++i) {
+				build_table(schemes[i]);
+			}
+			set_schemes(DEFAULT_SCHEMES);
+		}
+	};
+}
+
+std::vector<const scheme_t*> ratesync::decode::active_schemes;
+
+namespace {
+	//after active_schemes, so that it's constructed by then
+	SchemeInit init;
+}
+
+bool ratesync::decode::set_schemes(const std::string& names) {
+	std::vector<const scheme_t*> order;
+	size_t start = 0;
+	while (start <= names.size()) {
+		size_t end = names.find(',', start);
+		if (end == std::string::npos) {
+			end = names.size();
+		}
+		std::string name = names.substr(start, end - start);
+		start = end + 1;
+		if (name.empty()) {
+			continue;
+		}
+
+		size_t i = 0;
+		for (; i < scheme_count; ++i) {
+			if (name == schemes[i].name) {
+				break;
+			}
+		}
+		if (i == scheme_count) {
+			config::error("Unknown rating scheme '%s'", name.c_str());
+			return false;
+		}
+		order.push_back(&schemes[i]);
+	}
+	if (order.empty()) {
+		config::error("No rating schemes specified");
+		return false;
+	}
+	active_schemes.swap(order);
+	return true;
+}
+
+void ratesync::decode::print_schemes() {
+	for (size_t i = 0; i < scheme_count; ++i) {
+		config::error("    %-12s %s", schemes[i].name, schemes[i].description);
+	}
+	config::error("  (default: %s)", DEFAULT_SCHEMES);
+}
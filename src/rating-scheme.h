@@ -0,0 +1,169 @@
+#ifndef RATESYNC_RATING_SCHEME_H
+#define RATESYNC_RATING_SCHEME_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+
+#include "rating-decode.h"
+
+//Registry of the rating conventions used by the various taggers.
+//Each scheme owns a lookup table from its raw value (a POPM byte, or a
+//text value scaled to thousandths) to 1-5, built once at startup, so
+//decoding a tag is a handful of compares and a table lookup.
+
+namespace ratesync {
+	namespace decode {
+		enum scheme_tag_t {
+			SCHEME_POPM,//ID3v2 POPM frame, selected by email
+			//text fields, selected by key:
+			SCHEME_XIPH,//Xiph comment (Vorbis, Opus, FLAC, Speex)
+			SCHEME_APE,//APEv2 tag (APE, WavPack)
+			SCHEME_MP4//MP4 atom (M4A)
+		};
+		enum scheme_format_t {
+			FORMAT_FRACTION,//0.0-1.0
+			FORMAT_PERCENT,//0-100
+			FORMAT_STARS//1-5
+		};
+
+		//Table value for raw values that aren't valid for a scheme.
+		static const signed char INVALID = -2;
+
+		struct scheme_t {
+			const char* name;
+			const char* description;
+			scheme_tag_t tag;
+			//SCHEME_POPM: NULL-terminated emails, or NULL to match any email
+			const char* const* emails;
+			//text fields: the key (uppercase for Xiph/APE), optionally a prefix
+			const char* key;
+			bool key_is_prefix;
+			scheme_format_t format;
+			//maps a raw value to a rating, once to fill in 'table'
+			rating_t (*decode)(int raw);
+			//POPM: indexed by the rating byte, text fields: by thousandths
+			signed char table[1001];
+		};
+
+		//The enabled schemes, highest priority first.
+		extern std::vector<const scheme_t*> active_schemes;
+
+		//Enables the comma-separated list of scheme names, in priority order.
+		bool set_schemes(const std::string& names);
+
+		//Writes the list of available schemes to the error log (for --help).
+		void print_schemes();
+
+		//Decodes a POPM frame. Only schemes with a better (lower) priority
+		//than 'priority' are considered, which is updated when one matches.
+		//Start 'priority' at active_schemes.size() and call once per frame to
+		//pick the best frame.
+		template <typename StrT>
+		bool popm_rating(const StrT& email, int popm,
+						 rating_t& out, size_t& priority) {
+			for (size_t i = 0; i < priority && i < active_schemes.size(); ++i) {
+				const scheme_t& s = *active_schemes[i];
+				if (s.tag != SCHEME_POPM) {
+					continue;
+				}
+				if (s.emails != NULL) {
+					const char* const* email_it = s.emails;
+					while (*email_it != NULL && !equals(email, *email_it)) {
+						++email_it;
+					}
+					if (*email_it == NULL) {
+						continue;
+					}
+				}
+				signed char r = s.table[popm & 0xff];
+				if (r == INVALID) {
+					continue;
+				}
+				out = r;
+				priority = i;
+				return true;
+			}
+			return false;
+		}
+
+		//Whether scheme 's' reads the text field 'key'.
+		template <typename KeyT>
+		bool field_key(const scheme_t& s, scheme_tag_t tag, const KeyT& key) {
+			return s.tag == tag &&
+				(s.key_is_prefix ? starts_with(key, s.key) : equals(key, s.key));
+		}
+
+		//Whether field_rating() would look at the value of a 'tag' type field
+		//'key', so that the values of other fields needn't be converted.
+		template <typename KeyT>
+		bool field_key(scheme_tag_t tag, const KeyT& key, size_t priority) {
+			for (size_t i = 0; i < priority && i < active_schemes.size(); ++i) {
+				if (field_key(*active_schemes[i], tag, key)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		//Decodes a text field found in a 'tag' type tag, see popm_rating()
+		//for 'priority'.
+		template <typename KeyT, typename ValT>
+		bool field_rating(scheme_tag_t tag, const KeyT& key, const ValT& value,
+						  rating_t& out, size_t& priority) {
+			for (size_t i = 0; i < priority && i < active_schemes.size(); ++i) {
+				const scheme_t& s = *active_schemes[i];
+				if (!field_key(s, tag, key)) {
+					continue;
+				}
+				int milli;
+				switch (s.format) {
+				case FORMAT_FRACTION:
+					if (!parse_milli(value, milli)) {
+						continue;
+					}
+					break;
+				case FORMAT_PERCENT:
+					if (!parse_int(value, milli) || milli > 100) {
+						continue;
+					}
+					milli *= 10;
+					break;
+				case FORMAT_STARS:
+					if (!parse_int(value, milli) || milli > 5) {
+						continue;
+					}
+					milli *= 200;
+					break;
+				default:
+					continue;
+				}
+				if (milli > 1000 || s.table[milli] == INVALID) {
+					continue;
+				}
+				out = s.table[milli];
+				priority = i;
+				return true;
+			}
+			return false;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,157 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "recordio.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+	//Bigger than any path we'll ever see, protects against corrupt files.
+	const unsigned long long MAX_STRING = 1024 * 1024;
+
+	inline unsigned long long zigzag(ratesync::rating_t r) {
+		return (r < 0) ? ((unsigned long long)(-(long long)r) << 1) - 1 : (unsigned long long)r << 1;
+	}
+	inline ratesync::rating_t unzigzag(unsigned long long v) {
+		return (v & 1) ? -(ratesync::rating_t)((v + 1) >> 1) : (ratesync::rating_t)(v >> 1);
+	}
+}
+
+FILE* ratesync::record::temp_file() {
+	const char* dir = getenv("TMPDIR");
+	std::string path((dir != NULL && dir[0] != 0) ? dir : "/tmp");
+	path += "/ratesync-XXXXXX";
+
+	int fd = mkstemp(&path[0]);
+	if (fd < 0) {
+		config::error("Unable to create temporary file %s", path.c_str());
+		return NULL;
+	}
+	unlink(path.c_str());
+	FILE* f = fdopen(fd, "w+b");
+	if (f == NULL) {
+		close(fd);
+	}
+	return f;
+}
+
+void ratesync::record::make_parents(const std::string& path) {
+	for (size_t sep = path.find(SEP, 1); sep != std::string::npos;
+		 sep = path.find(SEP, sep + 1)) {
+		mkdir(path.substr(0, sep).c_str(), 0700);
+	}
+}
+
+bool ratesync::record::write_uint(FILE* f, unsigned long long val) {
+	unsigned char buf[10];
+	size_t len = 0;
+	while (val >= 0x80) {
+		buf[len++] = (unsigned char)(val | 0x80);
+		val >>= 7;
+	}
+	buf[len++] = (unsigned char)val;
+	return fwrite(buf, 1, len, f) == len;
+}
+
+bool ratesync::record::read_uint(FILE* f, unsigned long long& val) {
+	val = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int c = getc(f);
+		if (c == EOF) {
+			return false;
+		}
+		val |= (unsigned long long)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ratesync::record::write_string(FILE* f, const std::string& str) {
+	return write_uint(f, str.size()) &&
+		fwrite(str.data(), 1, str.size(), f) == str.size();
+}
+
+bool ratesync::record::read_string(FILE* f, std::string& str) {
+	unsigned long long len;
+	if (!read_uint(f, len) || len > MAX_STRING) {
+		return false;
+	}
+	str.resize((size_t)len);
+	return len == 0 || fread(&str[0], 1, (size_t)len, f) == len;
+}
+
+bool ratesync::record::write_song(FILE* f, const song_t& song, rating_t rating) {
+	return write_string(f, song) && write_uint(f, zigzag(rating));
+}
+
+bool ratesync::record::write_change(FILE* f, const song_ratings_t& change) {
+	return write_string(f, change.path) &&
+		write_uint(f, zigzag(change.rating_old)) &&
+		write_uint(f, zigzag(change.rating_new));
+}
+
+bool ratesync::record::read_song(FILE* f, song_t& song, rating_t& rating) {
+	unsigned long long r;
+	if (!read_string(f, song) || song.empty() || !read_uint(f, r)) {
+		return false;
+	}
+	rating = unzigzag(r);
+	return true;
+}
+
+void ratesync::record::songs_end_t::Add(const song_t& song, rating_t rating) {
+	++count;
+	checksum = hash_bytes(song.data(), song.size(), checksum);
+	//little-endian, so that files can be read on other hosts
+	unsigned long long r = zigzag(rating);
+	unsigned char bytes[8];
+	for (size_t i = 0; i < sizeof(bytes); ++i, r >>= 8) {
+		bytes[i] = (unsigned char)r;
+	}
+	checksum = hash_bytes(bytes, sizeof(bytes), checksum);
+}
+
+bool ratesync::record::write_songs_end(FILE* f, const songs_end_t& end) {
+	return write_string(f, std::string()) &&
+		write_uint(f, end.count) && write_uint(f, end.checksum);
+}
+
+bool ratesync::record::read_songs_end(FILE* f, songs_end_t& end) {
+	unsigned long long checksum;
+	if (!read_uint(f, end.count) || !read_uint(f, checksum)) {
+		return false;
+	}
+	end.checksum = checksum;
+	return true;
+}
+
+bool ratesync::record::read_change(FILE* f, song_ratings_t& change) {
+	unsigned long long r_old, r_new;
+	if (!read_string(f, change.path) ||
+		!read_uint(f, r_old) || !read_uint(f, r_new)) {
+		return false;
+	}
+	change.rating_old = unzigzag(r_old);
+	change.rating_new = unzigzag(r_new);
+	return true;
+}
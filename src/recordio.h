@@ -0,0 +1,74 @@
+#ifndef RATESYNC_RECORDIO_H
+#define RATESYNC_RECORDIO_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+
+#include "song.h"
+
+//Compact binary records for songs and rating changes, used for
+//temporary spill files as well as files that are kept around.
+//Integers are varints (ratings zigzag-encoded), strings are
+//length-prefixed.
+
+namespace ratesync {
+	namespace record {
+		//Creates an anonymous temporary file in $TMPDIR (or /tmp), which
+		//is removed once closed. Returns NULL on error.
+		FILE* temp_file();
+		//Creates the directories leading up to 'path', for files kept
+		//around (eg in ~/.cache).
+		void make_parents(const std::string& path);
+
+		bool write_uint(FILE* f, unsigned long long val);
+		bool read_uint(FILE* f, unsigned long long& val);
+
+		bool write_string(FILE* f, const std::string& str);
+		bool read_string(FILE* f, std::string& str);
+
+		bool write_song(FILE* f, const song_t& song, rating_t rating);
+		bool write_change(FILE* f, const song_ratings_t& change);
+
+		//These return false at the end of the file or on error,
+		//use ferror() to tell which.
+		bool read_song(FILE* f, song_t& song, rating_t& rating);
+		bool read_change(FILE* f, song_ratings_t& change);
+
+		//How many songs a file holds and a checksum of them. Files of
+		//songs end with an empty key followed by these, so that one that
+		//was cut short isn't taken for a complete one.
+		struct songs_end_t {
+			songs_end_t() : count(0), checksum(HASH_INIT) { }
+			void Add(const song_t& song, rating_t rating);
+			bool operator==(const songs_end_t& other) const {
+				return count == other.count && checksum == other.checksum;
+			}
+
+			unsigned long long count;
+			uint64_t checksum;
+		};
+		bool write_songs_end(FILE* f, const songs_end_t& end);
+		//Call once read_song returns false without ferror() or feof()
+		//being set, ie after the empty key.
+		bool read_songs_end(FILE* f, songs_end_t& end);
+	}
+}
+
+#endif
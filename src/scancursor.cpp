@@ -0,0 +1,74 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "scancursor.h"
+#include "recordio.h"
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+	//bump the trailing digit if the format changes
+	const char MAGIC[] = "RSCUR1\n";
+	const size_t MAGIC_LEN = sizeof(MAGIC) - 1;
+}
+
+bool ratesync::ScanCursor::Load(std::string& after) {
+	after.clear();
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == NULL) {
+		return errno == ENOENT;
+	}
+	char magic[MAGIC_LEN];
+	std::string file_scope, file_after;
+	bool ok = fread(magic, 1, MAGIC_LEN, f) == MAGIC_LEN &&
+		memcmp(magic, MAGIC, MAGIC_LEN) == 0 &&
+		record::read_string(f, file_scope) && record::read_string(f, file_after);
+	fclose(f);
+	if (!ok) {
+		config::error("Ignoring unreadable scan cursor %s", path.c_str());
+	} else if (file_scope != scope) {
+		config::debug("Scan cursor %s is for %s, starting over", path.c_str(), file_scope.c_str());
+	} else {
+		after = file_after;
+	}
+	return true;
+}
+
+bool ratesync::ScanCursor::Save(const std::string& after) {
+	const std::string tmp_path = path + ".tmp";
+	record::make_parents(path);
+	FILE* f = fopen(tmp_path.c_str(), "wb");
+	if (f == NULL) {
+		config::error("Unable to create scan cursor %s", tmp_path.c_str());
+		return false;
+	}
+	bool ok = fwrite(MAGIC, 1, MAGIC_LEN, f) == MAGIC_LEN &&
+		record::write_string(f, scope) && record::write_string(f, after);
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		config::error("Unable to write scan cursor %s", path.c_str());
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,46 @@
+#ifndef RATESYNC_SCANCURSOR_H
+#define RATESYNC_SCANCURSOR_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string>
+
+namespace ratesync {
+	//Where a budgeted scan stopped, kept across runs so that the next one
+	//resumes after it. Only valid for the same 'scope' (music dir, subtree,
+	//shard and destination): a different scope starts over.
+	class ScanCursor {
+	public:
+		ScanCursor(const std::string& path, const std::string& scope)
+			: path(path), scope(scope) { }
+
+		//Gets the last song scanned, or "" to start from the beginning.
+		bool Load(std::string& after);
+		//Records the last song scanned, "" once the whole library was.
+		bool Save(const std::string& after);
+
+		const std::string& Path() const { return path; }
+
+	private:
+		const std::string path, scope;
+	};
+}
+
+#endif
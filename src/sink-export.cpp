@@ -0,0 +1,376 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sink-export.h"
+#include "sink-symlink.h"
+#include "threadpool.h"
+#include "config.h"
+
+#include <algorithm>
+#include <queue>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+namespace {
+	const char PART_SUFFIX[] = ".part";
+	const size_t COPY_BUFFER_SIZE = 256 * 1024;
+
+	bool ends_with(const std::string& str, const char* suffix) {
+		size_t len = strlen(suffix);
+		return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+	}
+
+	//FAT keeps mtimes to 2s (and exFAT to 10ms), so copies there never get
+	//the exact mtime of the original
+	const long long MTIME_SLACK_NS = 2000000000LL;
+
+	//Whether 'copy' still matches 'orig', going by size and mtime.
+	bool up_to_date(const struct stat& orig, const struct stat& copy) {
+		const long long diff =
+			(orig.st_mtim.tv_sec - (long long)copy.st_mtim.tv_sec) * 1000000000LL +
+			(orig.st_mtim.tv_nsec - copy.st_mtim.tv_nsec);
+		return orig.st_size == copy.st_size &&
+			diff <= MTIME_SLACK_NS && diff >= -MTIME_SLACK_NS;
+	}
+
+	//Creates the directories leading up to 'path'.
+	bool make_parents(const std::string& path) {
+		for (size_t sep = path.find(SEP, 1); sep != std::string::npos;
+			 sep = path.find(SEP, sep + 1)) {
+			std::string dir = path.substr(0, sep);
+			if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool copy_data(int in, int out) {
+#ifdef FICLONE
+		//same filesystem with reflink support: share the blocks, no copying
+		if (ioctl(out, FICLONE, in) == 0) {
+			return true;
+		}
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+		//lets the kernel (or a network filesystem's server) do the copy
+		while (true) {
+			ssize_t n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+			if (n == 0) {
+				return true;
+			}
+			if (n < 0) {
+				if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+					errno == EOPNOTSUPP) {
+					break;//not supported here, copy the rest by hand
+				}
+				return false;
+			}
+		}
+#endif
+		std::vector<char> buf(COPY_BUFFER_SIZE);
+		while (true) {
+			ssize_t n = read(in, &buf[0], buf.size());
+			if (n == 0) {
+				return true;
+			}
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			for (ssize_t done = 0; done < n; ) {
+				ssize_t w = write(out, &buf[done], n - done);
+				if (w < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					return false;
+				}
+				done += w;
+			}
+		}
+	}
+
+	//Copies 'src' to 'dest' via a temp file, keeping the mtime so that the
+	//copy can be recognized as up to date later.
+	bool copy_file(const std::string& src, const std::string& dest) {
+		int in = open(src.c_str(), O_RDONLY);
+		if (in < 0) {
+			ratesync::config::error("Unable to open %s", src.c_str());
+			return false;
+		}
+		struct stat sb;
+		const std::string part = dest + PART_SUFFIX;
+		int out = -1;
+		bool ok = fstat(in, &sb) == 0 && make_parents(dest) &&
+			(out = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0 &&
+			copy_data(in, out);
+		if (ok) {
+			struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+			ok = futimens(out, times) == 0;
+		}
+		if (out >= 0) {
+			ok = (close(out) == 0) && ok;
+		}
+		close(in);
+		if (!ok || rename(part.c_str(), dest.c_str()) != 0) {
+			ratesync::config::error("Unable to copy %s to %s: %s",
+									src.c_str(), dest.c_str(), strerror(errno));
+			unlink(part.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	class CopyTask : public ratesync::ITask {
+	public:
+		CopyTask(const std::string& src, const std::string& dest,
+				 size_t& failed, pthread_mutex_t& mutex)
+			: src(src), dest(dest), failed(failed), mutex(mutex) { }
+
+		void Run() {
+			ratesync::config::debug("COPY %s -> %s", src.c_str(), dest.c_str());
+			if (!copy_file(src, dest)) {
+				ratesync::Lock lock(mutex);
+				++failed;
+			}
+		}
+
+	private:
+		const std::string src, dest;
+		size_t& failed;
+		pthread_mutex_t& mutex;
+	};
+}
+
+ratesync::sink::Export::Export(const std::string& music_dir, const std::string& export_dir,
+							   const export_options_t& options)
+	: export_dir(export_dir), root(music_dir), options(options) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ratesync::sink::Export::~Export() {
+	pthread_mutex_destroy(&mutex);
+}
+
+std::string ratesync::sink::Export::export_path(const song_t& song, rating_t rating) const {
+	return export_dir + rating_subdir(rating) + song;
+}
+
+bool ratesync::sink::Export::Get(ISongOutput& out) {
+	stale.clear();
+	gone.clear();
+	parts.clear();
+	//copies of songs that are gone are only listed for Commit to delete,
+	//and not even that if the whole music dir is missing (eg unmounted)
+	struct stat root_sb;
+	const bool prune = (stat(root.Dir().c_str(), &root_sb) == 0);
+	if (!prune) {
+		config::error("Music dir %s not found, keeping exported songs as they are",
+					  root.Dir().c_str());
+	}
+	static const rating_t ratings[] = { UNRATED, 1, 2, 3, 4, 5 };
+	for (size_t i = 0; i < sizeof(ratings)/sizeof(ratings[0]); ++i) {
+		const std::string subdir = export_dir + rating_subdir(ratings[i]);
+		std::queue<std::string> reldirqueue;
+		reldirqueue.push("");
+		while (!reldirqueue.empty()) {
+			std::string reldir = reldirqueue.front();
+			reldirqueue.pop();
+			std::string dir = subdir + reldir;
+
+			DIR* dp = opendir(dir.c_str());
+			if (dp == NULL) {
+				if (errno == ENOENT && reldir.empty()) {
+					continue;//nothing exported with this rating yet
+				}
+				config::error("Couldn't open directory %s", dir.c_str());
+				return false;
+			}
+			struct dirent* ep;
+			while ((ep = readdir(dp)) != NULL) {
+				const char* name = ep->d_name;
+				if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+					continue;
+				}
+				std::string filepath = dir + name;
+				struct stat sb;
+				if (lstat(filepath.c_str(), &sb) != 0) {
+					config::error("Unable to stat file %s.", filepath.c_str());
+					closedir(dp);
+					return false;
+				}
+				if (S_ISDIR(sb.st_mode)) {
+					reldirqueue.push(reldir + name + SEP);
+					continue;
+				}
+				if (!S_ISREG(sb.st_mode)) {
+					continue;
+				}
+				if (ends_with(filepath, PART_SUFFIX)) {
+					parts.push_back(filepath);//left behind by an interrupted copy
+					continue;
+				}
+
+				song_t song(reldir + name);
+				if (!normalize_key(song)) {
+					config::error("Unable to produce key for file %s", filepath.c_str());
+					continue;
+				}
+				struct stat orig;
+				const bool found = (stat(root.Path(song).c_str(), &orig) == 0);
+				if (!found && prune && (errno == ENOENT || errno == ENOTDIR)) {
+					//the song is gone from the music dir, like a dangling symlink
+					config::debug("GONE %s", filepath.c_str());
+					gone.push_back(filepath);
+					continue;
+				}
+				rating_t rating = ratings[i];
+				if (found && !up_to_date(orig, sb)) {
+					//the song was modified since: list it as missing so that
+					//this copy is replaced (or removed, if now rated too low)
+					stale[song] = rating;
+					rating = ABSENT;
+				}
+				if (!out.Put(song, rating)) {
+					config::error("Song exported more than once: %s", filepath.c_str());
+				}
+			}
+			closedir(dp);
+		}
+	}
+	return true;
+}
+
+bool ratesync::sink::Export::Set(const song_ratings_t& song) {
+	return SetShard(std::vector<song_ratings_t>(1, song)) == 0;
+}
+
+size_t ratesync::sink::Export::SetShard(const std::vector<song_ratings_t>& songs) {
+	size_t failed = 0;
+	for (std::vector<song_ratings_t>::const_iterator
+			 it = songs.begin(); it != songs.end(); ++it) {
+		const song_t& song = it->path;
+		std::string old_path;
+		bool old_stale = false;
+		if (it->rating_old != ABSENT) {
+			old_path = export_path(song, it->rating_old);
+		} else {
+			Lock lock(mutex);
+			std::map<song_t, rating_t>::const_iterator iter = stale.find(song);
+			if (iter != stale.end()) {
+				old_path = export_path(song, iter->second);
+				old_stale = true;
+			}
+		}
+
+		if (!AddsSong(it->rating_new)) {
+			//no longer rated highly enough
+			if (!old_path.empty() && unlink(old_path.c_str()) != 0 && errno != ENOENT) {
+				config::error("Unable to delete %s", old_path.c_str());
+				++failed;
+			}
+			continue;
+		}
+
+		const std::string src = root.Path(song), new_path = export_path(song, it->rating_new);
+		struct stat sb;
+		if (stat(src.c_str(), &sb) != 0) {
+			config::error("Unable to stat file %s.", src.c_str());
+			++failed;
+			continue;
+		}
+		if (!old_path.empty() && old_path != new_path) {
+			if (!old_stale && make_parents(new_path) &&
+				rename(old_path.c_str(), new_path.c_str()) == 0) {
+				continue;//moved to its new rating, no need to copy
+			}
+			unlink(old_path.c_str());
+		}
+
+		struct stat dest_sb;
+		if (stat(new_path.c_str(), &dest_sb) == 0 && up_to_date(sb, dest_sb)) {
+			continue;
+		}
+		copy_t copy;
+		copy.src = src;
+		copy.dest = new_path;
+		copy.size = sb.st_size;
+		Lock lock(mutex);
+		copies.push_back(copy);
+	}
+	return failed;
+}
+
+bool ratesync::sink::Export::Clear(const song_rating_t& song) {
+	std::string path = export_path(song.path, song.rating);
+	return unlink(path.c_str()) == 0 || errno == ENOENT;
+}
+
+bool ratesync::sink::Export::Commit() {
+	size_t failed = 0;
+	for (std::vector<std::string>::const_iterator it = gone.begin(); it != gone.end(); ++it) {
+		if (unlink(it->c_str()) != 0 && errno != ENOENT) {
+			config::error("Unable to delete %s", it->c_str());
+			++failed;
+		}
+	}
+	if (!gone.empty()) {
+		config::log("Deleted %d songs which are gone from the music dir", gone.size() - failed);
+	}
+	gone.clear();
+	for (std::vector<std::string>::const_iterator it = parts.begin(); it != parts.end(); ++it) {
+		unlink(it->c_str());
+	}
+	parts.clear();
+
+	//largest first, so that a big file doesn't start last and hold up the
+	//end while the other threads sit idle
+	std::sort(copies.begin(), copies.end());
+	off_t bytes = 0;
+	size_t failed_copies = 0;
+	pthread_mutex_t failed_mutex;
+	pthread_mutex_init(&failed_mutex, NULL);
+	{
+		ThreadPool pool((options.jobs > 1) ? options.jobs : 0);
+		for (std::vector<copy_t>::const_iterator
+				 it = copies.begin(); it != copies.end(); ++it) {
+			bytes += it->size;
+			pool.Add(new CopyTask(it->src, it->dest, failed_copies, failed_mutex));
+		}
+		pool.Wait();
+	}
+	pthread_mutex_destroy(&failed_mutex);
+	if (!copies.empty()) {
+		config::log("Copied %d songs (%.1f MB), %d failed",
+					copies.size(), bytes / (1024.0 * 1024.0), failed_copies);
+	}
+	copies.clear();
+	return failed == 0 && failed_copies == 0;
+}
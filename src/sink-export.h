@@ -0,0 +1,89 @@
+#ifndef RATESYNC_SINK_EXPORT_H
+#define RATESYNC_SINK_EXPORT_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+#include "sink.h"
+
+namespace ratesync {
+	namespace sink {
+		struct export_options_t {
+			export_options_t() : min_rating(4), jobs(1) { }
+
+			//songs rated lower aren't exported (unrated counts as lowest)
+			rating_t min_rating;
+			//copies made at once
+			size_t jobs;
+		};
+
+		//Copies songs into the same layout as Symlink (<export dir>/<rating>/
+		//<song>), eg onto a portable player. Copies are reflinks where the
+		//filesystem allows, and are made in Commit(), largest first, on up to
+		//'jobs' threads. A song whose rating changes is moved rather than
+		//copied again.
+		class Export : public ISink {
+		public:
+			Export(const std::string& music_dir, const std::string& export_dir,
+				   const export_options_t& options = export_options_t());
+			virtual ~Export();
+
+			bool Get(ISongOutput& out);
+			bool Set(const song_ratings_t& song);
+			bool Clear(const song_rating_t& song);
+			void SetPaths(const SongPaths* paths) { root.SetPaths(paths); }
+
+			size_t SetShard(const std::vector<song_ratings_t>& songs);
+			bool ThreadSafe() const { return true; }
+			bool AddsSong(rating_t rating) const { return rating >= options.min_rating; }
+			size_t Stale() const { return gone.size(); }
+			bool Commit();
+
+		private:
+			Export(const Export& sink);//disallow copy
+
+			struct copy_t {
+				std::string src, dest;
+				off_t size;
+				bool operator<(const copy_t& other) const {
+					return size > other.size;//largest first
+				}
+			};
+
+			std::string export_path(const song_t& song, rating_t rating) const;
+
+			const std::string export_dir;
+			SongRoot root;
+			const export_options_t options;
+			std::vector<copy_t> copies;
+			//exported songs that changed since, and their rating dir
+			std::map<song_t, rating_t> stale;
+			//copies of songs that are gone from the music dir, and partial
+			//copies left behind by an interrupted export, deleted by Commit
+			std::vector<std::string> gone, parts;
+			pthread_mutex_t mutex;
+		};
+	}
+}
+
+#endif
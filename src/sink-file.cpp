@@ -17,6 +17,14 @@
 */
 
 #include "sink-file.h"
+#include "badfiles.h"
+#include "boundedqueue.h"
+#include "concurrency.h"
+#include "fdstream.h"
+#include "scancursor.h"
+#include "tag-rating.h"
+#include "tagworker.h"
+#include "threadpool.h"
 #include "config.h"
 
 #include <taglib/taglib.h>
@@ -26,52 +34,33 @@
 #include <taglib/mpegfile.h>
 #include <taglib/flacfile.h>
 #include <taglib/oggflacfile.h>
+#include <taglib/opusfile.h>
 #include <taglib/speexfile.h>
 #include <taglib/vorbisfile.h>
+#include <taglib/mp4file.h>
+#include <taglib/apefile.h>
+#include <taglib/wavpackfile.h>
 
 #include <taglib/id3v2tag.h>
-#include <taglib/popularimeterframe.h>
+#include <taglib/id3v2framefactory.h>
 #include <taglib/xiphcomment.h>
+#include <taglib/mp4tag.h>
+#include <taglib/apetag.h>
 
-#include <taglib/tmap.h>
-#include <taglib/tlist.h>
-
+#include <algorithm>
+#include <map>
+#include <set>
 #include <sstream>
-#include <queue>
 
 #include <dirent.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 namespace {
-	bool string_ends_with_ci(const std::string& haystack, const std::string& needle) {
-		const size_t hs = haystack.size(), ns = needle.size();
-		if (hs < ns) {
-			return false;
-		}
-		std::string ending = haystack.substr(hs - ns, ns);
-		for (size_t i=0; i < ending.size(); i++) {
-			ending[i] = tolower(ending[i]);
-		}
-		return ending.compare(needle) == 0;
-	}
-
-	bool string_starts_with(const std::wstring& haystack, const std::wstring& needle) {
-		if (haystack.size() < needle.size()) {
-			return false;
-		}
-		const std::wstring& ending = haystack.substr(0, needle.size());
-		return ending.compare(needle) == 0;
-	}
-
-	bool check_file(const std::string& filepath) {
-		struct stat sb;
-		if (stat(filepath.c_str(), &sb) != 0) {
-			ratesync::config::error("Unable to stat file %s.",
-									 filepath.c_str());
-			return false;
-		}
-
+	bool check_file(const std::string& filepath, const struct stat& sb) {
 		if (access(filepath.c_str(), R_OK) != 0) {
 			ratesync::config::error("Unable to access file %s: No read access.",
 									 filepath.c_str());
@@ -87,209 +76,843 @@ namespace {
 		return true;
 	}
 
-	bool xiph_rating(TagLib::Ogg::XiphComment* xiphcomment,
-					 ratesync::rating_t& out) {
-		TagLib::Ogg::FieldListMap map = xiphcomment->fieldListMap();
-		for (TagLib::Ogg::FieldListMap::Iterator
-				 it = map.begin(); it != map.end(); ++it) {
-			std::wstring key = (*it).first.toWString();
-			if (string_starts_with(key,L"RATING:")) {
-				const TagLib::List<TagLib::String>& val = (*it).second;
-				if (val.size() == 1) {
-					//expecting [0.0, 0.2, 0.4, 0.6, 0.8, 1.0]
-					const TagLib::String& floatstr = val[0];
-					double ogg_rating;
-					std::istringstream stream(floatstr.toCString());
-					stream >> ogg_rating;
-					if (stream.fail()) {
-						continue;
-					}
-					if (ogg_rating == 0.5) {//unrated
-						out = UNRATED;
-					} else if (ogg_rating > 0.8) {// (0.8,1.0]
-						out = 5;
-					} else if (ogg_rating > 0.6) {// (0.6,0.8]
-						out = 4;
-					} else if (ogg_rating > 0.4) {// (0.4,0.6]
-						out = 3;
-					} else if (ogg_rating > 0.2) {// (0.2,0.4]
-						out = 2;
-					} else {// [0.0,0.2]
-						out = 1;
-					}
-					return true;
-				}
+	enum file_type_t { UNKNOWN, MP3, OGG, OGG_FLAC, OPUS, SPEEX, FLAC, MP4, WAVPACK, APE };
+
+	struct extension_t {
+		const char* ext;//lowercase, without the '.'
+		file_type_t type;
+	};
+	const extension_t extensions[] = {
+		{ "mp3", MP3 },
+		{ "ogg", OGG },
+		{ "oga", OGG },
+		{ "opus", OPUS },
+		{ "spx", SPEEX },
+		{ "flac", FLAC },
+		{ "m4a", MP4 },
+		{ "m4b", MP4 },
+		{ "mp4", MP4 },
+		{ "wv", WAVPACK },
+		{ "ape", APE }
+	};
+	const size_t MAX_EXT_LEN = 4;
+
+	file_type_t get_type(const std::string& file) {
+		//lowercase the extension into a small buffer, walking back from the end
+		char ext[MAX_EXT_LEN+1];
+		const size_t size = file.size();
+		size_t len = 0;
+		for (; len <= MAX_EXT_LEN && len < size; ++len) {
+			char c = file[size - len - 1];
+			if (c == '.') {
+				break;
+			} else if (c == SEP) {
+				return UNKNOWN;
 			}
+			ext[MAX_EXT_LEN - len] = (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c;
 		}
-		return false;
-	}
+		if (len == 0 || len > MAX_EXT_LEN || len == size) {
+			return UNKNOWN;//no extension, or too long to be one of ours
+		}
+		const char* lower = ext + (MAX_EXT_LEN + 1 - len);
 
-	bool id3v2_rating(TagLib::ID3v2::Tag* id3v2tag,
-					  ratesync::rating_t& out) {
-		const TagLib::ID3v2::FrameListMap& map = id3v2tag->frameListMap();
-		if (map.contains("POPM")) {
-			const TagLib::List<TagLib::ID3v2::Frame*>& vallist = map["POPM"];
-			for (TagLib::List<TagLib::ID3v2::Frame*>::ConstIterator
-					 frame = vallist.begin(); frame != vallist.end(); ++frame) {
-				TagLib::ID3v2::PopularimeterFrame* popmframe =
-					static_cast<TagLib::ID3v2::PopularimeterFrame*>(*frame);
-				int popm_rating = popmframe->rating();
-				if (popm_rating == 0) {
-					out = UNRATED;
-				} else if (popm_rating < 64) {
-					out = 1;
-				} else if (popm_rating < 128) {
-					out = 2;
-				} else if (popm_rating < 192) {
-					out = 3;
-				} else if (popm_rating < 255) {
-					out = 4;
-				} else {
-					out = 5;
-				}
-				return true;
+		for (size_t i = 0; i < sizeof(extensions)/sizeof(extensions[0]); ++i) {
+			const char* cand = extensions[i].ext;
+			size_t j = 0;
+			while (j < len && cand[j] == lower[j]) {
+				++j;
+			}
+			if (j == len && cand[j] == 0) {
+				return extensions[i].type;
 			}
 		}
-		return false;
+		return UNKNOWN;
 	}
 
-	enum file_type_t { UNKNOWN, MP3, OGG, FLAC };
-	file_type_t get_type(const ratesync::song_t& file) {
-		if (string_ends_with_ci(file, ".mp3")) {
-			return MP3;
-		} else if (string_ends_with_ci(file, ".ogg") ||
-				   string_ends_with_ci(file, ".oga")) {
-			return OGG;
-		} else if (string_ends_with_ci(file, ".flac")) {
-			return FLAC;
+	struct found_song_t {
+		std::string relpath;
+		file_type_t type;
+		//a symlink, or a hard link, so that the file may also be found by
+		//another path
+		bool link, hard_link;
+	};
+	typedef ratesync::BoundedQueue<found_song_t> song_queue_t;
+
+	//Songs found by the walker but not yet parsed. Enough to keep the
+	//parsers busy, while bounding memory use for huge libraries.
+	const size_t SONG_QUEUE_SIZE = 1024;
+
+	typedef std::pair<dev_t, ino_t> inode_t;
+
+	//A directory that was reached again by another path (bind mount or
+	//symlink), whose songs are the same files as those under 'target'.
+	struct dir_alias_t {
+		std::string reldir, target;
+	};
+
+	class IFoundOutput {
+	public:
+		virtual ~IFoundOutput() { }
+		//Returns false to stop the walk.
+		virtual bool Found(const found_song_t& song, const struct stat& sb) = 0;
+	};
+
+	//Lists supported files below 'root'+'start' ("" or "dir/"), as paths
+	//relative to 'root'. The order is fixed so that a walk can be resumed:
+	//each directory's files by name, then its subdirectories by name. With
+	//'after', everything up to and including that song is skipped. Each
+	//directory is only listed once: others that lead to it again are added
+	//to 'aliases', or skipped if they're loops.
+	bool list_dir(const std::string& root, const std::string& start,
+				  const ratesync::sink::file_options_t& options,
+				  IFoundOutput& songs_out, std::vector<dir_alias_t>& aliases,
+				  const std::string& after = std::string()) {
+		struct stat sb;
+		if (stat((root + start).c_str(), &sb) != 0) {
+			ratesync::config::error("Couldn't open directory %s", (root + start).c_str());
+			return false;
 		}
-		return UNKNOWN;
-	}
+		const dev_t root_dev = sb.st_dev;
+		//where each directory was first found
+		std::map<inode_t, std::string> dirs;
+		dirs[inode_t(sb.st_dev, sb.st_ino)] = start;
 
-	bool list_dir(const std::string& root, std::list<ratesync::song_t>& songs_out) {
-		std::queue<std::string> dirqueue;
-		dirqueue.push(root);
+		//depth first, the next directory to list is at the back
+		std::vector<std::string> dirstack(1, start);
 
-		while (!dirqueue.empty()) {
-			std::string dir = dirqueue.front();
-			dirqueue.pop();
+		while (!dirstack.empty()) {
+			std::string reldir = dirstack.back();
+			dirstack.pop_back();
+			std::string dir = root + reldir;
 
 			DIR* dp = opendir(dir.c_str());
 			if (dp == NULL) {
 				ratesync::config::error("Couldn't open directory %s", dir.c_str());
 				return false;
 			}
-
+			std::vector<std::string> names;
 			struct dirent* ep;
 			while (ep = readdir(dp)) {
 				//"This is the only field you can count on in all POSIX systems":
-				ratesync::song_t filepath = dir+ep->d_name;
+				const char* name = ep->d_name;
+				if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+					continue;
+				}
+				names.push_back(name);
+			}
+			closedir(dp);
+			std::sort(names.begin(), names.end());
+
+			//when 'after' is in this directory: either it's one of the files
+			//here, or it's within 'resume_dir' and all the files are done
+			const bool resuming = after.size() > reldir.size() &&
+				after.compare(0, reldir.size(), reldir) == 0;
+			const std::string resume = resuming ? after.substr(reldir.size()) : std::string();
+			const size_t resume_sep = resume.find(SEP);
+			const std::string resume_dir = resume.substr(0, resume_sep);
+
+			std::vector<std::string> subdirs;
+			for (std::vector<std::string>::const_iterator
+					 it = names.begin(); it != names.end(); ++it) {
+				const std::string& name = *it;
+				if (resuming && resume_sep != std::string::npos && name < resume_dir) {
+					continue;//done before, whatever it is
+				}
+				std::string relpath = reldir+name;
+				std::string filepath = root+relpath;
 				ratesync::config::debug(filepath.c_str());
 
-				struct stat sb;
-				if (stat(filepath.c_str(), &sb) != 0) {
+				if (lstat(filepath.c_str(), &sb) != 0) {
+					ratesync::config::error("Unable to stat file %s.",
+											filepath.c_str());
+					return false;
+				}
+				const bool link = S_ISLNK(sb.st_mode);
+				if (link && !options.follow_symlinks) {
+					ratesync::config::debug("Not following symlink %s", filepath.c_str());
+					continue;
+				}
+				if (link && stat(filepath.c_str(), &sb) != 0) {
 					ratesync::config::error("Unable to stat file %s.",
 											filepath.c_str());
-					closedir(dp);
 					return false;
 				}
+
 				if (S_ISDIR(sb.st_mode)) {
-					dirqueue.push(filepath+SEP);
-				} else if (S_ISREG(sb.st_mode) || S_ISLNK(sb.st_mode)) {
-					if (get_type(filepath) != UNKNOWN) {
-						songs_out.push_back(filepath);
+					if (options.one_file_system && sb.st_dev != root_dev) {
+						ratesync::config::debug("Not crossing into mount %s", filepath.c_str());
+						continue;
+					}
+					std::string subdir = relpath+SEP;
+					std::map<inode_t, std::string>::const_iterator
+						seen = dirs.find(inode_t(sb.st_dev, sb.st_ino));
+					if (seen == dirs.end()) {
+						dirs[inode_t(sb.st_dev, sb.st_ino)] = subdir;
+						subdirs.push_back(subdir);
+					} else if (subdir.compare(0, seen->second.size(), seen->second) == 0) {
+						ratesync::config::log("Skipping %s, which loops back to %s",
+											  filepath.c_str(), (root + seen->second).c_str());
+					} else {
+						dir_alias_t alias;
+						alias.reldir = subdir;
+						alias.target = seen->second;
+						aliases.push_back(alias);
+					}
+				} else if (S_ISREG(sb.st_mode)) {
+					if (resuming && (resume_sep != std::string::npos || name <= resume)) {
+						continue;//done before
+					}
+					found_song_t song;
+					song.type = get_type(relpath);
+					if (song.type != UNKNOWN) {
+						song.relpath = relpath;
+						song.link = link;
+						song.hard_link = sb.st_nlink > 1;
+						if (!songs_out.Found(song, sb)) {
+							return true;
+						}
 					}
 				}
 			}
-			closedir(dp);
+			dirstack.insert(dirstack.end(), subdirs.rbegin(), subdirs.rend());
 		}
 
 		return true;
 	}
 
-	bool rating(const ratesync::song_t& song, file_type_t type,
+	//enough for the magic numbers below, and an Ogg stream's first packet
+	const size_t SNIFF_SIZE = 512;
+
+	inline bool has_magic(const std::string& head, size_t offset, const char* magic, size_t len) {
+		return head.size() >= offset + len && memcmp(head.data() + offset, magic, len) == 0;
+	}
+
+	//Tells the codec in an Ogg stream from its first packet, which starts
+	//after the page header and its segment table.
+	file_type_t ogg_type(const std::string& head, file_type_t guess) {
+		if (head.size() < 27) {
+			return guess;
+		}
+		const size_t packet = 27 + (unsigned char)head[26];
+		if (has_magic(head, packet, "\x01vorbis", 7)) {
+			return OGG;
+		} else if (has_magic(head, packet, "OpusHead", 8)) {
+			return OPUS;
+		} else if (has_magic(head, packet, "\x7f" "FLAC", 5)) {
+			return OGG_FLAC;
+		} else if (has_magic(head, packet, "Speex   ", 8)) {
+			return SPEEX;
+		}
+		return guess;
+	}
+
+	//Tells the format from the first bytes of the file, so that misnamed
+	//files are read right. Falls back to 'guess' (from the extension) for
+	//anything unrecognized.
+	file_type_t sniff_type(ratesync::FdStream* song, file_type_t guess) {
+		const std::string& head = song->Head(SNIFF_SIZE);
+		if (has_magic(head, 0, "ID3", 3)) {
+			if (head.size() >= 10) {
+				//FLAC files sometimes have an ID3v2 tag in front, look past it
+				long tag_size = 10 +
+					(((head[6] & 0x7f) << 21) | ((head[7] & 0x7f) << 14) |
+					 ((head[8] & 0x7f) << 7) | (head[9] & 0x7f)) +
+					((head[5] & 0x10) ? 10 : 0);//footer
+				song->seek(tag_size);
+				TagLib::ByteVector after = song->readBlock(4);
+				song->seek(0);
+				if (after.size() == 4 && memcmp(after.data(), "fLaC", 4) == 0) {
+					return FLAC;
+				}
+			}
+			return MP3;
+		} else if (has_magic(head, 0, "fLaC", 4)) {
+			return FLAC;
+		} else if (has_magic(head, 0, "OggS", 4)) {
+			return ogg_type(head, (guess == OPUS || guess == SPEEX) ? guess : OGG);
+		} else if (has_magic(head, 4, "ftyp", 4)) {
+			return MP4;
+		} else if (has_magic(head, 0, "wvpk", 4)) {
+			return WAVPACK;
+		} else if (has_magic(head, 0, "MAC ", 4)) {
+			return APE;
+		} else if (head.size() >= 2 && (unsigned char)head[0] == 0xff &&
+				   ((unsigned char)head[1] & 0xe0) == 0xe0) {
+			return MP3;//MPEG frame sync, without a tag
+		}
+		return guess;
+	}
+
+	//Reads the rating of a song. Songs without any rating are UNRATED, only
+	//files which can't be parsed at all are an error.
+	bool rating(ratesync::FdStream* song, file_type_t guess,
 				ratesync::rating_t& out) {
+		out = UNRATED;
+		const file_type_t type = sniff_type(song, guess);
+		if (type != guess) {
+			ratesync::config::debug("%s is actually of type %d, not %d",
+									song->name(), type, guess);
+		}
 		switch (type) {
 		case MP3:
 			{
-				TagLib::MPEG::File mpegfile(song.c_str(), false);
+				TagLib::MPEG::File mpegfile(song, TagLib::ID3v2::FrameFactory::instance(), false);
+				if (!mpegfile.isValid()) {
+					break;
+				}
 				TagLib::ID3v2::Tag* id3v2tag = mpegfile.ID3v2Tag();
 				if (id3v2tag) {
-					return id3v2_rating(id3v2tag, out);
+					ratesync::decode::id3v2_rating(id3v2tag, out);
 				}
 			}
-			break;
+			return true;
 		case OGG:
 			{
-				TagLib::Ogg::Vorbis::File oggfile(song.c_str(), false);
+				TagLib::Ogg::Vorbis::File oggfile(song, false);
+				if (!oggfile.isValid()) {
+					break;
+				}
 				TagLib::Ogg::XiphComment* xiphcomment = oggfile.tag();
 				if (xiphcomment) {
-					return xiph_rating(xiphcomment, out);
+					ratesync::decode::xiph_rating(xiphcomment, out);
 				}
-
-				TagLib::Ogg::FLAC::File oggflacfile(song.c_str(), false);
-				xiphcomment = oggflacfile.tag();
+			}
+			return true;
+		case OGG_FLAC:
+			{
+				TagLib::Ogg::FLAC::File oggflacfile(song, false);
+				if (!oggflacfile.isValid()) {
+					break;
+				}
+				TagLib::Ogg::XiphComment* xiphcomment = oggflacfile.tag();
+				if (xiphcomment) {
+					ratesync::decode::xiph_rating(xiphcomment, out);
+				}
+			}
+			return true;
+		case OPUS:
+			{
+				TagLib::Ogg::Opus::File opusfile(song, false);
+				if (!opusfile.isValid()) {
+					break;
+				}
+				TagLib::Ogg::XiphComment* xiphcomment = opusfile.tag();
+				if (xiphcomment) {
+					ratesync::decode::xiph_rating(xiphcomment, out);
+				}
+			}
+			return true;
+		case SPEEX:
+			{
+				TagLib::Ogg::Speex::File speexfile(song, false);
+				if (!speexfile.isValid()) {
+					break;
+				}
+				TagLib::Ogg::XiphComment* xiphcomment = speexfile.tag();
 				if (xiphcomment) {
-					return xiph_rating(xiphcomment, out);
+					ratesync::decode::xiph_rating(xiphcomment, out);
 				}
 			}
-			break;
+			return true;
 		case FLAC:
 			{
-				TagLib::FLAC::File flacfile(song.c_str(), false);
+				TagLib::FLAC::File flacfile(song, TagLib::ID3v2::FrameFactory::instance(), false);
+				if (!flacfile.isValid()) {
+					break;
+				}
 				TagLib::Ogg::XiphComment* xiphcomment = flacfile.xiphComment();
-				if (xiphcomment) {
-					return xiph_rating(xiphcomment, out);
+				if (xiphcomment && ratesync::decode::xiph_rating(xiphcomment, out)) {
+					return true;
 				}
 
 				TagLib::ID3v2::Tag* id3v2tag = flacfile.ID3v2Tag();
 				if (id3v2tag) {
-					return id3v2_rating(id3v2tag, out);
+					ratesync::decode::id3v2_rating(id3v2tag, out);
+				}
+			}
+			return true;
+		case MP4:
+			{
+				TagLib::MP4::File mp4file(song, false);
+				if (!mp4file.isValid()) {
+					break;
+				}
+				TagLib::MP4::Tag* mp4tag = mp4file.tag();
+				if (mp4tag) {
+					ratesync::decode::mp4_rating(mp4tag, out);
+				}
+			}
+			return true;
+		case WAVPACK:
+			{
+				TagLib::WavPack::File wvfile(song, false);
+				if (!wvfile.isValid()) {
+					break;
+				}
+				TagLib::APE::Tag* apetag = wvfile.APETag();
+				if (apetag) {
+					ratesync::decode::ape_rating(apetag, out);
 				}
 			}
-			break;
+			return true;
+		case APE:
+			{
+				TagLib::APE::File apefile(song, false);
+				if (!apefile.isValid()) {
+					break;
+				}
+				TagLib::APE::Tag* apetag = apefile.APETag();
+				if (apetag) {
+					ratesync::decode::ape_rating(apetag, out);
+				}
+			}
+			return true;
 		case UNKNOWN:
 			ratesync::config::error("INTERNAL ERROR: queried rating against UNKNOWN type");
-			break;
+			return false;
 		default:
 			ratesync::config::error("UNKNOWN ENUM: %d", type);
-			break;
+			return false;
 		}
+		ratesync::config::error("Unable to parse file %s.", song->name());
 		return false;
 	}
+
+	double now() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec + tv.tv_usec / 1000000.;
+	}
+
+	//Queues songs for the parsers, until the budget (if any) runs out.
+	class QueueOutput : public IFoundOutput {
+	public:
+		QueueOutput(song_queue_t& songs, size_t max_files, double deadline)
+			: songs(songs), max_files(max_files), deadline(deadline),
+			  queued(0), stopped(false) { }
+		bool Found(const found_song_t& song, const struct stat&) {
+			if ((max_files > 0 && queued >= max_files) || (deadline > 0 && now() >= deadline)) {
+				stopped = true;
+				return false;
+			}
+			songs.Push(song);
+			++queued;
+			last = song.relpath;
+			return true;
+		}
+		size_t Queued() const { return queued; }
+		//whether the budget ran out, and the last song queued before then
+		bool Stopped() const { return stopped; }
+		const std::string& Last() const { return last; }
+	private:
+		song_queue_t& songs;
+		const size_t max_files;
+		const double deadline;
+		size_t queued;
+		bool stopped;
+		std::string last;
+	};
+
+	typedef std::vector<std::pair<found_song_t, inode_t> > found_list_t;
+
+	class ListOutput : public IFoundOutput {
+	public:
+		ListOutput(found_list_t& songs) : songs(songs) { }
+		bool Found(const found_song_t& song, const struct stat& sb) {
+			songs.push_back(std::make_pair(song, inode_t(sb.st_dev, sb.st_ino)));
+			return true;
+		}
+	private:
+		found_list_t& songs;
+	};
+
+	struct walk_t {
+		const std::string& root;
+		const std::string& start;
+		const ratesync::sink::file_options_t* options;
+		song_queue_t* songs;
+		QueueOutput* out;
+		//resume after this song (see list_dir)
+		std::string after;
+		std::vector<dir_alias_t> aliases;
+		bool ok;
+	};
+
+	void* walk_main(void* walk_ptr) {
+		walk_t* walk = static_cast<walk_t*>(walk_ptr);
+		walk->ok = list_dir(walk->root, walk->start, *walk->options, *walk->out,
+							walk->aliases, walk->after);
+		walk->songs->Close();
+		return NULL;
+	}
+
+	struct parse_t {
+		const std::string& music_dir;
+		const ratesync::sink::file_options_t* options;
+		ratesync::io::ScanIo* scan_io;
+		ratesync::ConcurrencyLimit* limit;
+		//with a parse timeout, where tags are read (NULL: in-process)
+		ratesync::TagWorkerPool* workers;
+		song_queue_t* songs;
+		ratesync::ISongOutput* out;
+		ratesync::SongPaths* paths;
+		//files that failed in earlier scans, by absolute path (may be NULL)
+		ratesync::BadFiles* bad_files;
+		const std::string& abs_dir;
+		//guards everything below
+		pthread_mutex_t mutex;
+		bool ok;
+		size_t timeouts, crashes;
+		//the rating read from each file, for its other paths
+		std::vector<std::pair<inode_t, ratesync::rating_t> > ratings;
+		//hard linked files being read or done, and symlinks or other links
+		//to files found since
+		std::set<inode_t> claimed;
+		found_list_t deferred;
+	};
+
+	//Reads a rating here, or in a tag worker if there are any.
+	bool read_rating(parse_t& parse, const std::string& songpath, const struct stat& sb,
+					 file_type_t type, ratesync::rating_t& out) {
+		if (!check_file(songpath, sb)) {
+			return false;
+		}
+		int fd = parse.scan_io->Open(songpath);
+		if (fd < 0) {
+			ratesync::config::error("Unable to open file %s.", songpath.c_str());
+			return false;
+		}
+		if (parse.workers == NULL) {
+			ratesync::FdStream stream(fd, songpath);
+			bool ok = rating(&stream, type, out);
+			parse.scan_io->Close(fd, stream.BytesRead());
+			return ok;
+		}
+		size_t bytes_read;
+		ratesync::TagWorker* worker = parse.workers->Take();
+		ratesync::TagWorker::result_t result = worker->Read(fd, type, songpath, out, bytes_read);
+		parse.workers->Give(worker);
+		parse.scan_io->Close(fd, bytes_read);
+		if (result == ratesync::TagWorker::TIMEOUT) {
+			ratesync::Lock lock(parse.mutex);
+			++parse.timeouts;
+		} else if (result == ratesync::TagWorker::CRASHED) {
+			ratesync::Lock lock(parse.mutex);
+			++parse.crashes;
+		}
+		return result == ratesync::TagWorker::OK;
+	}
+
+	//Reads and outputs the rating of 'song', or just outputs 'rating' if
+	//one is given (read from the same file by another path).
+	void parse_song(parse_t& parse, const found_song_t& song, const ratesync::rating_t* rating = NULL) {
+		std::string songpath(parse.music_dir + song.relpath);
+		ratesync::song_t key(song.relpath);
+		bool ok = false;
+		if (!ratesync::normalize_key(key)) {
+			ratesync::config::error("Unable to produce key for file %s", songpath.c_str());
+		} else if (parse.options->shard_count > 1 &&
+				   ratesync::hash_key(key) % parse.options->shard_count !=
+				   parse.options->shard_index) {
+			return;//another scanner's song, don't touch the file
+		} else if (rating != NULL) {
+			ratesync::config::debug("RATING %s = %d (same file)", key.c_str(), *rating);
+			parse.paths->Add(key, song.relpath);
+			ratesync::Lock lock(parse.mutex);
+			parse.out->Put(key, *rating);
+			return;
+		} else {
+			struct stat sb;
+			if (stat(songpath.c_str(), &sb) != 0) {
+				ratesync::config::error("Unable to stat file %s.", songpath.c_str());
+			} else if (parse.bad_files != NULL &&
+					   parse.bad_files->Skip(parse.abs_dir + song.relpath, sb)) {
+				return;//known bad, doesn't fail the scan again
+			} else {
+				const inode_t inode(sb.st_dev, sb.st_ino);
+				if (song.link) {
+					//most likely also found by its own path, share its rating later
+					ratesync::Lock lock(parse.mutex);
+					parse.deferred.push_back(std::make_pair(song, inode));
+					return;
+				} else if (song.hard_link) {
+					ratesync::Lock lock(parse.mutex);
+					if (!parse.claimed.insert(inode).second) {
+						//already read by another path, share its rating later
+						parse.deferred.push_back(std::make_pair(song, inode));
+						return;
+					}
+				}
+				ratesync::rating_t r;
+				double start = parse.limit->Acquire();
+				ok = read_rating(parse, songpath, sb, song.type, r);
+				parse.limit->Release(start);
+				if (ok) {
+					ratesync::config::debug("RATING %s = %d", key.c_str(), r);
+					parse.paths->Add(key, song.relpath);
+					ratesync::Lock lock(parse.mutex);
+					parse.out->Put(key, r);
+					parse.ratings.push_back(std::make_pair(inode, r));
+				} else if (parse.bad_files != NULL) {
+					parse.bad_files->Add(parse.abs_dir + song.relpath, sb);
+				}
+			}
+		}
+		if (!ok) {
+			ratesync::Lock lock(parse.mutex);
+			parse.ok = false;
+		}
+	}
+
+	//Reads the ratings of queued songs until the walker is done.
+	void parse_songs(parse_t& parse) {
+		found_song_t song;
+		while (parse.songs->Pop(song)) {
+			parse_song(parse, song);
+		}
+	}
+
+	bool inode_less(const std::pair<inode_t, ratesync::rating_t>& a,
+					const std::pair<inode_t, ratesync::rating_t>& b) {
+		return a.first < b.first;
+	}
+
+	//Outputs songs found by a second path with the rating read from their
+	//file, once everything else is read. Files that weren't read (eg in
+	//another shard) are read now.
+	size_t share_ratings(parse_t& parse, const found_list_t& songs) {
+		size_t shared = 0;
+		for (found_list_t::const_iterator it = songs.begin(); it != songs.end(); ++it) {
+			std::pair<inode_t, ratesync::rating_t> find(it->second, UNRATED);
+			std::vector<std::pair<inode_t, ratesync::rating_t> >::const_iterator
+				read = std::lower_bound(parse.ratings.begin(), parse.ratings.end(),
+										find, inode_less);
+			if (read != parse.ratings.end() && read->first == it->second) {
+				parse_song(parse, it->first, &read->second);
+				++shared;
+			} else {
+				found_song_t song = it->first;
+				song.link = song.hard_link = false;
+				parse_song(parse, song);
+			}
+		}
+		return shared;
+	}
+
+	class ParseTask : public ratesync::ITask {
+	public:
+		ParseTask(parse_t& parse) : parse(parse) { }
+		void Run() { parse_songs(parse); }
+	private:
+		parse_t& parse;
+	};
+
+	//Reads the queued songs on 'jobs' threads, including this one.
+	void parse_all(parse_t& parse, size_t jobs) {
+		ratesync::ThreadPool pool((jobs > 1) ? jobs - 1 : 0);
+		for (size_t i = 0; i < pool.Threads(); ++i) {
+			pool.Add(new ParseTask(parse));
+		}
+		parse_songs(parse);
+		pool.Wait();
+	}
+
+	//Outputs the keys of the songs found, without reading them.
+	class KeyOutput : public IFoundOutput {
+	public:
+		KeyOutput(const ratesync::sink::file_options_t& options, ratesync::SongPaths& paths,
+				  ratesync::ISongOutput& out)
+			: options(options), paths(paths), out(out) { }
+		bool Found(const found_song_t& song, const struct stat&) {
+			ratesync::song_t key(song.relpath);
+			if (!ratesync::normalize_key(key)) {
+				ratesync::config::error("Unable to produce key for file %s", song.relpath.c_str());
+			} else if (options.shard_count <= 1 ||
+					   ratesync::hash_key(key) % options.shard_count == options.shard_index) {
+				paths.Add(key, song.relpath);
+				out.Put(key, UNRATED);
+			}
+			return true;
+		}
+	private:
+		const ratesync::sink::file_options_t& options;
+		ratesync::SongPaths& paths;
+		ratesync::ISongOutput& out;
+	};
+
+	//What a scan cursor is for: the part of the library scanned, and what
+	//it's synced to, so that syncs to different places don't share one.
+	std::string cursor_scope(const std::string& music_dir,
+							 const ratesync::sink::file_options_t& options) {
+		std::ostringstream scope;
+		scope << ratesync::SongRoot(music_dir).Dir() << options.subtree << " "
+			  << options.shard_index << "/" << options.shard_count << " "
+			  << options.cursor_scope;
+		return scope.str();
+	}
 }
 
-bool ratesync::sink::File::Get(std::map<song_t,rating_t>& out_ratings) {
-	std::list<song_t> songs;
-	if (!list_dir(music_dir, songs)) {
+bool ratesync::sink::File::Get(ISongOutput& out) {
+	//with a budget, pick up where the last scan stopped. The queue is kept
+	//short so that what's left in it when time runs out is quickly read.
+	const bool budget = options.budget_secs > 0 || options.budget_files > 0;
+	ScanCursor cursor(options.cursor, cursor_scope(music_dir, options));
+	cursor_pending = false;
+	std::string after;
+	if (budget && !cursor.Load(after)) {
+		config::error("Unable to read scan cursor %s", cursor.Path().c_str());
+		return false;
+	}
+	if (!after.empty()) {
+		config::log("Resuming scan after %s", after.c_str());
+	}
+	song_queue_t queue(budget ? 4 * options.jobs : SONG_QUEUE_SIZE);
+	QueueOutput found(queue, options.budget_files,
+					  (options.budget_secs > 0) ? now() + options.budget_secs : 0);
+
+	//before starting any threads, so that the walker gets the I/O class too
+	io::ScanIo scan_io(options.io);
+	scan_io.Begin();
+
+	//walk the tree on one thread while parsing what it finds on the others
+	walk_t walk = { music_dir, options.subtree, &options, &queue, &found, after,
+					std::vector<dir_alias_t>(), false };
+	pthread_t walker;
+	if (pthread_create(&walker, NULL, walk_main, &walk) != 0) {
+		config::error("Unable to start directory walker thread");
 		return false;
 	}
 
-	bool ret = true;
-	for (std::list<song_t>::const_iterator
-			 it = songs.begin(); it != songs.end(); it++) {
-		song_t songpath(music_dir + *it);
-		if (!check_file(songpath)) {
-			ret = false;
-			continue;
+	//with adaptive_jobs, 'jobs' threads are started but only up to the
+	//current limit are reading at any time
+	ConcurrencyLimit limit(cpu_count(), options.jobs, options.adaptive_jobs);
+	TagWorkerPool workers(options.worker_command, options.parse_timeout_ms);
+	BadFiles bad_files(options.bad_files, options.retry_bad);
+	const bool use_bad_files = !options.bad_files.empty() && bad_files.Load();
+	const std::string abs_dir = SongRoot(music_dir).Dir();
+	parse_t parse = { music_dir, &options, &scan_io, &limit,
+					  (options.parse_timeout_ms > 0) ? &workers : NULL, &queue, &out, &paths,
+					  use_bad_files ? &bad_files : NULL, abs_dir,
+					  PTHREAD_MUTEX_INITIALIZER, true, 0, 0 };
+	parse_all(parse, options.jobs);
+	pthread_join(walker, NULL);
+
+	//the songs up to the last one queued were all read: the next scan
+	//resumes after it, or from the start once the walk got to the end.
+	//That's only saved by Synced, so a failed sync rescans them.
+	if (budget && walk.ok) {
+		if (found.Stopped()) {
+			config::log("Scan budget used up after %d songs, the next scan resumes after %s",
+						found.Queued(), found.Last().c_str());
+		} else {
+			config::log("Scanned to the end of the library, the next scan starts over");
 		}
+		cursor_pending = true;
+		cursor_after = found.Stopped() ? found.Last() : std::string();
+	}
 
-		file_type_t type = get_type(songpath);
-		if (type == UNKNOWN) {
-			config::log("Unsupported file %s", songpath.c_str());
-			continue;
+	//now that every file was read once, give songs found again through
+	//links and bind mounts the same ratings
+	std::sort(parse.ratings.begin(), parse.ratings.end(), inode_less);
+	size_t shared = share_ratings(parse, parse.deferred);
+	for (std::vector<dir_alias_t>::const_iterator
+			 it = walk.aliases.begin(); it != walk.aliases.end(); ++it) {
+		config::debug("%s is the same directory as %s", it->reldir.c_str(), it->target.c_str());
+		found_list_t songs;
+		ListOutput list(songs);
+		std::vector<dir_alias_t> nested;
+		if (!list_dir(music_dir, it->reldir, options, list, nested)) {
+			parse.ok = false;
+		}
+		shared += share_ratings(parse, songs);
+	}
+	if (shared > 0) {
+		config::log("%d songs were found again by another path (links or mounts), "
+					"and given the rating read the first time.", shared);
+	}
+	pthread_mutex_destroy(&parse.mutex);
+	limit.Report("Scan");
+	if (parse.timeouts > 0 || parse.crashes > 0) {
+		config::log("Skipped %d files which timed out and %d which crashed the tag reader.",
+					parse.timeouts, parse.crashes);
+	}
+	if (use_bad_files) {
+		if (bad_files.Skipped() > 0) {
+			config::log("Skipped %d files which couldn't be read before and haven't changed"
+						" since (listed in %s, use --retry-bad to read them anyway).",
+						bad_files.Skipped(), bad_files.Path().c_str());
+		}
+		bad_files.Save();
+	}
+	return walk.ok && parse.ok;
+}
+
+bool ratesync::sink::File::List(ISongOutput& out) {
+	KeyOutput keys(options, paths, out);
+	std::vector<dir_alias_t> aliases;
+	bool ok = list_dir(music_dir, options.subtree, options, keys, aliases);
+	for (std::vector<dir_alias_t>::const_iterator
+			 it = aliases.begin(); it != aliases.end(); ++it) {
+		std::vector<dir_alias_t> nested;
+		if (!list_dir(music_dir, it->reldir, options, keys, nested)) {
+			ok = false;
 		}
+	}
+	return ok;
+}
 
-		rating_t r;
-		if (!rating(songpath, type, r)) {
-			ret = false;
+bool ratesync::sink::File::GetSongs(const std::vector<song_t>& songs, ISongOutput& out) {
+	//queue every song that's still there up front, then read them in parallel
+	song_queue_t queue(songs.size());
+	for (std::vector<song_t>::const_iterator it = songs.begin(); it != songs.end(); ++it) {
+		const std::string relpath = paths.Path(*it);
+		struct stat sb;
+		if (stat((music_dir + relpath).c_str(), &sb) != 0 || !S_ISREG(sb.st_mode)) {
+			config::debug("Skipping %s, no longer a file", it->c_str());
 			continue;
 		}
+		found_song_t song;
+		song.relpath = relpath;
+		song.type = get_type(relpath);
+		song.link = song.hard_link = false;
+		queue.Push(song);
+	}
+	queue.Close();
+
+	io::ScanIo scan_io(options.io);
+	scan_io.Begin();
+	ConcurrencyLimit limit(cpu_count(), options.jobs, options.adaptive_jobs);
+	TagWorkerPool workers(options.worker_command, options.parse_timeout_ms);
+	const std::string abs_dir = SongRoot(music_dir).Dir();
+	parse_t parse = { music_dir, &options, &scan_io, &limit,
+					  (options.parse_timeout_ms > 0) ? &workers : NULL, &queue, &out, &paths,
+					  NULL, abs_dir, PTHREAD_MUTEX_INITIALIZER, true, 0, 0 };
+	parse_all(parse, (options.jobs < songs.size()) ? options.jobs : songs.size());
+	pthread_mutex_destroy(&parse.mutex);
+	return parse.ok;
+}
+
+int ratesync::sink::tag_worker_main(int sock) {
+	int fd, type;
+	std::string path;
+	while (tagworker::recv_request(sock, fd, type, path)) {
+		rating_t r = UNRATED;
+		FdStream stream(fd, path);
+		bool ok = rating(&stream, (file_type_t)type, r);
+		close(fd);
+		if (!tagworker::send_reply(sock, ok, r, stream.BytesRead())) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-		config::debug("RATING %s = %d", it->c_str(), r);
-		out_ratings.insert(std::make_pair(*it,r));
+bool ratesync::sink::File::Synced() {
+	if (!cursor_pending) {
+		return true;
 	}
-	return ret;
+	cursor_pending = false;
+	return ScanCursor(options.cursor, cursor_scope(music_dir, options)).Save(cursor_after);
 }
 
 bool ratesync::sink::File::Set(const song_ratings_t& song) {
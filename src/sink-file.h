@@ -19,22 +19,86 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string>
+#include <vector>
+
 #include "sink.h"
+#include "iopolicy.h"
 
 namespace ratesync {
 	namespace sink {
+		struct file_options_t {
+			file_options_t() : shard_index(0), shard_count(1), jobs(1),
+							   adaptive_jobs(false), parse_timeout_ms(0),
+							   retry_bad(false), follow_symlinks(true), one_file_system(false),
+							   budget_secs(0), budget_files(0) { }
+
+			io::policy_t io;
+			//only scan this directory within the music dir (keys stay
+			//relative to the music dir)
+			std::string subtree;
+			//only scan songs whose key hashes to shard_index (of shard_count)
+			size_t shard_index, shard_count;
+			//threads reading tags, alongside the one walking directories
+			size_t jobs;
+			//tune how many of the 'jobs' threads read at once, see
+			//ConcurrencyLimit
+			bool adaptive_jobs;
+			//with a timeout, tags are read in 'worker_command' processes
+			//(see TagWorker) which are killed if a file takes longer
+			unsigned parse_timeout_ms;
+			std::vector<std::string> worker_command;
+			//where to remember files that couldn't be read, so that they're
+			//skipped until they change (see BadFiles), unless 'retry_bad'
+			std::string bad_files;
+			bool retry_bad;
+			//whether to scan symlinked files/directories, and directories on
+			//other filesystems. Songs found by several paths are read once.
+			bool follow_symlinks, one_file_system;
+			//with a budget, stop finding songs after this many seconds or
+			//files, and resume after the last one on the next scan. The
+			//position is kept in 'cursor' (see ScanCursor), for scans that
+			//are for the same 'cursor_scope' (what they're synced to).
+			double budget_secs;
+			size_t budget_files;
+			std::string cursor, cursor_scope;
+		};
+
 		class File : public ISink {
 		public:
-		File(const std::string& music_dir) : music_dir(music_dir) { }
+		File(const std::string& music_dir,
+			 const file_options_t& options = file_options_t())
+			: music_dir(music_dir), options(options), cursor_pending(false) { }
 			virtual ~File() { }
 
-			bool Get(std::map<song_t,rating_t>& out_ratings);
+			bool Get(ISongOutput& out);
 			bool Set(const song_ratings_t& song);
 			bool Clear(const song_rating_t& song);
+			//Walks the directories without reading any tags.
+			bool List(ISongOutput& out);
+			bool GetSongs(const std::vector<song_t>& songs, ISongOutput& out);
+			//Tags aren't written yet, see Set.
+			bool Writable() const { return false; }
+			//Filled in by Get, List and GetSongs.
+			const SongPaths* Paths() const { return &paths; }
+			//With a budget, saves where the last Get stopped, so that the
+			//next scan only resumes after it once its songs were synced.
+			bool Synced();
 
 		private:
+			File(const File& sink);//disallow copy
+
 			const std::string music_dir;
+			const file_options_t options;
+			SongPaths paths;
+			//where the next scan resumes, set by a budgeted Get
+			bool cursor_pending;
+			std::string cursor_after;
 		};
+
+		//Serves TagWorker requests on 'sock' until it's closed, returns
+		//the process' exit code.
+		int tag_worker_main(int sock);
 	}
 }
 
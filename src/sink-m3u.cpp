@@ -0,0 +1,214 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sink-m3u.h"
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+	static const size_t PLAYLISTS = 6;
+	static const size_t PLAYLIST_BUFFER_SIZE = 256 * 1024;
+
+	inline bool valid(ratesync::rating_t rating) {
+		return rating >= UNRATED && rating <= 5;
+	}
+	inline size_t slot(ratesync::rating_t rating) {
+		return rating + 1;
+	}
+}
+
+ratesync::sink::M3u::M3u(const std::string& music_dir, const std::string& playlist_dir)
+	: playlist_dir(playlist_dir), root(music_dir), stale(0) {
+	for (size_t i = 0; i < PLAYLISTS; ++i) {
+		dirty[i] = false;
+	}
+}
+
+std::string ratesync::sink::M3u::playlist_path(rating_t rating) const {
+	char name[16];
+	if (rating == UNRATED) {
+		snprintf(name, sizeof(name), "unrated.m3u8");
+	} else {
+		snprintf(name, sizeof(name), "%d.m3u8", rating);
+	}
+	return playlist_dir + name;
+}
+
+bool ratesync::sink::M3u::Get(ISongOutput& out) {
+	struct stat sb;
+	if (stat(playlist_dir.c_str(), &sb) != 0 && mkdir(playlist_dir.c_str(), 0777) != 0) {
+		config::error("Unable to create playlist dir: %s", playlist_dir.c_str());
+		return false;
+	}
+
+	//entries whose file is gone are left out (and dropped from the
+	//playlist by Commit), unless the whole music dir is missing
+	const bool prune = (stat(root.Dir().c_str(), &sb) == 0);
+	if (!prune) {
+		config::error("Music dir %s not found, keeping playlist entries for missing songs",
+					  root.Dir().c_str());
+	}
+	songs.clear();
+	stale = 0;
+	SongRoot playlist_root(playlist_dir);
+	for (rating_t rating = UNRATED; rating <= 5; rating = (rating == UNRATED) ? 1 : rating + 1) {
+		const std::string path = playlist_path(rating);
+		FILE* f = fopen(path.c_str(), "r");
+		if (f == NULL) {
+			if (errno == ENOENT) {
+				continue;//no songs with this rating yet
+			}
+			config::error("Unable to open playlist %s", path.c_str());
+			return false;
+		}
+		setvbuf(f, NULL, _IOFBF, PLAYLIST_BUFFER_SIZE);
+
+		char* line = NULL;
+		size_t line_size = 0;
+		ssize_t len;
+		while ((len = getline(&line, &line_size, f)) >= 0) {
+			while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+				line[--len] = 0;
+			}
+			if (len == 0 || line[0] == '#') {
+				continue;//blank, or #EXTM3U/#EXTINF
+			}
+			std::string entry(line, len);
+			if (entry[0] != SEP) {
+				//relative to the playlist
+				entry = playlist_root.Dir() + entry;
+			}
+			song_t song;
+			if (!root.Key(entry, song)) {
+				config::error("Playlist %s: song outside of music dir: %s",
+							  path.c_str(), line);
+				continue;
+			}
+			if (prune && stat(entry.c_str(), &sb) != 0 &&
+				(errno == ENOENT || errno == ENOTDIR)) {
+				config::debug("Playlist %s: song is gone: %s", path.c_str(), line);
+				dirty[slot(rating)] = true;
+				++stale;
+				continue;
+			}
+			if (!songs.insert(std::make_pair(song, rating)).second) {
+				config::error("Playlist %s: song listed more than once: %s",
+							  path.c_str(), line);
+				dirty[slot(rating)] = true;//drop it on the next write
+				continue;
+			}
+			out.Put(song, rating);
+		}
+		free(line);
+		bool ok = !ferror(f);
+		fclose(f);
+		if (!ok) {
+			config::error("Unable to read playlist %s", path.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ratesync::sink::M3u::Set(const song_ratings_t& song) {
+	if (!valid(song.rating_new)) {
+		return false;
+	}
+	if (song.path.find('\n') != std::string::npos) {
+		config::error("Song %s can't be listed in a playlist", song.path.c_str());
+		return false;
+	}
+	std::map<song_t, rating_t>::iterator iter = songs.find(song.path);
+	if (iter != songs.end()) {
+		dirty[slot(iter->second)] = true;
+		iter->second = song.rating_new;
+	} else {
+		songs.insert(std::make_pair(song.path, song.rating_new));
+	}
+	dirty[slot(song.rating_new)] = true;
+	return true;
+}
+
+bool ratesync::sink::M3u::Clear(const song_rating_t& song) {
+	std::map<song_t, rating_t>::iterator iter = songs.find(song.path);
+	if (iter == songs.end()) {
+		return false;
+	}
+	dirty[slot(iter->second)] = true;
+	songs.erase(iter);
+	return true;
+}
+
+bool ratesync::sink::M3u::Commit() {
+	//one pass over the songs, appending each to its playlist if it changed
+	FILE* files[PLAYLISTS];
+	std::string paths[PLAYLISTS];
+	bool ok = true;
+	for (size_t i = 0; i < PLAYLISTS; ++i) {
+		files[i] = NULL;
+		if (!dirty[i]) {
+			continue;
+		}
+		paths[i] = playlist_path((rating_t)i - 1);
+		files[i] = fopen((paths[i] + ".tmp").c_str(), "w");
+		if (files[i] == NULL) {
+			config::error("Unable to create playlist %s.tmp", paths[i].c_str());
+			ok = false;
+			continue;
+		}
+		setvbuf(files[i], NULL, _IOFBF, PLAYLIST_BUFFER_SIZE);
+		fputs("#EXTM3U\n", files[i]);
+	}
+
+	for (std::map<song_t, rating_t>::const_iterator
+			 it = songs.begin(); ok && it != songs.end(); ++it) {
+		FILE* f = files[slot(it->second)];
+		if (f != NULL) {
+			fputs(root.Path(it->first).c_str(), f);
+			fputc('\n', f);
+		}
+	}
+
+	for (size_t i = 0; i < PLAYLISTS; ++i) {
+		if (files[i] == NULL) {
+			continue;
+		}
+		const std::string tmp_path = paths[i] + ".tmp";
+		bool written = ok && !ferror(files[i]) && fflush(files[i]) == 0 &&
+			fsync(fileno(files[i])) == 0;
+		written = (fclose(files[i]) == 0) && written;
+		if (!written || rename(tmp_path.c_str(), paths[i].c_str()) != 0) {
+			if (ok) {
+				config::error("Unable to write playlist %s", paths[i].c_str());
+			}
+			unlink(tmp_path.c_str());
+			ok = false;
+			continue;
+		}
+		dirty[i] = false;
+	}
+	if (ok) {
+		stale = 0;
+	}
+	return ok;
+}
@@ -0,0 +1,61 @@
+#ifndef RATESYNC_SINK_M3U_H
+#define RATESYNC_SINK_M3U_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "sink.h"
+
+namespace ratesync {
+	namespace sink {
+		//Keeps one M3U8 playlist per rating ("unrated.m3u8", "1.m3u8" to
+		//"5.m3u8") of absolute song paths. Changes are only made in memory
+		//until Commit(), which rewrites each affected playlist in one go and
+		//renames it into place.
+		class M3u : public ISink {
+		public:
+			M3u(const std::string& music_dir, const std::string& playlist_dir);
+			virtual ~M3u() { }
+
+			bool Get(ISongOutput& out);
+			bool Set(const song_ratings_t& song);
+			bool Clear(const song_rating_t& song);
+			void SetPaths(const SongPaths* paths) { root.SetPaths(paths); }
+
+			bool AddsSong(rating_t /*rating*/) const { return true; }
+			size_t Stale() const { return stale; }
+			bool Commit();
+
+		private:
+			M3u(const M3u& sink);//disallow copy
+
+			std::string playlist_path(rating_t rating) const;
+
+			const std::string playlist_dir;
+			SongRoot root;
+			std::map<song_t, rating_t> songs;
+			//indexed by rating+1 (unrated, 1-5)
+			bool dirty[6];
+			//entries dropped by Get, see Stale
+			size_t stale;
+		};
+	}
+}
+
+#endif
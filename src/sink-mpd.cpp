@@ -17,111 +17,447 @@
 */
 
 #include "sink-mpd.h"
+#include "rating-decode.h"
+#include "threadpool.h"
 #include "config.h"
 
 #include <mpd/client.h>
-#include <sstream>
-#include <assert.h>
+#include <algorithm>
+#include <string.h>
 
 namespace {
 	static const char* RATING_STICKER = "rating";
+	//songs per sticker query task
+	static const size_t GET_CHUNK = 256;
 
-	bool rating_get(struct mpd_connection* conn, const ratesync::song_t& song,
+	bool parse_rating(const std::string& uri, const char* value,
+					  ratesync::rating_t& out) {
+		//extract rating (1-5) from sticker
+		ratesync::rating_t mpd_rating;
+		if (!ratesync::decode::parse_int(ratesync::decode::CStr(value), mpd_rating) ||
+			mpd_rating < 1 || mpd_rating > 5) {
+			ratesync::config::error("MPD Song '%s': Unknown rating value '%s'",
+									uri.c_str(), value);
+			return false;
+		}
+		out = mpd_rating;
+		return true;
+	}
+
+	bool closed(struct mpd_connection* conn) {
+		return mpd_connection_get_error(conn) == MPD_ERROR_CLOSED;
+	}
+
+	bool rating_get(struct mpd_connection* conn, const std::string& uri,
 					ratesync::rating_t& out) {
 		struct mpd_pair* mpd_rating_pair;
-		if (mpd_send_sticker_get(conn, "song", song.c_str(), RATING_STICKER) &&
+		if (mpd_send_sticker_get(conn, "song", uri.c_str(), RATING_STICKER) &&
 			(mpd_rating_pair = mpd_recv_sticker(conn)) != NULL) {
-			//extract rating (1-5) from sticker
+			bool valid = parse_rating(uri, mpd_rating_pair->value, out);
+			mpd_return_sticker(conn,mpd_rating_pair);
 			if (!mpd_response_finish(conn)) {
 				ratesync::config::error("Failed to close sticker query");
 				return false;
 			}
-			ratesync::rating_t mpd_rating;
-			std::istringstream mpd_rating_stream(mpd_rating_pair->value);
-			mpd_rating_stream >> mpd_rating;
-			if (mpd_rating_stream.fail() || mpd_rating < 1 || mpd_rating > 5) {
-				mpd_return_sticker(conn,mpd_rating_pair);
-				ratesync::config::error("MPD Song '%s': Unknown rating value '%s'",
-										song.c_str(), mpd_rating_pair->value);
-				return false;
-			}
-			mpd_return_sticker(conn,mpd_rating_pair);
-			out = mpd_rating;
-			return true;
+			return valid;
 		} else {
 			//requested sticker is unset. clear error state and continue
 			if (!mpd_connection_clear_error(conn)) {
 				//it was a fatal error (not just unset sticker), abort
-				ratesync::config::error("Failed to get sticker");
+				if (!closed(conn)) {
+					ratesync::config::error("Failed to get sticker");
+				}
 				return false;
 			}
 			out = UNRATED;
 			return true;
 		}
 	}
+
+	//Gets all rating stickers with a single 'sticker find'. Returns false
+	//with 'supported' unset if the server refused the command.
+	bool find_ratings(struct mpd_connection* conn,
+					  std::map<std::string, ratesync::rating_t>& ratings,
+					  bool& supported) {
+		supported = true;
+		if (!mpd_send_sticker_find(conn, "song", "", RATING_STICKER)) {
+			return false;
+		}
+		std::string file;
+		struct mpd_pair* pair;
+		while ((pair = mpd_recv_pair(conn)) != NULL) {
+			if (strcmp(pair->name, "file") == 0) {
+				file = pair->value;
+			} else if (strcmp(pair->name, "sticker") == 0) {
+				unsigned name_len;
+				const char* value = mpd_parse_sticker(pair->value, &name_len);
+				ratesync::rating_t r;
+				if (value != NULL && !file.empty() && parse_rating(file, value, r)) {
+					ratings[file] = r;
+				}
+			}
+			mpd_return_pair(conn, pair);
+		}
+		if (!mpd_response_finish(conn)) {
+			//old servers, or ones with the sticker db disabled
+			supported = !(mpd_connection_get_error(conn) == MPD_ERROR_SERVER &&
+						  mpd_connection_clear_error(conn));
+			return false;
+		}
+		return true;
+	}
+
+	//Appends the uri of every song in the database to 'uris'. Only the
+	//"file" lines of each response are kept (no mpd_song is built), and
+	//the database is listed one top level directory at a time, which keeps
+	//each response well below MPD's output buffer limit.
+	bool list_uris(struct mpd_connection* conn, std::vector<std::string>& uris) {
+		//the root: songs (with their metadata, but there are usually few)
+		//and the directories to list recursively
+		std::vector<std::string> dirs;
+		if (!mpd_send_list_meta(conn, "")) {
+			return false;
+		}
+		struct mpd_pair* pair;
+		while ((pair = mpd_recv_pair(conn)) != NULL) {
+			if (strcmp(pair->name, "file") == 0) {
+				uris.push_back(pair->value);
+			} else if (strcmp(pair->name, "directory") == 0) {
+				dirs.push_back(pair->value);
+			}
+			mpd_return_pair(conn, pair);
+		}
+		if (!mpd_response_finish(conn)) {
+			return false;
+		}
+
+		for (std::vector<std::string>::const_iterator
+				 it = dirs.begin(); it != dirs.end(); ++it) {
+			if (!mpd_send_list_all(conn, it->c_str())) {
+				return false;
+			}
+			while ((pair = mpd_recv_pair_named(conn, "file")) != NULL) {
+				uris.push_back(pair->value);
+				mpd_return_pair(conn, pair);
+			}
+			if (!mpd_response_finish(conn)) {
+				return false;
+			}
+			ratesync::config::debug("Listed MPD directory %s (%d songs so far)",
+									it->c_str(), uris.size());
+		}
+		return true;
+	}
+
+	//Gets the stickers for a range of songs, one query at a time.
+	class GetTask : public ratesync::ITask {
+	public:
+		GetTask(ratesync::sink::MpdPool& pool,
+				const std::vector<std::string>& uris,
+				std::vector<ratesync::rating_t>& ratings,
+				size_t begin, size_t end, bool& failed)
+			: pool(pool), uris(uris), ratings(ratings),
+			  begin(begin), end(end), failed(failed) { }
+
+		void Run() {
+			struct mpd_connection* conn = pool.Acquire();
+			if (conn == NULL) {
+				failed = true;
+				return;
+			}
+			for (size_t i = begin; i < end && !failed; ++i) {
+				if (!rating_get(conn, uris[i], ratings[i]) &&
+					!(pool.Reconnect(conn) && rating_get(conn, uris[i], ratings[i]))) {
+					ratesync::config::error("MPD Song '%s': Unable to get rating",
+											uris[i].c_str());
+					failed = true;//other tasks notice and stop early
+				}
+			}
+			pool.Release(conn);
+		}
+
+	private:
+		ratesync::sink::MpdPool& pool;
+		const std::vector<std::string>& uris;
+		std::vector<ratesync::rating_t>& ratings;
+		const size_t begin, end;
+		bool& failed;
+	};
 }
 
-ratesync::sink::Mpd::Mpd(const std::string& host, size_t port)
-	: host(host), port(port), conn(NULL) { }
+ratesync::sink::MpdPool::MpdPool(const std::string& host, size_t port,
+								 const mpd_options_t& options)
+	: host(host), port(port), options(options), open(0) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&released, NULL);
+}
 
-ratesync::sink::Mpd::~Mpd() {
-	if (conn != NULL) {
-		mpd_connection_free(conn);
-		conn = NULL;
+ratesync::sink::MpdPool::~MpdPool() {
+	for (std::vector<struct mpd_connection*>::iterator
+			 it = idle.begin(); it != idle.end(); ++it) {
+		mpd_connection_free(*it);
 	}
+	pthread_cond_destroy(&released);
+	pthread_mutex_destroy(&mutex);
 }
 
-bool ratesync::sink::Mpd::Get(std::map<song_t,rating_t>& out_rating) {
-	conn = mpd_connection_new(host.c_str(), port, 0);
+struct mpd_connection* ratesync::sink::MpdPool::connect() {
+	struct mpd_connection* conn =
+		mpd_connection_new(host.c_str(), port, options.timeout_ms);
+	if (conn == NULL) {
+		config::error("Unable to connect to MPD Server @ %s:%d: out of memory",
+					  host.c_str(), port);
+		return NULL;
+	}
 	if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
 		config::error("Unable to connect to MPD Server @ %s:%d: %s",
 					  host.c_str(), port,
 					  mpd_connection_get_error_message(conn));
+		mpd_connection_free(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+struct mpd_connection* ratesync::sink::MpdPool::Acquire() {
+	{
+		Lock lock(mutex);
+		while (idle.empty() && open >= options.connections) {
+			pthread_cond_wait(&released, &mutex);
+		}
+		if (!idle.empty()) {
+			struct mpd_connection* conn = idle.back();
+			idle.pop_back();
+			return conn;
+		}
+		++open;
+	}
+	//connect without holding the lock, others may be releasing meanwhile
+	struct mpd_connection* conn = connect();
+	if (conn == NULL) {
+		Lock lock(mutex);
+		--open;
+		pthread_cond_signal(&released);
+	}
+	return conn;
+}
+
+void ratesync::sink::MpdPool::Release(struct mpd_connection* conn) {
+	if (conn == NULL) {
+		return;//already given up on by Reconnect
+	}
+	const bool broken = (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS &&
+						 !mpd_connection_clear_error(conn));
+	if (broken) {
+		mpd_connection_free(conn);
+	}
+	Lock lock(mutex);
+	if (broken) {
+		--open;
+	} else {
+		idle.push_back(conn);
+	}
+	pthread_cond_signal(&released);
+}
+
+bool ratesync::sink::MpdPool::Reconnect(struct mpd_connection*& conn) {
+	if (conn == NULL || !closed(conn)) {
+		return false;
+	}
+	config::debug("MPD closed the connection, reconnecting");
+	mpd_connection_free(conn);
+	conn = connect();
+	if (conn == NULL) {
+		Lock lock(mutex);
+		--open;
+		pthread_cond_signal(&released);
 		return false;
 	}
+	return true;
+}
+
+ratesync::sink::Mpd::Mpd(const std::string& host, size_t port,
+						 const mpd_options_t& options)
+	: options(options), pool(host, port, options) { }
 
-	if (!mpd_send_list_all(conn,"")) {
+bool ratesync::sink::Mpd::list(std::vector<std::string>& song_uris) {
+	struct mpd_connection* conn = pool.Acquire();
+	if (conn == NULL) {
+		return false;
+	}
+	if (!list_uris(conn, song_uris)) {
 		config::error("Got error when retrieving list of MPD songs: %s",
 					  mpd_connection_get_error_message(conn));
+		pool.Release(conn);
 		return false;
 	}
+	pool.Release(conn);
+	return true;
+}
 
-	struct mpd_song* song_orig = NULL;
-	while ((song_orig = mpd_recv_song(conn)) != NULL) {
-		song_t song = mpd_song_get_uri(song_orig);
-		mpd_song_free(song_orig);
+bool ratesync::sink::Mpd::get_each(const std::vector<std::string>& song_uris,
+								   std::vector<rating_t>& ratings) {
+	config::debug("Querying %d MPD songs on %d connections",
+				  song_uris.size(), options.connections);
+	bool failed = false;
+	{
+		ThreadPool threads((options.connections > 1) ? options.connections : 0);
+		for (size_t i = 0; i < song_uris.size(); i += GET_CHUNK) {
+			size_t end = (i + GET_CHUNK < song_uris.size()) ? i + GET_CHUNK : song_uris.size();
+			threads.Add(new GetTask(pool, song_uris, ratings, i, end, failed));
+		}
+		threads.Wait();
+	}
+	return !failed;
+}
 
-		rating_t r;
-		if (!rating_get(conn, song, r)) {
-			return false;//immediately abort
+void ratesync::sink::Mpd::put(const std::vector<std::string>& song_uris,
+							  const std::vector<rating_t>& ratings, ISongOutput& out) {
+	for (size_t i = 0; i < song_uris.size(); ++i) {
+		const std::string& uri = song_uris[i];
+		song_t song(uri);
+		if (!normalize_key(song)) {
+			config::error("MPD Song '%s': Unable to produce key", uri.c_str());
+			continue;
 		}
+		if (song != uri) {
+			//only remember the original uri where it differs from the key
+			uris.insert(std::make_pair(song, uri));
+		}
+		out.Put(song, ratings[i]);
+	}
+}
 
-		out_rating.insert(std::make_pair(song, r));
+bool ratesync::sink::Mpd::Get(ISongOutput& out) {
+	std::vector<std::string> song_uris;
+	if (!list(song_uris)) {
+		return false;
+	}
+
+	//one round trip for every rating if the server supports it, otherwise
+	//one per song, spread over the pool
+	std::vector<rating_t> ratings(song_uris.size(), UNRATED);
+	std::map<std::string, rating_t> found;
+	bool supported;
+	struct mpd_connection* conn = pool.Acquire();
+	if (conn == NULL) {
+		return false;
+	}
+	if (find_ratings(conn, found, supported)) {
+		pool.Release(conn);
+		for (size_t i = 0; i < song_uris.size(); ++i) {
+			std::map<std::string, rating_t>::const_iterator iter = found.find(song_uris[i]);
+			if (iter != found.end()) {
+				ratings[i] = iter->second;
+			}
+		}
+	} else if (supported) {
+		config::error("Got error when retrieving MPD stickers: %s",
+					  mpd_connection_get_error_message(conn));
+		pool.Release(conn);
+		return false;
+	} else {
+		pool.Release(conn);
+		config::debug("MPD can't find stickers, querying each song");
+		if (!get_each(song_uris, ratings)) {
+			return false;//immediately abort
+		}
 	}
 
+	put(song_uris, ratings, out);
 	return true;
 }
 
-bool ratesync::sink::Mpd::Set(const song_ratings_t& song) {
-	std::ostringstream file_rating_ss;
-	file_rating_ss << song.rating_new;
-	const char* file_rating_s = file_rating_ss.str().c_str();
-
-	assert(conn != NULL);
-	if (!mpd_run_sticker_set(conn, "song", song.path.c_str(), RATING_STICKER, file_rating_s)) {
-		config::error("MPD Song '%s' : Error setting rating sticker", song.path.c_str());
+bool ratesync::sink::Mpd::List(ISongOutput& out) {
+	std::vector<std::string> song_uris;
+	if (!list(song_uris)) {
 		return false;
 	}
+	put(song_uris, std::vector<rating_t>(song_uris.size(), UNRATED), out);
+	return true;
+}
 
+bool ratesync::sink::Mpd::GetSongs(const std::vector<song_t>& songs, ISongOutput& out) {
+	//listing is cheap next to the stickers, and tells songs that aren't in
+	//the database apart from ones that are unrated
+	std::vector<std::string> song_uris, wanted;
+	if (!list(song_uris)) {
+		return false;
+	}
+	for (std::vector<std::string>::const_iterator
+			 it = song_uris.begin(); it != song_uris.end(); ++it) {
+		song_t song(*it);
+		if (normalize_key(song) && std::binary_search(songs.begin(), songs.end(), song)) {
+			wanted.push_back(*it);
+		}
+	}
+	std::vector<rating_t> ratings(wanted.size(), UNRATED);
+	if (!get_each(wanted, ratings)) {
+		return false;
+	}
+	put(wanted, ratings, out);
 	return true;
 }
 
-bool ratesync::sink::Mpd::Clear(const song_rating_t& song) {
-	assert(conn != NULL);
-	if (!mpd_run_sticker_delete(conn, "song", song.path.c_str(), RATING_STICKER)) {
+bool ratesync::sink::Mpd::set(struct mpd_connection*& conn, const song_ratings_t& song) {
+	const char* song_uri = uri(song.path).c_str();
+	if (song.rating_new == UNRATED) {
+		if (mpd_run_sticker_delete(conn, "song", song_uri, RATING_STICKER) ||
+			(pool.Reconnect(conn) &&
+			 mpd_run_sticker_delete(conn, "song", song_uri, RATING_STICKER))) {
+			return true;
+		}
 		config::error("MPD Song '%s': Error clearing rating sticker", song.path.c_str());
+		if (conn != NULL) {
+			mpd_connection_clear_error(conn);
+		}
 		return false;
 	}
 
-	return true;
+	char file_rating_s[12];
+	decode::format_int(song.rating_new, file_rating_s);
+	if (mpd_run_sticker_set(conn, "song", song_uri, RATING_STICKER, file_rating_s) ||
+		(pool.Reconnect(conn) &&
+		 mpd_run_sticker_set(conn, "song", song_uri, RATING_STICKER, file_rating_s))) {
+		return true;
+	}
+	config::error("MPD Song '%s' : Error setting rating sticker", song.path.c_str());
+	if (conn != NULL) {
+		mpd_connection_clear_error(conn);
+	}
+	return false;
+}
+
+bool ratesync::sink::Mpd::Set(const song_ratings_t& song) {
+	std::vector<song_ratings_t> songs(1, song);
+	return SetShard(songs) == 0;
+}
+
+size_t ratesync::sink::Mpd::SetShard(const std::vector<song_ratings_t>& songs) {
+	struct mpd_connection* conn = pool.Acquire();
+	if (conn == NULL) {
+		return songs.size();
+	}
+	size_t failed = 0;
+	for (std::vector<song_ratings_t>::const_iterator
+			 it = songs.begin(); it != songs.end(); ++it) {
+		if (conn == NULL || !set(conn, *it)) {
+			++failed;
+		}
+	}
+	pool.Release(conn);
+	return failed;
+}
+
+bool ratesync::sink::Mpd::Clear(const song_rating_t& song) {
+	song_ratings_t change;
+	change.path = song.path;
+	change.rating_old = song.rating;
+	change.rating_new = UNRATED;
+	return Set(change);
+}
+
+const std::string& ratesync::sink::Mpd::uri(const song_t& song) const {
+	std::map<song_t, std::string>::const_iterator iter = uris.find(song);
+	return (iter == uris.end()) ? song : iter->second;
 }
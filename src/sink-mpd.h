@@ -19,27 +19,84 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <vector>
+#include <pthread.h>
+
 #include "sink.h"
 
 struct mpd_connection;
 
 namespace ratesync {
 	namespace sink {
+		struct mpd_options_t {
+			mpd_options_t() : connections(1), timeout_ms(30000) { }
+
+			//sticker queries/updates are spread over up to this many
+			//connections, when the server can't list all stickers at once
+			size_t connections;
+			unsigned timeout_ms;
+		};
+
+		//Opens connections on demand, and hands them out to one thread at a time.
+		class MpdPool {
+		public:
+			MpdPool(const std::string& host, size_t port, const mpd_options_t& options);
+			~MpdPool();
+
+			//Returns NULL if a new connection couldn't be opened.
+			struct mpd_connection* Acquire();
+			//Connections in an unrecoverable error state are closed.
+			void Release(struct mpd_connection* conn);
+			//Replaces a connection that was closed by the server (eg after
+			//its idle timeout). Returns false if it's broken otherwise, or if
+			//reconnecting failed.
+			bool Reconnect(struct mpd_connection*& conn);
+
+		private:
+			MpdPool(const MpdPool&);//disallow copy
+			struct mpd_connection* connect();
+
+			const std::string host;
+			const size_t port;
+			const mpd_options_t options;
+			std::vector<struct mpd_connection*> idle;
+			size_t open;
+			pthread_mutex_t mutex;
+			pthread_cond_t released;
+		};
+
 		class Mpd : public ISink {
 		public:
-			Mpd(const std::string& host, size_t port);
-			virtual ~Mpd();
+			Mpd(const std::string& host, size_t port,
+				const mpd_options_t& options = mpd_options_t());
+			virtual ~Mpd() { }
 
-			bool Get(std::map<song_t,rating_t>& out_rating);
+			bool Get(ISongOutput& out);
 			bool Set(const song_ratings_t& song);
 			bool Clear(const song_rating_t& song);
+			bool List(ISongOutput& out);
+			bool GetSongs(const std::vector<song_t>& songs, ISongOutput& out);
+
+			size_t SetShard(const std::vector<song_ratings_t>& songs);
+			bool ThreadSafe() const { return options.connections > 1; }
 
 		private:
 			Mpd(const Mpd& sink);//disallow copy
 
-			const std::string host;
-			const size_t port;
-			struct mpd_connection* conn;
+			bool set(struct mpd_connection*& conn, const song_ratings_t& song);
+			bool list(std::vector<std::string>& song_uris);
+			//Gets the ratings one song at a time, spread over the pool.
+			bool get_each(const std::vector<std::string>& song_uris,
+						  std::vector<rating_t>& ratings);
+			void put(const std::vector<std::string>& song_uris,
+					 const std::vector<rating_t>& ratings, ISongOutput& out);
+
+			//the MPD uri for a song key
+			const std::string& uri(const song_t& song) const;
+
+			const mpd_options_t options;
+			MpdPool pool;
+			std::map<song_t, std::string> uris;
 		};
 	}
 }
@@ -0,0 +1,154 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sink-partial.h"
+#include "extsort.h"
+#include "recordio.h"
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+	//bump the trailing digit if the record format changes
+	const char MAGIC[] = "RSPART2\n";
+	const size_t MAGIC_LEN = sizeof(MAGIC) - 1;
+	const size_t PARTIAL_BUFFER_SIZE = 64 * 1024;
+}
+
+FILE* ratesync::sink::open_partial(const std::string& path) {
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == NULL) {
+		config::error("Unable to open partial file %s", path.c_str());
+		return NULL;
+	}
+	char magic[MAGIC_LEN];
+	if (fread(magic, 1, MAGIC_LEN, f) != MAGIC_LEN ||
+		memcmp(magic, MAGIC, MAGIC_LEN) != 0) {
+		config::error("%s is not a partial file (or from another version)",
+					  path.c_str());
+		fclose(f);
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, PARTIAL_BUFFER_SIZE);
+	return f;
+}
+
+bool ratesync::sink::Partial::Get(ISongOutput& out) {
+	std::vector<FILE*> files;
+	bool ret = true;
+	for (std::vector<std::string>::const_iterator
+			 it = paths.begin(); it != paths.end(); ++it) {
+		FILE* f = open_partial(*it);
+		if (f == NULL) {
+			ret = false;
+			break;
+		}
+		files.push_back(f);
+	}
+
+	if (ret) {
+		//the merger logs any songs found in more than one partial
+		RunMerger merger(files);
+		song_t song;
+		rating_t rating;
+		while (merger.Next(song, rating)) {
+			if (!out.Put(song, rating)) {
+				ret = false;
+			}
+		}
+		ret = ret && !merger.Failed();
+	}
+
+	for (std::vector<FILE*>::iterator it = files.begin(); it != files.end(); ++it) {
+		fclose(*it);
+	}
+	return ret;
+}
+
+bool ratesync::sink::Partial::Set(const song_ratings_t& song) {
+	config::error("Partial results are read-only (song %s)", song.path.c_str());
+	return false;
+}
+
+bool ratesync::sink::Partial::Clear(const song_rating_t& song) {
+	config::error("Partial results are read-only (song %s)", song.path.c_str());
+	return false;
+}
+
+ratesync::sink::PartialWriter::PartialWriter(const std::string& path)
+	: path(path), tmp_path(path + ".tmp"), file(NULL), failed(false) { }
+
+ratesync::sink::PartialWriter::~PartialWriter() {
+	if (file != NULL) {
+		//never committed: don't leave a half-written file around
+		fclose(file);
+		unlink(tmp_path.c_str());
+	}
+}
+
+bool ratesync::sink::PartialWriter::Open() {
+	file = fopen(tmp_path.c_str(), "wb");
+	if (file == NULL) {
+		config::error("Unable to create partial file %s", tmp_path.c_str());
+		return false;
+	}
+	setvbuf(file, NULL, _IOFBF, PARTIAL_BUFFER_SIZE);
+	if (fwrite(MAGIC, 1, MAGIC_LEN, file) != MAGIC_LEN) {
+		config::error("Unable to write partial file %s", tmp_path.c_str());
+		failed = true;
+		return false;
+	}
+	return true;
+}
+
+bool ratesync::sink::PartialWriter::Put(const song_t& song, rating_t rating) {
+	if (failed || file == NULL) {
+		return false;
+	}
+	if (end.count > 0 && !(last < song)) {
+		config::error("INTERNAL ERROR: partial songs out of order: %s after %s",
+					  song.c_str(), last.c_str());
+		failed = true;
+		return false;
+	}
+	if (!record::write_song(file, song, rating)) {
+		config::error("Unable to write partial file %s", tmp_path.c_str());
+		failed = true;
+		return false;
+	}
+	last = song;
+	end.Add(song, rating);
+	return true;
+}
+
+bool ratesync::sink::PartialWriter::Commit() {
+	if (file == NULL) {
+		return false;
+	}
+	bool ok = !failed && record::write_songs_end(file, end) &&
+		fflush(file) == 0 && fsync(fileno(file)) == 0;
+	ok = (fclose(file) == 0) && ok;
+	file = NULL;
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		config::error("Unable to write partial file %s", path.c_str());
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,80 @@
+#ifndef RATESYNC_SINK_PARTIAL_H
+#define RATESYNC_SINK_PARTIAL_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <vector>
+
+#include "sink.h"
+#include "recordio.h"
+
+//Partial scan results, as written by the scan command: a header followed
+//by songs sorted by key and their count and checksum (see recordio.h). Since each file is sorted, any
+//number of them can be combined by a streaming merge.
+
+namespace ratesync {
+	namespace sink {
+		//Reads songs from one or more partial files, as a single sorted
+		//list. Read-only, so it can only be used as a source.
+		class Partial : public ISink {
+		public:
+			Partial(const std::vector<std::string>& paths) : paths(paths) { }
+			virtual ~Partial() { }
+
+			bool Get(ISongOutput& out);
+			bool Set(const song_ratings_t& song);
+			bool Clear(const song_rating_t& song);
+			bool Writable() const { return false; }
+
+		private:
+			const std::vector<std::string> paths;
+		};
+
+		//Opens a partial file and checks its header, leaving it at the
+		//first song (eg for a RunMerger). Returns NULL on error.
+		FILE* open_partial(const std::string& path);
+
+		//Writes songs into a new partial file. Songs must be Put in
+		//ascending order. The file only appears at 'path' once Commit()
+		//succeeds.
+		class PartialWriter : public ISongOutput {
+		public:
+			PartialWriter(const std::string& path);
+			virtual ~PartialWriter();
+
+			bool Open();
+			bool Put(const song_t& song, rating_t rating);
+			bool Commit();
+
+			size_t Size() const { return end.count; }
+
+		private:
+			PartialWriter(const PartialWriter&);//disallow copy
+
+			const std::string path, tmp_path;
+			FILE* file;
+			song_t last;
+			record::songs_end_t end;
+			bool failed;
+		};
+	}
+}
+
+#endif
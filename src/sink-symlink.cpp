@@ -17,6 +17,7 @@
 */
 
 #include "sink-symlink.h"
+#include "threadpool.h"
 #include "config.h"
 
 #include <sstream>
@@ -27,11 +28,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 
 namespace {
 	bool check_symlink(const std::string& linkpath, bool show_err = true) {
 		struct stat sb;
-		if (stat(linkpath.c_str(), &sb) != 0) {
+		if (lstat(linkpath.c_str(), &sb) != 0) {
 			ratesync::config::error("Unable to stat file %s.",
 									linkpath.c_str());
 			return false;
@@ -46,19 +50,30 @@ namespace {
 		return true;
 	}
 
-	bool scan_rating_subdir(const std::string& subdir, ratesync::rating_t rating,
-							std::map<ratesync::song_t, ratesync::rating_t>& out_rating) {
-		std::queue<std::string> dirqueue;
-		dirqueue.push(subdir);
+	//Scans the links in 'subdir', which is found at 'relsubdir' within the
+	//symlink dir. Link targets are converted into song keys using 'root'.
+	//With 'prune', links whose target is gone are left out and added to
+	//'dangling' instead.
+	bool scan_rating_subdir(const ratesync::SongRoot& root,
+							const ratesync::SongRoot& links,
+							const std::string& subdir, const std::string& relsubdir,
+							ratesync::rating_t rating, bool prune,
+							std::vector<std::string>& dangling,
+							ratesync::ISongOutput& out) {
+		std::queue<std::string> reldirqueue;
+		reldirqueue.push("");
 
-		char symdest_c[1024];
-		memset(&symdest_c, 0, sizeof(symdest_c));
-		while (!dirqueue.empty()) {
-			std::string dir = dirqueue.front();
-			dirqueue.pop();
+		char symdest_c[PATH_MAX];
+		while (!reldirqueue.empty()) {
+			std::string reldir = reldirqueue.front();
+			reldirqueue.pop();
+			std::string dir = subdir+reldir;
 
 			DIR* dp = opendir(dir.c_str());
 			if (dp == NULL) {
+				if (errno == ENOENT && reldir.empty()) {
+					continue;//no links for this rating yet
+				}
 				ratesync::config::error("Couldn't open directory %s",
 										dir.c_str());
 				return false;
@@ -67,54 +82,127 @@ namespace {
 			struct dirent* ep;
 			while (ep = readdir(dp)) {
 				//"This is the only field you can count on in all POSIX systems":
-				ratesync::song_t filepath = dir+ep->d_name;
+				const char* name = ep->d_name;
+				if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+					continue;
+				}
+				std::string filepath = dir+name;
 				ratesync::config::debug(filepath.c_str());
 
 				struct stat sb;
-				if (stat(filepath.c_str(), &sb) != 0) {
+				if (lstat(filepath.c_str(), &sb) != 0) {
 					ratesync::config::error("Unable to stat file %s.",
 											filepath.c_str());
 					closedir(dp);
 					return false;
 				}
 				if (S_ISDIR(sb.st_mode)) {
-					dirqueue.push(filepath+SEP);
+					reldirqueue.push(reldir+name+SEP);
 				} else if (S_ISLNK(sb.st_mode)) {
-					ssize_t len = readlink(filepath.c_str(), symdest_c, sizeof(symdest_c));
+					ssize_t len = readlink(filepath.c_str(), symdest_c, sizeof(symdest_c)-1);
 					if (len < 0) {
 						ratesync::config::error("Unable to read symlink %s.",
 												filepath.c_str());
+						closedir(dp);
 						return false;
 					}
+					symdest_c[len] = 0;
+
+					std::string symdest(symdest_c);
+					if (symdest.empty() || symdest[0] != SEP) {
+						//relative to the directory containing the link
+						symdest = links.Dir() + relsubdir + reldir + symdest;
+					}
 
 					struct stat lsb;
-					if (lstat(symdest_c, &lsb) != 0) {//TODO assuming != 0 when dangling
-						if (unlink(filepath.c_str()) == 0) {
-							continue;
-						} else {
-							ratesync::config::error("Unable to delete dangling symlink %s -> %s.",
-													filepath.c_str(), symdest_c);
-							return false;
-						}
+					if (prune && lstat(symdest.c_str(), &lsb) != 0 &&
+						(errno == ENOENT || errno == ENOTDIR)) {
+						ratesync::config::debug("Dangling symlink %s -> %s",
+												filepath.c_str(), symdest_c);
+						dangling.push_back(filepath);
+						continue;
 					}
 
-					std::string symdest(symdest_c);
-					std::map<ratesync::song_t, ratesync::rating_t>::iterator
-						iter = out_rating.find(symdest);
-					if (iter != out_rating.end()) {
-						ratesync::config::error("Duplicate symlink to same file: %s -> %s",
+					ratesync::song_t song;
+					if (!root.Key(symdest, song)) {
+						ratesync::config::error("Symlink points outside of music dir: %s -> %s",
 												filepath.c_str(), symdest_c);
 						continue;
 					}
-					out_rating.insert(std::make_pair(symdest, rating));
+					if (!out.Put(song, rating)) {
+						ratesync::config::error("Duplicate symlink to same file: %s -> %s",
+												filepath.c_str(), symdest_c);
+					}
 				}
 			}
 			closedir(dp);
 		}
+		return true;
+	}
+
+	//Opens 'reldir' below the directory 'base', creating it if needed.
+	int open_dir_at(int base, const std::string& reldir, bool create) {
+		int cur = openat(base, ".", O_RDONLY | O_DIRECTORY);
+		size_t start = 0;
+		while (cur >= 0 && start < reldir.size()) {
+			size_t end = reldir.find(SEP, start);
+			if (end == std::string::npos) {
+				end = reldir.size();
+			}
+			std::string name = reldir.substr(start, end - start);
+			start = end + 1;
+			if (name.empty()) {
+				continue;
+			}
+
+			int next = openat(cur, name.c_str(), O_RDONLY | O_DIRECTORY);
+			if (next < 0 && errno == ENOENT && create &&
+				(mkdirat(cur, name.c_str(), 0777) == 0 || errno == EEXIST)) {
+				next = openat(cur, name.c_str(), O_RDONLY | O_DIRECTORY);
+			}
+			close(cur);
+			cur = next;
+		}
+		return cur;
+	}
+
+	//Directory fds opened for a shard, -1 where the directory didn't exist.
+	typedef std::map<std::string, int> shard_dirs_t;
+
+	int shard_dir(shard_dirs_t& dirs, int base, const std::string& reldir, bool create) {
+		shard_dirs_t::iterator iter = dirs.find(reldir);
+		if (iter != dirs.end() && (iter->second >= 0 || !create)) {
+			return iter->second;
+		}
+		int fd = open_dir_at(base, reldir, create);
+		dirs[reldir] = fd;
+		return fd;
+	}
+}
+
+std::string ratesync::sink::rating_subdir(rating_t rating) {
+	std::ostringstream oss;
+	if (rating == UNRATED) {
+		oss << "unrated" << SEP;
+	} else {
+		oss << rating << SEP;
+	}
+	return oss.str();
+}
+
+ratesync::sink::Symlink::Symlink(const std::string& music_dir, const std::string& symlink_dir)
+	: symlink_dir(symlink_dir), root(music_dir), links(symlink_dir), symlink_dir_fd(-1) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ratesync::sink::Symlink::~Symlink() {
+	if (symlink_dir_fd >= 0) {
+		close(symlink_dir_fd);
 	}
+	pthread_mutex_destroy(&mutex);
 }
 
-bool ratesync::sink::Symlink::Get(std::map<song_t,rating_t>& out_rating) {
+bool ratesync::sink::Symlink::Get(ISongOutput& out) {
 	struct stat sb;
 	if (stat(symlink_dir.c_str(), &sb) != 0) {//TODO assuming != 0 when doesnt exist
 		if (mkdir(symlink_dir.c_str(), 0777) == 0) {
@@ -127,30 +215,108 @@ bool ratesync::sink::Symlink::Get(std::map<song_t,rating_t>& out_rating) {
 		}
 	}
 
-	if (!scan_rating_subdir(symlink_dir+"unrated"+SEP, UNRATED, out_rating) ||
-		!scan_rating_subdir(symlink_dir+"1"+SEP, 1, out_rating) ||
-		!scan_rating_subdir(symlink_dir+"2"+SEP, 2, out_rating) ||
-		!scan_rating_subdir(symlink_dir+"3"+SEP, 3, out_rating) ||
-		!scan_rating_subdir(symlink_dir+"4"+SEP, 4, out_rating) ||
-		!scan_rating_subdir(symlink_dir+"5"+SEP, 5, out_rating)) {
-		return false;
+	//dangling links are only listed for Commit to delete, and not even that
+	//if the whole music dir is missing (eg unmounted)
+	dangling.clear();
+	const bool prune = (stat(root.Dir().c_str(), &sb) == 0);
+	if (!prune) {
+		config::error("Music dir %s not found, keeping dangling symlinks",
+					  root.Dir().c_str());
+	}
+	static const rating_t ratings[] = { UNRATED, 1, 2, 3, 4, 5 };
+	for (size_t i = 0; i < sizeof(ratings)/sizeof(ratings[0]); ++i) {
+		std::string relsubdir = rating_subdir(ratings[i]);
+		if (!scan_rating_subdir(root, links, symlink_dir+relsubdir, relsubdir,
+								ratings[i], prune, dangling, out)) {
+			return false;
+		}
 	}
 
 	return true;
 }
 
+bool ratesync::sink::Symlink::Commit() {
+	size_t deleted = 0;
+	bool ok = true;
+	for (std::vector<std::string>::const_iterator
+			 it = dangling.begin(); it != dangling.end(); ++it) {
+		//unless it was pointed somewhere valid since
+		struct stat sb;
+		if (stat(it->c_str(), &sb) == 0) {
+			continue;
+		}
+		if (unlink(it->c_str()) == 0) {
+			++deleted;
+		} else if (errno != ENOENT) {
+			config::error("Unable to delete dangling symlink %s.", it->c_str());
+			ok = false;
+		}
+	}
+	if (deleted > 0) {
+		config::log("Deleted %d symlinks to songs which are gone from the music dir", deleted);
+	}
+	dangling.clear();
+	return ok;
+}
+
 bool ratesync::sink::Symlink::Set(const song_ratings_t& song) {
-	symlink_t oldpath = link_path(song.path, song.rating_old);
-	if (check_symlink(oldpath, false) && unlink(oldpath.c_str()) != 0) {
-		config::error("Unable to delete old symlink: %s", oldpath.c_str());
-		return false;
+	return SetShard(std::vector<song_ratings_t>(1, song)) == 0;
+}
+
+int ratesync::sink::Symlink::dir_fd() {
+	Lock lock(mutex);
+	if (symlink_dir_fd < 0) {
+		symlink_dir_fd = open(symlink_dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (symlink_dir_fd < 0) {
+			config::error("Unable to open symlink dir: %s", symlink_dir.c_str());
+		}
 	}
-	symlink_t newpath = link_path(song.path, song.rating_new);
-	if (symlink(song.path.c_str(), newpath.c_str()) != 0) {
-		config::error("Unable to create symlink: %s", newpath.c_str());
-		return false;
+	return symlink_dir_fd;
+}
+
+size_t ratesync::sink::Symlink::SetShard(const std::vector<song_ratings_t>& songs) {
+	int base = dir_fd();
+	if (base < 0) {
+		return songs.size();
 	}
-	return true;
+
+	//all songs are usually in the same directory, so each <rating>/<songdir>
+	//only gets opened once for the whole shard
+	shard_dirs_t dirs;
+	size_t failed = 0;
+	for (std::vector<song_ratings_t>::const_iterator
+			 it = songs.begin(); it != songs.end(); ++it) {
+		const song_t& song = it->path;
+		size_t sep = song.find_last_of(SEP);
+		std::string reldir = (sep == std::string::npos) ? "" : song.substr(0, sep+1);
+		const char* name = song.c_str() + ((sep == std::string::npos) ? 0 : sep+1);
+
+		int oldfd = shard_dir(dirs, base, rating_subdir(it->rating_old) + reldir, false);
+		if (oldfd >= 0 && unlinkat(oldfd, name, 0) != 0 && errno != ENOENT) {
+			config::error("Unable to delete old symlink: %s",
+						  link_path(song, it->rating_old).c_str());
+			++failed;
+			continue;
+		}
+
+		int newfd = shard_dir(dirs, base, rating_subdir(it->rating_new) + reldir, true);
+		std::string target = root.Path(song);
+		if (newfd < 0 ||
+			(symlinkat(target.c_str(), newfd, name) != 0 &&
+			 (errno != EEXIST || unlinkat(newfd, name, 0) != 0 ||
+			  symlinkat(target.c_str(), newfd, name) != 0))) {
+			config::error("Unable to create symlink: %s",
+						  link_path(song, it->rating_new).c_str());
+			++failed;
+		}
+	}
+
+	for (shard_dirs_t::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+		if (it->second >= 0) {
+			close(it->second);
+		}
+	}
+	return failed;
 }
 
 bool ratesync::sink::Symlink::Clear(const song_rating_t& song) {
@@ -160,13 +326,6 @@ bool ratesync::sink::Symlink::Clear(const song_rating_t& song) {
 
 ratesync::sink::Symlink::symlink_t
 ratesync::sink::Symlink::link_path(const song_t& song, const rating_t rating) {
-	std::ostringstream oss;
-	if (rating == UNRATED) {
-		oss << symlink_dir << "unrated" << SEP;
-	} else {
-		oss << symlink_dir << rating << SEP;
-	}
-	// /dir1/music_dir/dir2/file -> dir2/file
-	oss << song.substr(music_dir.length());
-	return oss.str();
+	// dir2/file -> /symlink_dir/<rating>/dir2/file
+	return symlink_dir + rating_subdir(rating) + song;
 }
@@ -19,25 +19,49 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+
 #include "sink.h"
 
 namespace ratesync {
 	namespace sink {
+		//The subdir of the symlink dir for songs with 'rating' ("unrated/",
+		//"1/" to "5/").
+		std::string rating_subdir(rating_t rating);
+
 		class Symlink : public ISink {
 		public:
-		Symlink(const std::string& music_dir, const std::string& symlink_dir)
-			: music_dir(music_dir), symlink_dir(symlink_dir) { }
-			virtual ~Symlink() { }
+			Symlink(const std::string& music_dir, const std::string& symlink_dir);
+			virtual ~Symlink();
 
-			bool Get(std::map<song_t,rating_t>& out_rating);
+			bool Get(ISongOutput& out);
 			bool Set(const song_ratings_t& song);
 			bool Clear(const song_rating_t& song);
+			void SetPaths(const SongPaths* paths) { root.SetPaths(paths); }
+
+			size_t SetShard(const std::vector<song_ratings_t>& songs);
+			bool ThreadSafe() const { return true; }
+
+			//Links whose song is gone are only deleted by Commit.
+			size_t Stale() const { return dangling.size(); }
+			bool Commit();
 
 		private:
+			Symlink(const Symlink& sink);//disallow copy
+
+			//fd of symlink_dir, opened on first use
+			int dir_fd();
+
 			typedef std::string symlink_t;
 			symlink_t link_path(const song_t& song, const rating_t rating);
 
-			const std::string music_dir, symlink_dir;
+			const std::string symlink_dir;
+			SongRoot root;
+			const SongRoot links;
+			int symlink_dir_fd;
+			pthread_mutex_t mutex;
+			//links found dangling by Get, see Stale
+			std::vector<std::string> dangling;
 		};
 	}
 }
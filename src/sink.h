@@ -19,15 +19,155 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <map>
+#include <vector>
 #include "song.h"
 
 namespace ratesync {
+	//Receives the songs listed by ISink::Get, in no particular order.
+	class ISongOutput {
+	public:
+		virtual ~ISongOutput() { }
+		//Returns false if the song couldn't be stored, or was already stored.
+		virtual bool Put(const song_t& song, rating_t rating) = 0;
+	};
+
+	//Collects songs into a map.
+	class MapOutput : public ISongOutput {
+	public:
+		MapOutput(std::map<song_t,rating_t>& out_rating) : out_rating(out_rating) { }
+		bool Put(const song_t& song, rating_t rating) {
+			return out_rating.insert(std::make_pair(song, rating)).second;
+		}
+	private:
+		std::map<song_t,rating_t>& out_rating;
+	};
+
+	//Order-independent summary of a list of songs and their ratings, to
+	//tell whether a sink changed in the meantime.
+	struct fingerprint_t {
+		fingerprint_t() : digest(0), count(0) { }
+		bool operator==(const fingerprint_t& o) const {
+			return digest == o.digest && count == o.count;
+		}
+		uint64_t digest, count;
+	};
+
+	//Fingerprints the songs that pass through to 'next' (if any).
+	class FingerprintOutput : public ISongOutput {
+	public:
+		FingerprintOutput(ISongOutput* next = NULL) : next(next) { }
+		bool Put(const song_t& song, rating_t rating) {
+			if (next != NULL && !next->Put(song, rating)) {
+				return false;
+			}
+			//summing keeps it independent of the order songs are listed in
+			const unsigned char r = (unsigned char)(rating + 2);
+			fp.digest += hash_bytes(&r, 1, hash_key(song));
+			++fp.count;
+			return true;
+		}
+		const fingerprint_t& Fingerprint() const { return fp; }
+	private:
+		ISongOutput* next;
+		fingerprint_t fp;
+	};
+
+	//Passes on only the songs listed in 'songs' (sorted) to 'next'.
+	class FilterOutput : public ISongOutput {
+	public:
+		FilterOutput(const std::vector<song_t>& songs, ISongOutput& next)
+			: songs(songs), next(next) { }
+		bool Put(const song_t& song, rating_t rating) {
+			if (!std::binary_search(songs.begin(), songs.end(), song)) {
+				return true;
+			}
+			return next.Put(song, rating);
+		}
+	private:
+		const std::vector<song_t>& songs;
+		ISongOutput& next;
+	};
+
+	//Passes on only the songs directly in 'dir' (a key prefix ending in
+	//SEP, or "" for the root), not in its subdirectories.
+	class DirOutput : public ISongOutput {
+	public:
+		DirOutput(const std::string& dir, ISongOutput& next)
+			: dir(dir), next(next) { }
+		bool Put(const song_t& song, rating_t rating) {
+			if (song.find(SEP, dir.size()) != std::string::npos) {
+				return true;
+			}
+			return next.Put(song, rating);
+		}
+	private:
+		const std::string& dir;
+		ISongOutput& next;
+	};
+
 	class ISink {
 	public:
-		virtual bool Get(std::map<song_t,rating_t>& out_rating) = 0;
+		virtual ~ISink() { }
+		virtual bool Get(ISongOutput& out) = 0;
 		virtual bool Set(const song_ratings_t& song) = 0;
 		virtual bool Clear(const song_rating_t& song) = 0;
+
+		//Lists the songs without needing their ratings, for sinks where
+		//that's cheaper than Get(). The ratings passed to 'out' may be anything.
+		virtual bool List(ISongOutput& out) { return Get(out); }
+
+		//Outputs the ratings of just 'songs' (sorted), for those in the sink.
+		//Sinks that can look songs up individually avoid a full Get().
+		virtual bool GetSongs(const std::vector<song_t>& songs, ISongOutput& out) {
+			FilterOutput filter(songs, out);
+			return Get(filter);
+		}
+
+		//Applies a group of changes to songs in the same directory, returning
+		//how many failed. Sinks may reuse per-directory state across the group.
+		virtual size_t SetShard(const std::vector<song_ratings_t>& songs) {
+			size_t failed = 0;
+			for (std::vector<song_ratings_t>::const_iterator
+					 it = songs.begin(); it != songs.end(); ++it) {
+				if (!Set(*it)) {
+					++failed;
+				}
+			}
+			return failed;
+		}
+
+		//Whether SetShard may be called from several threads at once, for
+		//different directories.
+		virtual bool ThreadSafe() const { return false; }
+
+		//Whether a song that's only in the source, rated 'rating', gets added
+		//to this sink as a change with a rating_old of ABSENT. Otherwise
+		//it's skipped.
+		virtual bool AddsSong(rating_t /*rating*/) const { return false; }
+
+		//Whether Set/Clear can store ratings here, so that a two-way sync
+		//can copy changes back to it when it's the source.
+		virtual bool Writable() const { return true; }
+
+		//The on-disk paths of songs whose keys differ from them, for sources
+		//that read the music dir (NULL: keys are paths).
+		virtual const SongPaths* Paths() const { return NULL; }
+		//Tells a sink that accesses the music dir where the source's songs
+		//are, see SongPaths.
+		virtual void SetPaths(const SongPaths* /*paths*/) { }
+
+		//How many songs the last Get() found here whose files are gone from
+		//the music dir. Get() leaves them be, Commit() removes them.
+		virtual size_t Stale() const { return 0; }
+
+		//Called once all changes are applied, for sinks that write their
+		//changes out all at once.
+		virtual bool Commit() { return true; }
+		//Called on a source once what its last Get() returned was synced to
+		//the destination (or saved to be applied later).
+		virtual bool Synced() { return true; }
 	};
 }
 
@@ -0,0 +1,157 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "song-index.h"
+#include "config.h"
+
+#include <algorithm>
+#include <string.h>
+
+struct ratesync::SongIndex::entry_less {
+	entry_less(const std::string& keys) : keys(keys) { }
+	bool operator()(const entry_t& a, const entry_t& b) const {
+		return compare(keys.data() + a.offset, a.size,
+					   keys.data() + b.offset, b.size) < 0;
+	}
+	//for lower_bound against a plain string
+	bool operator()(const entry_t& a, const std::string& b) const {
+		return compare(keys.data() + a.offset, a.size, b.data(), b.size()) < 0;
+	}
+	static int compare(const char* a, size_t a_size, const char* b, size_t b_size) {
+		int cmp = memcmp(a, b, (a_size < b_size) ? a_size : b_size);
+		if (cmp != 0) {
+			return cmp;
+		}
+		return (a_size < b_size) ? -1 : ((a_size > b_size) ? 1 : 0);
+	}
+	const std::string& keys;
+};
+
+bool ratesync::SongIndex::Put(const song_t& song, rating_t rating) {
+	if (song.size() > 0xffff || keys.size() + song.size() > 0xffffffffULL) {
+		config::error("Song %s doesn't fit in the index", song.c_str());
+		return false;
+	}
+	entry_t entry;
+	entry.offset = keys.size();
+	entry.size = song.size();
+	entry.rating = rating;
+	if (sorted && !entries.empty() && !entry_less(keys)(entries.back(), song)) {
+		sorted = false;
+	}
+	keys += song;
+	entries.push_back(entry);
+	return true;
+}
+
+void ratesync::SongIndex::Finish() {
+	entry_less less(keys);
+	if (!sorted) {
+		std::sort(entries.begin(), entries.end(), less);
+		sorted = true;
+	}
+	//drop duplicates (the keys stay in the buffer, they're rare)
+	std::vector<entry_t>::iterator out = entries.begin();
+	for (std::vector<entry_t>::const_iterator
+			 it = entries.begin(); it != entries.end(); ++it) {
+		if (out != entries.begin() && !less(*(out - 1), *it)) {
+			config::error("Duplicate entries for song %s", key(*it).c_str());
+			continue;
+		}
+		*out++ = *it;
+	}
+	entries.erase(out, entries.end());
+	//trim the excess from growing
+	std::vector<entry_t>(entries).swap(entries);
+	std::string(keys).swap(keys);
+}
+
+std::vector<ratesync::SongIndex::entry_t>::const_iterator
+ratesync::SongIndex::lower_bound(const std::string& song) const {
+	return std::lower_bound(entries.begin(), entries.end(), song, entry_less(keys));
+}
+
+bool ratesync::SongIndex::Find(const song_t& song, rating_t& out) const {
+	std::vector<entry_t>::const_iterator it = lower_bound(song);
+	if (it == entries.end() || it->size != song.size() ||
+		memcmp(keys.data() + it->offset, song.data(), song.size()) != 0) {
+		return false;
+	}
+	out = it->rating;
+	return true;
+}
+
+void ratesync::SongIndex::Range(const std::string& prefix, rating_t min, rating_t max,
+								ISongOutput& out, const std::string& after) const {
+	std::vector<entry_t>::const_iterator it;
+	if (after.compare(prefix) < 0) {
+		it = lower_bound(prefix);
+	} else {
+		it = lower_bound(after);
+		if (it != entries.end() && after.compare(0, std::string::npos,
+												 keys.data() + it->offset, it->size) == 0) {
+			++it;
+		}
+	}
+	for (; it != entries.end() && it->size >= prefix.size() &&
+			 memcmp(keys.data() + it->offset, prefix.data(), prefix.size()) == 0; ++it) {
+		if (it->rating >= min && it->rating <= max && !out.Put(key(*it), it->rating)) {
+			return;
+		}
+	}
+}
+
+void ratesync::SongIndex::Diff(const SongIndex& old,
+							   std::vector<song_ratings_t>& changes) const {
+	std::vector<entry_t>::const_iterator
+		it = entries.begin(), old_it = old.entries.begin();
+	song_ratings_t change;
+	while (it != entries.end() || old_it != old.entries.end()) {
+		int cmp;
+		if (it == entries.end()) {
+			cmp = 1;
+		} else if (old_it == old.entries.end()) {
+			cmp = -1;
+		} else {
+			cmp = entry_less::compare(keys.data() + it->offset, it->size,
+									  old.keys.data() + old_it->offset, old_it->size);
+		}
+		if (cmp < 0) {
+			change.path = key(*it);
+			change.rating_old = ABSENT;
+			change.rating_new = it->rating;
+			changes.push_back(change);
+			++it;
+		} else if (cmp > 0) {
+			change.path = old.key(*old_it);
+			change.rating_old = old_it->rating;
+			change.rating_new = ABSENT;
+			changes.push_back(change);
+			++old_it;
+		} else {
+			if (it->rating != old_it->rating) {
+				change.path = key(*it);
+				change.rating_old = old_it->rating;
+				change.rating_new = it->rating;
+				changes.push_back(change);
+			}
+			++it;
+			++old_it;
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef RATESYNC_SONG_INDEX_H
+#define RATESYNC_SONG_INDEX_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <vector>
+
+#include "sink.h"
+
+namespace ratesync {
+	//A compact, read-only song -> rating table, sorted by key. Keys are
+	//packed into a single buffer, so each song costs its key plus 8 bytes.
+	class SongIndex : public ISongOutput {
+	public:
+		SongIndex() : sorted(true) { }
+
+		//Adds a song, call Finish() once all songs are in.
+		bool Put(const song_t& song, rating_t rating);
+		//Sorts the songs, dropping (and logging) duplicates.
+		void Finish();
+
+		size_t Size() const { return entries.size(); }
+
+		bool Find(const song_t& song, rating_t& out) const;
+		//Lists the songs whose key starts with 'prefix' and which are rated
+		//'min' to 'max', in key order, starting after the key 'after' (if
+		//any). Stops early if 'out' returns false.
+		void Range(const std::string& prefix, rating_t min, rating_t max,
+				   ISongOutput& out, const std::string& after = std::string()) const;
+		//Lists the songs that differ from 'old', in key order. Added songs
+		//have a rating_old of ABSENT, removed ones a rating_new of ABSENT.
+		void Diff(const SongIndex& old, std::vector<song_ratings_t>& changes) const;
+
+	private:
+		struct entry_t {
+			uint32_t offset;
+			uint16_t size;
+			signed char rating;
+		};
+		struct entry_less;
+
+		song_t key(const entry_t& entry) const {
+			return keys.substr(entry.offset, entry.size);
+		}
+		//the first entry whose key is >= 'song'
+		std::vector<entry_t>::const_iterator lower_bound(const std::string& song) const;
+
+		std::string keys;
+		std::vector<entry_t> entries;
+		bool sorted;
+	};
+}
+
+#endif
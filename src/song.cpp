@@ -0,0 +1,199 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "song.h"
+#include "config.h" //must come early, defines USE_ICU
+#include "threadpool.h"
+
+#include <unistd.h>
+#include <limits.h>
+
+#ifdef USE_ICU
+#include <unicode/normalizer2.h>
+#include <unicode/unistr.h>
+#endif
+
+namespace {
+	//Whether 'key' is already free of empty/"."/".." components.
+	bool is_clean(const std::string& key) {
+		const size_t len = key.size();
+		size_t start = 0;
+		for (size_t i = 0; i <= len; ++i) {
+			if (i == len || key[i] == SEP) {
+				const size_t n = i - start;
+				if (n == 0 ||
+						(n == 1 && key[start] == '.') ||
+						(n == 2 && key[start] == '.' && key[start+1] == '.')) {
+					return false;
+				}
+				start = i + 1;
+			}
+		}
+		return true;
+	}
+
+	//Appends the components of 'in' to 'out', resolving "." and "..".
+	bool append_components(const std::string& in, std::string& out) {
+		const size_t len = in.size();
+		size_t i = 0;
+		while (i < len) {
+			while (i < len && in[i] == SEP) {
+				++i;
+			}
+			const size_t start = i;
+			while (i < len && in[i] != SEP) {
+				++i;
+			}
+			const size_t n = i - start;
+			if (n == 0 || (n == 1 && in[start] == '.')) {
+				continue;
+			}
+			if (n == 2 && in[start] == '.' && in[start+1] == '.') {
+				if (out.empty()) {
+					return false;
+				}
+				size_t pos = out.find_last_of(SEP);
+				out.erase((pos == std::string::npos) ? 0 : pos);
+				continue;
+			}
+			if (!out.empty()) {
+				out += SEP;
+			}
+			out.append(in, start, n);
+		}
+		return true;
+	}
+
+#ifdef USE_ICU
+	void nfc(std::string& key) {
+		size_t i = 0;
+		while (i < key.size() && (unsigned char)key[i] < 0x80) {
+			++i;
+		}
+		if (i == key.size()) {
+			return;//plain ascii, always NFC
+		}
+
+		UErrorCode status = U_ZERO_ERROR;
+		const icu::Normalizer2* normalizer = icu::Normalizer2::getNFCInstance(status);
+		if (U_FAILURE(status)) {
+			return;
+		}
+		icu::UnicodeString ustr = icu::UnicodeString::fromUTF8(key);
+		if (normalizer->isNormalized(ustr, status) || U_FAILURE(status)) {
+			return;
+		}
+		icu::UnicodeString normalized = normalizer->normalize(ustr, status);
+		if (U_SUCCESS(status)) {
+			key.clear();
+			normalized.toUTF8String(key);
+		}
+	}
+#endif
+}
+
+bool ratesync::normalize_key(song_t& key) {
+	if (!is_clean(key)) {
+		std::string clean;
+		if (!append_components(key, clean)) {
+			return false;
+		}
+		key.swap(clean);
+	}
+#ifdef USE_ICU
+	if (config::nfc_enabled) {
+		nfc(key);
+	}
+#endif
+	return true;
+}
+
+ratesync::SongPaths::SongPaths() {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ratesync::SongPaths::~SongPaths() {
+	pthread_mutex_destroy(&mutex);
+}
+
+void ratesync::SongPaths::Add(const song_t& key, const std::string& relpath) {
+	if (key == relpath) {
+		return;
+	}
+	Lock lock(mutex);
+	paths[key] = relpath;
+}
+
+bool ratesync::SongPaths::Find(const song_t& key, std::string& relpath) const {
+	Lock lock(mutex);
+	std::map<song_t, std::string>::const_iterator it = paths.find(key);
+	if (it == paths.end()) {
+		return false;
+	}
+	relpath = it->second;
+	return true;
+}
+
+std::string ratesync::SongPaths::Path(const song_t& key) const {
+	std::string relpath;
+	return Find(key, relpath) ? relpath : key;
+}
+
+ratesync::SongRoot::SongRoot(const std::string& root)
+	: paths(NULL) {
+	std::string abs;
+	if (root.empty() || root[0] != SEP) {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof(cwd)) != NULL) {
+			append_components(cwd, abs);
+		}
+	}
+	append_components(root, abs);
+	abs_root = SEP + abs;
+	if (abs_root.size() > 1) {
+		abs_root += SEP;
+	}
+}
+
+bool ratesync::SongRoot::Key(const std::string& path, song_t& out) const {
+	if (path.empty() || path[0] != SEP) {
+		out = path;
+		return normalize_key(out);
+	}
+
+	//absolute: must be under the root
+	if (path.compare(0, abs_root.size(), abs_root) == 0) {
+		out.assign(path, abs_root.size(), std::string::npos);
+		return normalize_key(out);
+	}
+	std::string abs;
+	if (!append_components(path, abs)) {
+		return false;
+	}
+	abs.insert(abs.begin(), SEP);
+	abs += SEP;//allow matching the root itself
+	if (abs.compare(0, abs_root.size(), abs_root) != 0) {
+		return false;
+	}
+	out.assign(abs, abs_root.size(), abs.size() - abs_root.size() - 1);
+	return normalize_key(out);
+}
+
+std::string ratesync::SongRoot::Path(const song_t& key) const {
+	return abs_root + ((paths != NULL) ? paths->Path(key) : key);
+}
@@ -1,7 +1,11 @@
 #ifndef RATESYNC_SONG_H
 #define RATESYNC_SONG_H
 
+#include <map>
 #include <string>
+#include <stdint.h>
+
+#include <pthread.h>
 
 #ifdef _WIN32
 #define SEP '\\'
@@ -10,9 +14,12 @@
 #endif
 
 #define UNRATED -1
+//for changes to a song that's missing on one side
+#define ABSENT -2
 
 namespace ratesync {
 	typedef int rating_t;
+	//canonical song key: relative to the music dir, see SongRoot
 	typedef std::string song_t;
 
 	typedef struct {
@@ -25,6 +32,71 @@ namespace ratesync {
 		rating_t rating_old;
 		rating_t rating_new;
 	} song_ratings_t;
+
+	//The on-disk paths (relative to the music dir) of songs whose keys
+	//differ from them, ie files whose names were NFC-normalized. Sinks
+	//that access the music dir look paths up here rather than using keys
+	//as paths. Filled in by the File source as it finds songs.
+	class SongPaths {
+	public:
+		SongPaths();
+		~SongPaths();
+
+		//Remembers 'relpath' for 'key', unless they're the same.
+		void Add(const song_t& key, const std::string& relpath);
+		//Returns false if 'key' is its own path.
+		bool Find(const song_t& key, std::string& relpath) const;
+		//The relative path for 'key': the one added for it, or 'key' itself.
+		std::string Path(const song_t& key) const;
+
+	private:
+		SongPaths(const SongPaths&);//disallow copy
+		mutable pthread_mutex_t mutex;
+		std::map<song_t, std::string> paths;
+	};
+
+	//Converts file paths into canonical song keys and back, so that all
+	//sinks agree on how a given song is named regardless of where they
+	//got its path from. Keys are relative to the root ("dir/file.mp3"),
+	//contain no empty, "." or ".." components, and are optionally
+	//Unicode NFC-normalized (see config::nfc_enabled).
+	class SongRoot {
+	public:
+		SongRoot(const std::string& root);
+
+		//Produces the key for 'path', which may either be absolute or
+		//relative to the root. Returns false if 'path' lies outside the root.
+		bool Key(const std::string& path, song_t& out) const;
+
+		//Produces the absolute path for 'key', looking it up in the paths
+		//given to SetPaths (if any).
+		std::string Path(const song_t& key) const;
+		void SetPaths(const SongPaths* song_paths) { paths = song_paths; }
+
+		//The absolute root, with a trailing SEP.
+		const std::string& Dir() const { return abs_root; }
+
+	private:
+		std::string abs_root;
+		const SongPaths* paths;
+	};
+
+	//Lexically normalizes a relative path in-place, as done by SongRoot::Key.
+	//Returns false if a ".." component would escape the path.
+	bool normalize_key(song_t& key);
+
+	//64-bit FNV-1a, for hashing keys into shards and digests.
+	static const uint64_t HASH_INIT = 14695981039346656037ULL;
+	inline uint64_t hash_bytes(const void* data, size_t len, uint64_t hash = HASH_INIT) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < len; ++i) {
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		}
+		return hash;
+	}
+	inline uint64_t hash_key(const song_t& key) {
+		return hash_bytes(key.data(), key.size());
+	}
 }
 
 #endif
@@ -0,0 +1,116 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tag-rating.h"
+#include "rating-scheme.h"
+
+#include <taglib/taglib.h>
+#include <taglib/id3v2tag.h>
+#include <taglib/popularimeterframe.h>
+#include <taglib/xiphcomment.h>
+#include <taglib/mp4tag.h>
+#include <taglib/apetag.h>
+
+#include <taglib/tmap.h>
+#include <taglib/tlist.h>
+
+namespace {
+	//ID3v2 frame id, kept around to avoid building it for every lookup
+	const TagLib::ByteVector POPM_ID("POPM", 4);
+}
+
+bool ratesync::decode::xiph_rating(const TagLib::Ogg::XiphComment* xiphcomment,
+								   rating_t& out) {
+	size_t priority = active_schemes.size();
+	const TagLib::Ogg::FieldListMap& map = xiphcomment->fieldListMap();
+	for (TagLib::Ogg::FieldListMap::ConstIterator
+			 it = map.begin(); it != map.end() && priority > 0; ++it) {
+		const TagLib::StringList& vals = (*it).second;
+		for (TagLib::StringList::ConstIterator
+				 val = vals.begin(); val != vals.end(); ++val) {
+			if (field_rating(SCHEME_XIPH, (*it).first, *val, out, priority)) {
+				break;
+			}
+		}
+	}
+	return priority < active_schemes.size();
+}
+
+bool ratesync::decode::id3v2_rating(const TagLib::ID3v2::Tag* id3v2tag,
+									rating_t& out) {
+	size_t priority = active_schemes.size();
+	const TagLib::ID3v2::FrameListMap& map = id3v2tag->frameListMap();
+	TagLib::ID3v2::FrameListMap::ConstIterator popm = map.find(POPM_ID);
+	if (popm != map.end()) {
+		const TagLib::ID3v2::FrameList& vallist = (*popm).second;
+		for (TagLib::ID3v2::FrameList::ConstIterator
+				 frame = vallist.begin(); frame != vallist.end() && priority > 0; ++frame) {
+			const TagLib::ID3v2::PopularimeterFrame* popmframe =
+				static_cast<const TagLib::ID3v2::PopularimeterFrame*>(*frame);
+			popm_rating(popmframe->email(), popmframe->rating(), out, priority);
+		}
+	}
+	return priority < active_schemes.size();
+}
+
+bool ratesync::decode::ape_rating(const TagLib::APE::Tag* apetag,
+								  rating_t& out) {
+	size_t priority = active_schemes.size();
+	const TagLib::APE::ItemListMap& map = apetag->itemListMap();
+	for (TagLib::APE::ItemListMap::ConstIterator
+			 it = map.begin(); it != map.end() && priority > 0; ++it) {
+		if (!field_key(SCHEME_APE, (*it).first, priority)) {
+			continue;
+		}
+		const TagLib::StringList vals = (*it).second.values();//shallow copy
+		for (TagLib::StringList::ConstIterator
+				 val = vals.begin(); val != vals.end(); ++val) {
+			if (field_rating(SCHEME_APE, (*it).first, *val, out, priority)) {
+				break;
+			}
+		}
+	}
+	return priority < active_schemes.size();
+}
+
+bool ratesync::decode::mp4_rating(TagLib::MP4::Tag* mp4tag,
+								  rating_t& out) {
+	size_t priority = active_schemes.size();
+	const TagLib::MP4::ItemListMap& map = mp4tag->itemListMap();
+	for (TagLib::MP4::ItemListMap::ConstIterator
+			 it = map.begin(); it != map.end() && priority > 0; ++it) {
+		if (!field_key(SCHEME_MP4, (*it).first, priority)) {
+			continue;//eg cover art, which isn't worth converting
+		}
+		const TagLib::StringList vals = (*it).second.toStringList();//shallow copy
+		if (vals.isEmpty()) {
+			//integer atom
+			char buf[12];
+			field_rating(SCHEME_MP4, (*it).first,
+						 CStr(format_int((*it).second.toInt(), buf)), out, priority);
+			continue;
+		}
+		for (TagLib::StringList::ConstIterator
+				 val = vals.begin(); val != vals.end(); ++val) {
+			if (field_rating(SCHEME_MP4, (*it).first, *val, out, priority)) {
+				break;
+			}
+		}
+	}
+	return priority < active_schemes.size();
+}
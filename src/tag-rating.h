@@ -0,0 +1,46 @@
+#ifndef RATESYNC_TAG_RATING_H
+#define RATESYNC_TAG_RATING_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "song.h"
+
+namespace TagLib {
+	namespace Ogg { class XiphComment; }
+	namespace ID3v2 { class Tag; }
+	namespace APE { class Tag; }
+	namespace MP4 { class Tag; }
+}
+
+//Finds the rating in each kind of tag TagLib reads, using the active
+//rating schemes (see rating-scheme.h). These run once per song and
+//don't allocate: fields are looked at in place, and values are only
+//converted for the keys a scheme reads.
+
+namespace ratesync {
+	namespace decode {
+		//Each returns whether a rating was found, in 'out'.
+		bool xiph_rating(const TagLib::Ogg::XiphComment* xiphcomment, rating_t& out);
+		bool id3v2_rating(const TagLib::ID3v2::Tag* id3v2tag, rating_t& out);
+		bool ape_rating(const TagLib::APE::Tag* apetag, rating_t& out);
+		bool mp4_rating(TagLib::MP4::Tag* mp4tag, rating_t& out);
+	}
+}
+
+#endif
@@ -0,0 +1,246 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tagworker.h"
+#include "threadpool.h"
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace {
+	//request: type, then the path (for messages), with the fd attached.
+	//SOCK_SEQPACKET keeps each request/reply in one message.
+	const size_t MAX_REQUEST = sizeof(int32_t) + 8192;
+
+	struct reply_t {
+		int32_t ok;
+		int32_t rating;
+		uint64_t bytes_read;
+	};
+
+	bool send_fd(int sock, int fd, const std::string& payload) {
+		struct iovec iov;
+		iov.iov_base = const_cast<char*>(payload.data());
+		iov.iov_len = payload.size();
+		char control[CMSG_SPACE(sizeof(int))];
+		memset(control, 0, sizeof(control));
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		ssize_t n;
+		while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) { }
+		return n == (ssize_t)payload.size();
+	}
+}
+
+ratesync::TagWorkerPool::TagWorkerPool(const std::vector<std::string>& command,
+									   unsigned timeout_ms)
+	: command(command), timeout_ms(timeout_ms), started(0) {
+	pthread_mutex_init(&mutex, NULL);
+}
+
+ratesync::TagWorkerPool::~TagWorkerPool() {
+	for (std::vector<TagWorker*>::iterator it = idle.begin(); it != idle.end(); ++it) {
+		delete *it;
+	}
+	config::debug("Used %d tag workers", started);
+	pthread_mutex_destroy(&mutex);
+}
+
+ratesync::TagWorker* ratesync::TagWorkerPool::Take() {
+	Lock lock(mutex);
+	if (idle.empty()) {
+		++started;
+		return new TagWorker(command, timeout_ms);
+	}
+	TagWorker* worker = idle.back();
+	idle.pop_back();
+	return worker;
+}
+
+void ratesync::TagWorkerPool::Give(TagWorker* worker) {
+	Lock lock(mutex);
+	idle.push_back(worker);
+}
+
+ratesync::TagWorker::TagWorker(const std::vector<std::string>& command, unsigned timeout_ms)
+	: command(command), timeout_ms(timeout_ms), pid(-1), sock(-1) { }
+
+ratesync::TagWorker::~TagWorker() {
+	stop(false);
+}
+
+bool ratesync::TagWorker::start() {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+		config::error("Unable to create tag worker socket: %s", strerror(errno));
+		return false;
+	}
+	std::vector<char*> argv;
+	for (std::vector<std::string>::const_iterator
+			 it = command.begin(); it != command.end(); ++it) {
+		argv.push_back(const_cast<char*>(it->c_str()));
+	}
+	argv.push_back(NULL);
+
+	pid = fork();
+	if (pid == 0) {
+		//child: the socket becomes stdin, everything else is CLOEXEC
+		if (dup2(fds[1], STDIN_FILENO) < 0) {
+			_exit(127);
+		}
+		execv(argv[0], &argv[0]);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid < 0) {
+		config::error("Unable to start tag worker: %s", strerror(errno));
+		close(fds[0]);
+		return false;
+	}
+	sock = fds[0];
+	return true;
+}
+
+void ratesync::TagWorker::stop(bool kill_worker) {
+	if (pid < 0) {
+		return;
+	}
+	if (kill_worker) {
+		kill(pid, SIGKILL);
+	}
+	close(sock);//the worker exits once it sees EOF
+	sock = -1;
+	int status;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+	pid = -1;
+}
+
+ratesync::TagWorker::result_t ratesync::TagWorker::Read(int fd, int type, const std::string& path,
+														rating_t& rating, size_t& bytes_read) {
+	bytes_read = 0;
+	int32_t type32 = type;
+	std::string request(reinterpret_cast<const char*>(&type32), sizeof(type32));
+	request.append(path, 0, MAX_REQUEST - sizeof(type32));
+
+	//a worker that died since the last request shows up here, retry once
+	//with a new one
+	bool sent = false;
+	for (int attempt = 0; attempt < 2 && !sent; ++attempt) {
+		if (pid < 0 && !start()) {
+			return FAILED;
+		}
+		sent = send_fd(sock, fd, request);
+		if (!sent) {
+			stop(true);
+		}
+	}
+	if (!sent) {
+		config::error("Unable to send %s to a tag worker", path.c_str());
+		return FAILED;
+	}
+
+	struct pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	int ready;
+	while ((ready = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) { }
+	if (ready == 0) {
+		config::error("Timed out reading tags of %s after %.1fs, skipping it.",
+					  path.c_str(), timeout_ms / 1000.);
+		stop(true);
+		return TIMEOUT;
+	}
+
+	reply_t reply;
+	ssize_t n;
+	while ((n = recv(sock, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) { }
+	if (n != sizeof(reply)) {
+		int status = 0;
+		close(sock);
+		sock = -1;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+		pid = -1;
+		if (WIFSIGNALED(status)) {
+			config::error("Tag worker crashed (signal %d) reading %s, skipping it.",
+						  WTERMSIG(status), path.c_str());
+		} else {
+			config::error("Tag worker exited (status %d) reading %s, skipping it.",
+						  WEXITSTATUS(status), path.c_str());
+		}
+		return CRASHED;
+	}
+	rating = reply.rating;
+	bytes_read = reply.bytes_read;
+	return reply.ok ? OK : FAILED;
+}
+
+bool ratesync::tagworker::recv_request(int sock, int& fd, int& type, std::string& path) {
+	char buf[MAX_REQUEST];
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) { }
+	if (n < (ssize_t)sizeof(int32_t)) {
+		return false;//parent is done (or gone)
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		config::error("Tag worker request without a file");
+		return false;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	int32_t type32;
+	memcpy(&type32, buf, sizeof(type32));
+	type = type32;
+	path.assign(buf + sizeof(type32), n - sizeof(type32));
+	return true;
+}
+
+bool ratesync::tagworker::send_reply(int sock, bool ok, rating_t rating, size_t bytes_read) {
+	reply_t reply;
+	reply.ok = ok ? 1 : 0;
+	reply.rating = rating;
+	reply.bytes_read = bytes_read;
+	ssize_t n;
+	while ((n = send(sock, &reply, sizeof(reply), MSG_NOSIGNAL)) < 0 && errno == EINTR) { }
+	return n == sizeof(reply);
+}
@@ -0,0 +1,94 @@
+#ifndef RATESYNC_TAGWORKER_H
+#define RATESYNC_TAGWORKER_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "song.h"
+
+//First argument which starts ratesync as a tag worker, see TagWorker.
+#define TAG_WORKER_ARG "--tag-worker"
+
+namespace ratesync {
+	//Reads tags in a child process, so that a file which makes the parser
+	//hang or crash only costs that child: it's killed (or reaped) and
+	//replaced, and the file counts as failed. The parent opens each file
+	//and hands the fd over a socket, so it keeps applying its io::ScanIo
+	//policy.
+	class TagWorker {
+	public:
+		enum result_t { OK, FAILED, TIMEOUT, CRASHED };
+
+		//'command' runs the worker (see tag_worker_main()), which has
+		//'timeout_ms' to answer each request.
+		TagWorker(const std::vector<std::string>& command, unsigned timeout_ms);
+		~TagWorker();
+
+		//Reads the rating of the file open as 'fd', whose 'type' is passed
+		//through to the worker. 'bytes_read' is how much the worker read.
+		result_t Read(int fd, int type, const std::string& path,
+					  rating_t& rating, size_t& bytes_read);
+
+	private:
+		TagWorker(const TagWorker&);//disallow copy
+
+		bool start();
+		void stop(bool kill_worker);
+
+		const std::vector<std::string> command;
+		const unsigned timeout_ms;
+		pid_t pid;
+		int sock;
+	};
+
+	//Lends TagWorkers to the threads reading tags, only starting another
+	//when all of them are in use. Reads are limited by a ConcurrencyLimit,
+	//so there are never more workers than reads allowed at once.
+	class TagWorkerPool {
+	public:
+		TagWorkerPool(const std::vector<std::string>& command, unsigned timeout_ms);
+		~TagWorkerPool();
+
+		TagWorker* Take();
+		void Give(TagWorker* worker);
+
+	private:
+		TagWorkerPool(const TagWorkerPool&);//disallow copy
+
+		const std::vector<std::string> command;
+		const unsigned timeout_ms;
+		pthread_mutex_t mutex;
+		std::vector<TagWorker*> idle;
+		size_t started;
+	};
+
+	namespace tagworker {
+		//Worker side: receives the next request, false once the parent
+		//closes the socket.
+		bool recv_request(int sock, int& fd, int& type, std::string& path);
+		bool send_reply(int sock, bool ok, rating_t rating, size_t bytes_read);
+	}
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "threadpool.h"
+#include "config.h"
+
+ratesync::ThreadPool::ThreadPool(size_t count, size_t max_queued)
+	: max_queued((max_queued == 0) ? ((count == 0) ? 4 : count * 4) : max_queued),
+	  running(0), stopping(false) {
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&task_added, NULL);
+	pthread_cond_init(&task_done, NULL);
+	for (size_t i = 0; i < count; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, thread_main, this) != 0) {
+			config::error("Unable to start thread %d of %d", i+1, count);
+			break;
+		}
+		threads.push_back(thread);
+	}
+}
+
+ratesync::ThreadPool::~ThreadPool() {
+	Wait();
+	{
+		Lock lock(mutex);
+		stopping = true;
+		pthread_cond_broadcast(&task_added);
+	}
+	for (std::vector<pthread_t>::iterator it = threads.begin(); it != threads.end(); ++it) {
+		pthread_join(*it, NULL);
+	}
+	pthread_cond_destroy(&task_done);
+	pthread_cond_destroy(&task_added);
+	pthread_mutex_destroy(&mutex);
+}
+
+void ratesync::ThreadPool::Add(ITask* task) {
+	if (threads.empty()) {
+		//no threads to hand it to, run it here
+		task->Run();
+		delete task;
+		return;
+	}
+	Lock lock(mutex);
+	while (queue.size() >= max_queued) {
+		pthread_cond_wait(&task_done, &mutex);
+	}
+	queue.push_back(task);
+	pthread_cond_signal(&task_added);
+}
+
+void ratesync::ThreadPool::Wait() {
+	Lock lock(mutex);
+	while (!queue.empty() || running > 0) {
+		pthread_cond_wait(&task_done, &mutex);
+	}
+}
+
+void* ratesync::ThreadPool::thread_main(void* pool) {
+	static_cast<ThreadPool*>(pool)->run();
+	return NULL;
+}
+
+void ratesync::ThreadPool::run() {
+	for (;;) {
+		ITask* task;
+		{
+			Lock lock(mutex);
+			while (queue.empty() && !stopping) {
+				pthread_cond_wait(&task_added, &mutex);
+			}
+			if (queue.empty()) {
+				return;//stopping
+			}
+			task = queue.front();
+			queue.pop_front();
+			++running;
+			//a slot opened up for Add()
+			pthread_cond_broadcast(&task_done);
+		}
+
+		task->Run();
+		delete task;
+
+		Lock lock(mutex);
+		--running;
+		pthread_cond_broadcast(&task_done);
+	}
+}
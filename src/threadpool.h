@@ -0,0 +1,72 @@
+#ifndef RATESYNC_THREADPOOL_H
+#define RATESYNC_THREADPOOL_H
+
+/*
+  ratesync - Manages songs according their rating metadata.
+  Copyright (C) 2010  Nicholas Parker
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+namespace ratesync {
+	class ITask {
+	public:
+		virtual ~ITask() { }
+		virtual void Run() = 0;
+	};
+
+	//Runs tasks on a fixed set of threads. Tasks are deleted once run.
+	class ThreadPool {
+	public:
+		//At most 'max_queued' tasks wait for a thread, after which Add()
+		//blocks (0: threads*4).
+		ThreadPool(size_t threads, size_t max_queued = 0);
+		~ThreadPool();//waits for queued tasks
+
+		void Add(ITask* task);
+		//Blocks until every added task has finished.
+		void Wait();
+
+		size_t Threads() const { return threads.size(); }
+
+	private:
+		ThreadPool(const ThreadPool&);//disallow copy
+		static void* thread_main(void* pool);
+		void run();
+
+		const size_t max_queued;
+		std::vector<pthread_t> threads;
+		std::deque<ITask*> queue;
+		size_t running;
+		bool stopping;
+		pthread_mutex_t mutex;
+		pthread_cond_t task_added, task_done;
+	};
+
+	//Scoped pthread mutex lock.
+	class Lock {
+	public:
+		Lock(pthread_mutex_t& mutex) : mutex(mutex) { pthread_mutex_lock(&mutex); }
+		~Lock() { pthread_mutex_unlock(&mutex); }
+	private:
+		pthread_mutex_t& mutex;
+	};
+}
+
+#endif
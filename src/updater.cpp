@@ -17,10 +17,21 @@
 */
 
 #include "updater.h"
+#include "concurrency.h"
+#include "extsort.h"
+#include "threadpool.h"
+#include "recordio.h"
+#include "sink-partial.h"
 #include "config.h"
 
+#include <algorithm>
 #include <sstream>
 #include <iostream>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 namespace {
 	using ratesync::song_t;
@@ -29,9 +40,22 @@ namespace {
 	using ratesync::song_rating_t;
 	using ratesync::song_ratings_t;
 
-	void get_changes(const std::map<song_t, rating_t>& src_ratings,
+	inline bool add_change(const song_t& song, rating_t src_rating, rating_t dest_rating,
+						   ratesync::ChangeSet& dest_rating_change) {
+		if (src_rating == dest_rating) {
+			return true;
+		}
+		//update mpd rating
+		song_ratings_t srs;
+		srs.path = song;
+		srs.rating_old = dest_rating;
+		srs.rating_new = src_rating;
+		return dest_rating_change.Add(srs);
+	}
+
+	bool get_changes(const std::map<song_t, rating_t>& src_ratings,
 					 const std::map<song_t, rating_t>& dest_ratings,
-					 std::list<song_ratings_t>& dest_rating_change) {
+					 const ratesync::ISink& dest, ratesync::ChangeSet& dest_rating_change) {
 		//ignore files not listed in input
 		for (std::map<song_t, rating_t>::const_iterator
 				 it = src_ratings.begin(); it != src_ratings.end(); ++it) {
@@ -40,34 +64,260 @@ namespace {
 				dest_it = dest_ratings.find(song);
 			if (dest_it != dest_ratings.end()) {
 				//file exists, has a rating (or unrated)
-				rating_t src_rating = it->second,
-					dest_rating = dest_it->second;
-				if (src_rating != dest_rating) {
-					//update mpd rating
-					dest_rating_change.push_back(song_ratings_t());
-					song_ratings_t& srs = dest_rating_change.back();
-					srs.path = song;
-					srs.rating_old = dest_rating;
-					srs.rating_new = src_rating;
+				if (!add_change(song, it->second, dest_it->second, dest_rating_change)) {
+					return false;
+				}
+			} else if (dest.AddsSong(it->second) &&
+					   !add_change(song, it->second, ABSENT, dest_rating_change)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//Same as get_changes(), over two sorted streams.
+	bool get_changes(ratesync::RunMerger& src_ratings,
+					 ratesync::RunMerger& dest_ratings,
+					 const ratesync::ISink& dest, ratesync::ChangeSet& dest_rating_change) {
+		song_t src_song, dest_song;
+		rating_t src_rating, dest_rating;
+		bool src_ok = src_ratings.Next(src_song, src_rating),
+			dest_ok = dest_ratings.Next(dest_song, dest_rating);
+		while (src_ok && dest_ok) {
+			int cmp = src_song.compare(dest_song);
+			if (cmp < 0) {
+				if (dest.AddsSong(src_rating) &&
+					!add_change(src_song, src_rating, ABSENT, dest_rating_change)) {
+					return false;
+				}
+				src_ok = src_ratings.Next(src_song, src_rating);
+			} else if (cmp > 0) {
+				dest_ok = dest_ratings.Next(dest_song, dest_rating);
+			} else {
+				if (!add_change(src_song, src_rating, dest_rating, dest_rating_change)) {
+					return false;
+				}
+				src_ok = src_ratings.Next(src_song, src_rating);
+				dest_ok = dest_ratings.Next(dest_song, dest_rating);
+			}
+		}
+		while (src_ok) {
+			if (dest.AddsSong(src_rating) &&
+				!add_change(src_song, src_rating, ABSENT, dest_rating_change)) {
+				return false;
+			}
+			src_ok = src_ratings.Next(src_song, src_rating);
+		}
+		return !src_ratings.Failed() && !dest_ratings.Failed();
+	}
+
+	//One side of a three-way merge: the next song of a sorted stream.
+	struct stream_head_t {
+		stream_head_t(ratesync::RunMerger& merger) : merger(merger) {
+			advance();
+		}
+		void advance() {
+			ok = merger.Next(song, rating);
+		}
+		//Returns the rating of 'key' and moves past it if it's next,
+		//otherwise ABSENT.
+		rating_t take(const song_t& key) {
+			if (!ok || song != key) {
+				return ABSENT;
+			}
+			rating_t ret = rating;
+			advance();
+			return ret;
+		}
+		ratesync::RunMerger& merger;
+		song_t song;
+		rating_t rating;
+		bool ok;
+	};
+
+	//Keeps a uniform random sample of the songs listed (reservoir sampling),
+	//so the list never needs to be held in full.
+	class SampleOutput : public ratesync::ISongOutput {
+	public:
+		SampleOutput(size_t size) : size(size), seen(0) {
+			srand48(time(NULL) ^ getpid());
+		}
+		bool Put(const song_t& song, rating_t /*rating*/) {
+			++seen;
+			if (sample.size() < size) {
+				sample.push_back(song);
+			} else {
+				size_t i = (size_t)(drand48() * seen);
+				if (i < size) {
+					sample[i] = song;
 				}
 			}
+			return true;
 		}
+		size_t Seen() const { return seen; }
+		std::vector<song_t>& Sample() { return sample; }
+	private:
+		const size_t size;
+		size_t seen;
+		std::vector<song_t> sample;
+	};
+
+	//Wilson score interval for 'hits' out of 'n', at 95% confidence.
+	void wilson_interval(size_t hits, size_t n, double& low, double& high) {
+		const double z = 1.96;
+		const double p = (double)hits / n, z2n = z * z / n;
+		const double center = (p + z2n / 2) / (1 + z2n);
+		const double spread = z * sqrt(p * (1 - p) / n + z2n / (4 * n)) / (1 + z2n);
+		low = (center - spread > 0) ? center - spread : 0;
+		high = (center + spread < 1) ? center + spread : 1;
 	}
 }
 
+ratesync::Updater::~Updater() {
+	//never saved: the old baseline stays
+	delete next_baseline;
+}
+
 bool ratesync::Updater::Calculate() {
+	if (!baseline.empty()) {
+		return calculate_two_way();
+	}
+	if (max_memory > 0) {
+		return calculate_bounded();
+	}
+
 	std::map<song_t, rating_t> src_ratings, dest_ratings;
-	if (!src->Get(src_ratings) || !dest->Get(dest_ratings)) {
+	MapOutput src_map(src_ratings), dest_map(dest_ratings);
+	FingerprintOutput src_out(&src_map), dest_out(&dest_map);
+	if (!src->Get(src_out) || !dest->Get(dest_out)) {
 		return false;
 	}
+	src_fp = src_out.Fingerprint();
+	dest_fp = dest_out.Fingerprint();
 
-	get_changes(src_ratings, dest_ratings, dest_rating_change);
+	return get_changes(src_ratings, dest_ratings, *dest, dest_rating_change);
+}
 
-	return true;
+bool ratesync::Updater::calculate_bounded() {
+	//a third each for the two sinks and the changes
+	RunWriter src_runs(max_memory / 3), dest_runs(max_memory / 3);
+	FingerprintOutput src_out(&src_runs), dest_out(&dest_runs);
+	if (!src->Get(src_out) || !src_runs.Finish() ||
+		!dest->Get(dest_out) || !dest_runs.Finish()) {
+		return false;
+	}
+	src_fp = src_out.Fingerprint();
+	dest_fp = dest_out.Fingerprint();
+	config::debug("Merging %d+%d sorted runs",
+				  src_runs.Runs().size(), dest_runs.Runs().size());
+
+	RunMerger src_ratings(src_runs.Runs()), dest_ratings(dest_runs.Runs());
+	return get_changes(src_ratings, dest_ratings, *dest, dest_rating_change);
+}
+
+bool ratesync::Updater::calculate_two_way() {
+	//the sinks and the baseline are merged as sorted streams, as with a
+	//max_memory, while writing the next baseline
+	const size_t run_memory = (max_memory > 0) ? max_memory / 3 : (size_t)-1;
+	RunWriter src_runs(run_memory), dest_runs(run_memory);
+	FingerprintOutput src_out(&src_runs), dest_out(&dest_runs);
+	if (!src->Get(src_out) || !src_runs.Finish() ||
+		!dest->Get(dest_out) || !dest_runs.Finish()) {
+		return false;
+	}
+	src_fp = src_out.Fingerprint();
+	dest_fp = dest_out.Fingerprint();
+
+	std::vector<FILE*> base_files;
+	if (access(baseline.c_str(), F_OK) == 0) {
+		FILE* f = sink::open_partial(baseline);
+		if (f == NULL) {
+			return false;
+		}
+		base_files.push_back(f);
+	} else {
+		config::log("No baseline in %s yet, syncing one way where the ratings differ.",
+					baseline.c_str());
+	}
+	delete next_baseline;
+	next_baseline = new sink::PartialWriter(baseline);
+	bool ok = next_baseline->Open();
+
+	RunMerger src_ratings(src_runs.Runs()), dest_ratings(dest_runs.Runs()),
+		base_ratings(base_files);
+	stream_head_t src_head(src_ratings), dest_head(dest_ratings), base_head(base_ratings);
+	const bool writable = src->Writable();
+	while (ok && (src_head.ok || dest_head.ok || base_head.ok)) {
+		//the first song in any of them
+		const stream_head_t* first = NULL;
+		const stream_head_t* heads[] = { &src_head, &dest_head, &base_head };
+		for (size_t i = 0; i < 3; ++i) {
+			if (heads[i]->ok && (first == NULL || heads[i]->song < first->song)) {
+				first = heads[i];
+			}
+		}
+		const song_t song(first->song);
+		const rating_t s = src_head.take(song), d = dest_head.take(song),
+			b = base_head.take(song);
+
+		rating_t next = ABSENT;
+		if (s == ABSENT) {
+			//not seen in the source this time (eg outside the --subtree):
+			//remember it for as long as the destination has it
+			next = (d != ABSENT) ? b : ABSENT;
+		} else if (s == d) {
+			next = s;
+		} else if (d == ABSENT) {
+			if (dest->AddsSong(s)) {
+				ok = add_change(song, s, ABSENT, dest_rating_change);
+				next = s;
+			}
+		} else if (b == ABSENT || b == d) {
+			//changed in the source
+			ok = add_change(song, s, d, dest_rating_change);
+			next = s;
+		} else if (b == s) {
+			//changed in the destination
+			if (writable) {
+				ok = add_change(song, d, s, src_rating_change);
+				next = d;
+			} else {
+				config::debug("KEPT %s: %d in the destination", song.c_str(), d);
+				++kept;
+				next = b;
+			}
+		} else {
+			conflict_t conflict = { song, b, s, d };
+			conflicts.push_back(conflict);
+			next = b;
+		}
+		if (ok && next != ABSENT) {
+			ok = next_baseline->Put(song, next);
+		}
+	}
+	for (std::vector<FILE*>::iterator it = base_files.begin(); it != base_files.end(); ++it) {
+		fclose(*it);
+	}
+	ok = ok && !src_ratings.Failed() && !dest_ratings.Failed() && !base_ratings.Failed();
+
+	if (!conflicts.empty()) {
+		config::log("%d songs were rated on both sides since the last sync, leaving them:",
+					conflicts.size());
+		for (std::vector<conflict_t>::const_iterator
+				 it = conflicts.begin(); it != conflicts.end(); ++it) {
+			config::log("  %s: was %d, now %d in the source and %d in the destination",
+						it->path.c_str(), it->base, it->src, it->dest);
+		}
+	}
+	if (kept > 0) {
+		config::log("%d songs rated in the destination since the last sync are kept as they"
+					" are, the source can't store ratings.", kept);
+	}
+	return ok;
 }
 
 bool ratesync::Updater::HasChanges() const {
-	return !dest_rating_change.empty();
+	return !dest_rating_change.Empty() || !src_rating_change.Empty() || dest->Stale() > 0;
 }
 
 namespace {
@@ -75,6 +325,8 @@ namespace {
 		std::ostringstream oss;
 		if (rating == UNRATED) {
 			oss << "unrated";
+		} else if (rating == ABSENT) {
+			oss << "new";
 		} else {
 			oss << rating;
 		}
@@ -82,35 +334,358 @@ namespace {
 	}
 }
 
-void ratesync::Updater::Print() const {
-	if (dest_rating_change.empty()) {
-		config::log("No changes to be made.");
+void ratesync::Updater::Print() {
+	if (!src_rating_change.Empty()) {
+		size_t i = 0, size = src_rating_change.Size();
+		config::log("%d songs rated in the destination, to copy back to the source", size);
+		song_ratings_t change;
+		src_rating_change.Rewind();
+		while (src_rating_change.Next(change)) {
+			config::log("  %d/%d %s: %s -> %s",
+						++i, size, change.path.c_str(),
+						str(change.rating_old).c_str(),
+						str(change.rating_new).c_str());
+		}
+	}
+	if (dest_rating_change.Empty()) {
+		if (src_rating_change.Empty() && dest->Stale() == 0) {
+			config::log("No changes to be made.");
+		}
 	} else {
-		size_t i = 0, size = dest_rating_change.size();
+		size_t i = 0, size = dest_rating_change.Size();
 		config::log("%d songs out of sync", size);
-		for (std::list<song_ratings_t>::const_iterator
-				 iter = dest_rating_change.begin();
-			 iter != dest_rating_change.end(); iter++) {
-			config::log("  %d/%d %s: %d -> %d",
-						i++, size, iter->path.c_str(),
-						str(iter->rating_old).c_str(),
-						str(iter->rating_new).c_str());
+		song_ratings_t change;
+		dest_rating_change.Rewind();
+		while (dest_rating_change.Next(change)) {
+			config::log("  %d/%d %s: %s -> %s",
+						++i, size, change.path.c_str(),
+						str(change.rating_old).c_str(),
+						str(change.rating_new).c_str());
+		}
+	}
+	if (dest->Stale() > 0) {
+		config::log("%d songs are gone from the music dir and will be removed", dest->Stale());
+	}
+}
+
+namespace {
+	//changes per task, keeps huge directories from being applied serially
+	const size_t MAX_SHARD = 1024;
+
+	struct shard_result_t {
+		std::string dir;
+		size_t songs, failed;
+	};
+
+	class ShardTask : public ratesync::ITask {
+	public:
+		ShardTask(ratesync::ISink* sink, const std::string& dir,
+				  std::vector<song_ratings_t>& take_songs, ratesync::ConcurrencyLimit& limit,
+				  std::vector<shard_result_t>& failures, pthread_mutex_t& mutex)
+			: sink(sink), dir(dir), limit(limit), failures(failures), mutex(mutex) {
+			songs.swap(take_songs);
+		}
+
+		void Run() {
+			double start = limit.Acquire();
+			size_t failed = sink->SetShard(songs);
+			limit.Release(start, songs.size());
+			for (std::vector<song_ratings_t>::const_iterator
+					 iter = songs.begin(); iter != songs.end(); ++iter) {
+				ratesync::config::debug("SET %s: %s -> %s",
+										iter->path.c_str(),
+										str(iter->rating_old).c_str(),
+										str(iter->rating_new).c_str());
+			}
+			if (failed > 0) {
+				shard_result_t result;
+				result.dir = dir;
+				result.songs = songs.size();
+				result.failed = failed;
+				ratesync::Lock lock(mutex);
+				failures.push_back(result);
+			}
+		}
+
+	private:
+		ratesync::ISink* sink;
+		const std::string dir;
+		std::vector<song_ratings_t> songs;
+		ratesync::ConcurrencyLimit& limit;
+		std::vector<shard_result_t>& failures;
+		pthread_mutex_t& mutex;
+	};
+
+	inline std::string song_dir(const song_t& song) {
+		size_t sep = song.find_last_of(SEP);
+		return (sep == std::string::npos) ? "" : song.substr(0, sep);
+	}
+}
+
+bool ratesync::Updater::apply(ISink* sink, ChangeSet& changes) {
+	if (!changes.Rewind()) {
+		return false;
+	}
+
+	//changes are sorted by song, so songs in the same directory arrive
+	//together and can be grouped into shards as they're read
+	const bool parallel = (jobs > 1 && sink->ThreadSafe());
+	std::vector<shard_result_t> failures;
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, NULL);
+	ConcurrencyLimit limit(cpu_count(), parallel ? jobs : 1, parallel && adaptive);
+	{
+		ThreadPool pool(parallel ? jobs : 0);
+		std::vector<song_ratings_t> shard;
+		std::string shard_dir;
+		song_ratings_t change;
+		while (changes.Next(change)) {
+			std::string dir = song_dir(change.path);
+			if (!shard.empty() && (dir != shard_dir || shard.size() >= MAX_SHARD)) {
+				pool.Add(new ShardTask(sink, shard_dir, shard, limit, failures, mutex));
+				shard.clear();
+			}
+			shard_dir.swap(dir);
+			shard.push_back(change);
+		}
+		if (!shard.empty()) {
+			pool.Add(new ShardTask(sink, shard_dir, shard, limit, failures, mutex));
 		}
+		pool.Wait();
 	}
+	pthread_mutex_destroy(&mutex);
+	limit.Report("Apply");
+
+	for (std::vector<shard_result_t>::const_iterator
+			 iter = failures.begin(); iter != failures.end(); ++iter) {
+		config::error("%s: %d of %d changes failed",
+					  iter->dir.empty() ? "." : iter->dir.c_str(),
+					  iter->failed, iter->songs);
+	}
+	if (!sink->Commit()) {
+		return false;
+	}
+	return failures.empty() && !changes.Failed();
 }
 
 bool ratesync::Updater::Apply() {
-	for (std::list<song_ratings_t>::const_iterator
-			 iter = dest_rating_change.begin();
-		 iter != dest_rating_change.end(); iter++) {
-		if (!dest->Set(*iter)) {
+	bool ok = apply(dest, dest_rating_change);
+	if (!src_rating_change.Empty()) {
+		ok = apply(src, src_rating_change) && ok;
+	}
+	//the baseline is only moved on once both sides have it
+	return ok && SaveBaseline();
+}
+
+bool ratesync::Updater::SaveBaseline() {
+	if (next_baseline == NULL) {
+		return true;
+	}
+	bool ok = next_baseline->Commit();
+	delete next_baseline;
+	next_baseline = NULL;
+	return ok;
+}
+
+namespace {
+	//bump the trailing digit if the format changes
+	const char CHANGE_MAGIC[] = "RSCHNG2\n";
+	const size_t CHANGE_MAGIC_LEN = sizeof(CHANGE_MAGIC) - 1;
+
+	bool write_fingerprint(FILE* f, const ratesync::fingerprint_t& fp) {
+		return ratesync::record::write_uint(f, fp.digest) &&
+			ratesync::record::write_uint(f, fp.count);
+	}
+	bool read_fingerprint(FILE* f, ratesync::fingerprint_t& fp) {
+		unsigned long long digest, count;
+		if (!ratesync::record::read_uint(f, digest) ||
+			!ratesync::record::read_uint(f, count)) {
 			return false;
 		}
-		config::debug("SET %s: %d -> %d",
-					  iter->path.c_str(),
-					  str(iter->rating_old).c_str(),
-					  str(iter->rating_new).c_str());
+		fp.digest = digest;
+		fp.count = count;
+		return true;
+	}
+
+	//Opens a change file and reads its header, leaving 'f' at the fingerprints.
+	FILE* open_changes(const std::string& path, std::vector<std::string>& dest_desc) {
+		FILE* f = fopen(path.c_str(), "rb");
+		if (f == NULL) {
+			ratesync::config::error("Unable to open change file %s", path.c_str());
+			return NULL;
+		}
+		char magic[CHANGE_MAGIC_LEN];
+		unsigned long long desc_size;
+		if (fread(magic, 1, CHANGE_MAGIC_LEN, f) != CHANGE_MAGIC_LEN ||
+			memcmp(magic, CHANGE_MAGIC, CHANGE_MAGIC_LEN) != 0 ||
+			!ratesync::record::read_uint(f, desc_size)) {
+			ratesync::config::error("%s is not a change file (or from another version)",
+									path.c_str());
+			fclose(f);
+			return NULL;
+		}
+		dest_desc.resize(desc_size);
+		for (size_t i = 0; i < desc_size; ++i) {
+			if (!ratesync::record::read_string(f, dest_desc[i])) {
+				ratesync::config::error("Unable to read change file %s", path.c_str());
+				fclose(f);
+				return NULL;
+			}
+		}
+		return f;
+	}
+}
+
+bool ratesync::read_change_desc(const std::string& path, std::vector<std::string>& dest_desc) {
+	FILE* f = open_changes(path, dest_desc);
+	if (f == NULL) {
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+bool ratesync::Updater::Export(const std::string& path,
+							   const std::vector<std::string>& dest_desc) {
+	if (!dest_rating_change.Rewind()) {
+		return false;
+	}
+	//write to a temp file first, so a failed export can't be applied
+	const std::string tmp_path = path + ".tmp";
+	FILE* f = fopen(tmp_path.c_str(), "wb");
+	if (f == NULL) {
+		config::error("Unable to create change file %s", tmp_path.c_str());
+		return false;
+	}
+	bool ok = fwrite(CHANGE_MAGIC, 1, CHANGE_MAGIC_LEN, f) == CHANGE_MAGIC_LEN &&
+		record::write_uint(f, dest_desc.size());
+	for (size_t i = 0; ok && i < dest_desc.size(); ++i) {
+		ok = record::write_string(f, dest_desc[i]);
+	}
+	ok = ok && write_fingerprint(f, src_fp) && write_fingerprint(f, dest_fp) &&
+		record::write_uint(f, dest_rating_change.Size());
+	//followed by the paths of changed songs that aren't their own key
+	const SongPaths* paths = (src != NULL) ? src->Paths() : NULL;
+	std::vector<std::pair<song_t, std::string> > renamed;
+	song_ratings_t change;
+	std::string relpath;
+	while (ok && dest_rating_change.Next(change)) {
+		ok = record::write_change(f, change);
+		if (paths != NULL && paths->Find(change.path, relpath)) {
+			renamed.push_back(std::make_pair(change.path, relpath));
+		}
+	}
+	ok = ok && !dest_rating_change.Failed() && record::write_uint(f, renamed.size());
+	for (size_t i = 0; ok && i < renamed.size(); ++i) {
+		ok = record::write_string(f, renamed[i].first) &&
+			record::write_string(f, renamed[i].second);
+	}
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		config::error("Unable to write change file %s", path.c_str());
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool ratesync::Updater::Import(const std::string& path) {
+	std::vector<std::string> dest_desc;
+	FILE* f = open_changes(path, dest_desc);
+	if (f == NULL) {
+		return false;
+	}
+	unsigned long long size;
+	bool ok = read_fingerprint(f, src_fp) && read_fingerprint(f, dest_fp) &&
+		record::read_uint(f, size);
+	song_ratings_t change;
+	for (unsigned long long i = 0; ok && i < size; ++i) {
+		ok = record::read_change(f, change) && dest_rating_change.Add(change);
+	}
+	ok = ok && record::read_uint(f, size);
+	std::string key, relpath;
+	for (unsigned long long i = 0; ok && i < size; ++i) {
+		ok = record::read_string(f, key) && record::read_string(f, relpath);
+		if (ok) {
+			imported_paths.Add(key, relpath);
+		}
+	}
+	fclose(f);
+	dest->SetPaths(&imported_paths);
+	if (!ok) {
+		config::error("Unable to read change file %s, is it truncated?", path.c_str());
+		return false;
+	}
+	config::debug("Loaded %d changes (source: %d songs, digest %016llx)",
+				  dest_rating_change.Size(), (size_t)src_fp.count,
+				  (unsigned long long)src_fp.digest);
+	return true;
+}
+
+bool ratesync::Updater::CheckDest(bool& unchanged) {
+	FingerprintOutput out;
+	if (!dest->Get(out)) {
+		return false;
+	}
+	unchanged = (out.Fingerprint() == dest_fp);
+	if (!unchanged) {
+		config::debug("Destination fingerprint: %d songs, digest %016llx (was %d, %016llx)",
+					  (size_t)out.Fingerprint().count,
+					  (unsigned long long)out.Fingerprint().digest,
+					  (size_t)dest_fp.count, (unsigned long long)dest_fp.digest);
+	}
+	return true;
+}
+
+bool ratesync::Updater::Sample(size_t sample_size, drift_t& out) {
+	SampleOutput sampler(sample_size);
+	if (!src->List(sampler)) {
+		config::error("Unable to list source songs.");
+		return false;
 	}
+	std::vector<song_t>& sample = sampler.Sample();
+	std::sort(sample.begin(), sample.end());
+	config::debug("Sampled %d of %d songs", sample.size(), sampler.Seen());
 
+	std::map<song_t, rating_t> src_ratings, dest_ratings;
+	MapOutput src_out(src_ratings), dest_out(dest_ratings);
+	if (!src->GetSongs(sample, src_out)) {
+		config::error("Unable to read sampled source songs.");
+		return false;
+	}
+	if (!dest->GetSongs(sample, dest_out)) {
+		config::error("Unable to read sampled destination songs.");
+		return false;
+	}
+
+	//same rules as Calculate: songs that vanished from the source since
+	//they were listed are left out of the sample
+	out = drift_t();
+	out.population = sampler.Seen();
+	for (std::map<song_t, rating_t>::const_iterator
+			 it = src_ratings.begin(); it != src_ratings.end(); ++it) {
+		++out.sampled;
+		std::map<song_t, rating_t>::const_iterator dest_it = dest_ratings.find(it->first);
+		if (dest_it != dest_ratings.end()) {
+			if (dest_it->second != it->second) {
+				config::debug("DRIFT %s: %d -> %d", it->first.c_str(),
+							  dest_it->second, it->second);
+				++out.drifted;
+			}
+		} else if (dest->AddsSong(it->second)) {
+			config::debug("DRIFT %s: missing -> %d", it->first.c_str(), it->second);
+			++out.drifted;
+		}
+	}
+	if (out.sampled == 0) {
+		return true;
+	}
+	out.rate = (double)out.drifted / out.sampled;
+	if (out.sampled >= out.population) {
+		out.low = out.high = out.rate;//compared everything
+	} else {
+		wilson_interval(out.drifted, out.sampled, out.low, out.high);
+	}
 	return true;
 }
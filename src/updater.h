@@ -19,23 +19,109 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <list>
+#include <string>
+#include <vector>
 
+#include "changeset.h"
 #include "sink.h"
 
 namespace ratesync {
+	namespace sink {
+		class PartialWriter;
+	}
+
+	//Reads the destination description stored by Updater::Export, so that
+	//the destination can be reopened before calling Updater::Import.
+	bool read_change_desc(const std::string& path, std::vector<std::string>& dest_desc);
+
+	//The result of Updater::Sample.
+	struct drift_t {
+		drift_t() : population(0), sampled(0), drifted(0), rate(0), low(0), high(0) { }
+		//songs in the source, how many of them were compared, and how many
+		//of those would be changed by a sync
+		size_t population, sampled, drifted;
+		//estimated fraction of the source that's out of sync, with a 95%
+		//confidence interval
+		double rate, low, high;
+	};
+
 	class Updater {
 	public:
-	Updater(ISink* src, ISink* dest) : src(src), dest(dest) { }
+		//With a 'max_memory' (in bytes), both sinks are spilled to sorted
+		//runs on disk and merged, and the changes are spilled as well, so that
+		//memory use stays bounded regardless of the number of songs.
+		//Changes are applied a directory at a time, on up to 'jobs' threads
+		//if the destination supports it. With 'adaptive', the number of
+		//those running at once is tuned as they go (see ConcurrencyLimit).
+		Updater(ISink* src, ISink* dest, size_t max_memory = 0, size_t jobs = 1,
+				bool adaptive = false)
+			: src(src), dest(dest), max_memory(max_memory), jobs(jobs), adaptive(adaptive),
+			  dest_rating_change(max_memory / 3), src_rating_change(max_memory / 3),
+			  next_baseline(NULL), kept(0) {
+			//so that the destination finds songs renamed by normalization
+			if (src != NULL) {
+				dest->SetPaths(src->Paths());
+			}
+		}
+		~Updater();
+
+		//Switches to a two-way sync against the ratings both sinks had
+		//after the last one, kept in 'path' (a partial file). Songs changed
+		//on one side since are changed on the other (if the source is
+		//Writable, otherwise they're kept as they are in the destination),
+		//and songs changed on both are conflicts which are left alone.
+		//Songs without a baseline yet are synced one way, like before.
+		void SetBaseline(const std::string& path) { baseline = path; }
 
 		bool Calculate();
 		bool HasChanges() const;
-		void Print() const;
+		void Print();
 		bool Apply();
 
+		//Writes the calculated changes to 'path' along with fingerprints
+		//of both sinks, the on-disk paths of changed songs (see SongPaths)
+		//and 'dest_desc', which describes how to reopen the destination
+		//(only interpreted by the caller).
+		bool Export(const std::string& path, const std::vector<std::string>& dest_desc);
+		//Loads changes written by Export, in place of calling Calculate.
+		bool Import(const std::string& path);
+		//Re-reads the destination and checks whether it's 'unchanged' since
+		//the changes were calculated. This also prepares it for Apply.
+		bool CheckDest(bool& unchanged);
+
+		//Estimates how much of the destination is out of sync by comparing
+		//the ratings of 'sample_size' songs picked at random from the source,
+		//without reading the rest.
+		bool Sample(size_t sample_size, drift_t& out);
+
+		//With a baseline, stores the new one once the changes are applied
+		//(or if there were none). Apply does this too.
+		bool SaveBaseline();
+
 	private:
+		Updater(const Updater&);//disallow copy
+		bool calculate_bounded();
+		bool calculate_two_way();
+		bool apply(ISink* sink, ChangeSet& changes);
+
 		ISink *src, *dest;
-		std::list<song_ratings_t> dest_rating_change;
+		fingerprint_t src_fp, dest_fp;
+		const size_t max_memory, jobs;
+		const bool adaptive;
+		ChangeSet dest_rating_change;
+		//the song paths read by Import
+		SongPaths imported_paths;
+
+		//two-way sync state
+		struct conflict_t {
+			song_t path;
+			rating_t base, src, dest;
+		};
+		std::string baseline;
+		ChangeSet src_rating_change;
+		sink::PartialWriter* next_baseline;
+		std::vector<conflict_t> conflicts;
+		size_t kept;
 	};
 }
 